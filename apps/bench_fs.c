@@ -0,0 +1,640 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_format.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Size of a disk block, mirrors BLOCK_SIZE from disk.h */
+#define BENCH_BLOCK_SIZE 4096
+
+/* Maximum number of results a single run (or a baseline file) can hold */
+#define MAX_RESULTS 128
+
+/* Default regression threshold for the compare mode, in percent */
+#define DEFAULT_THRESHOLD 10.0
+
+static const size_t io_sizes[] = { 512, 4096, 16384, 65536 };
+static const int mount_sizes[] = { 128, 1024, 4096, 8192, 65536, 1048576 };
+
+/* Image formats every benchmark runs on */
+static const struct format {
+	/* Options given to the formatter */
+	const char *options;
+	/* Appended to the result names, empty for the original format */
+	const char *suffix;
+	/* Largest image the formatter accepts */
+	int max_blocks;
+} formats[] = {
+	{ "-F 16",	"",		FS_MAX_DATA_BLOCKS_V1 },
+	{ "-F 32",	"_fat32",	FS_MAX_DATA_BLOCKS_V2 },
+	{ "-F 32 -c 8",	"_fat32_c8",	FS_MAX_DATA_BLOCKS_V2 },
+};
+
+struct result {
+	char name[64];
+	char unit[16];
+	double value;
+	/* 1 if a larger value is better (throughput), 0 if smaller is better */
+	int higher_better;
+};
+
+struct bench_config {
+	const char *mkfs;
+	const char *outfile;
+	char workdir[PATH_MAX];
+	size_t file_size;
+	int reps;
+	unsigned int seed;
+};
+
+static struct result results[MAX_RESULTS];
+static int result_count;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_result(const char *name, const char *unit, double value,
+		       int higher_better)
+{
+	struct result *r;
+
+	if (result_count == MAX_RESULTS)
+		die("too many results");
+
+	r = &results[result_count++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	snprintf(r->unit, sizeof(r->unit), "%s", unit);
+	r->value = value;
+	r->higher_better = higher_better;
+
+	fprintf(stderr, "  %-24s %12.2f %s\n", name, value, unit);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Median of @n samples (sorts @samples in place) */
+static double median(double *samples, int n)
+{
+	qsort(samples, n, sizeof(double), cmp_double);
+	if (n % 2)
+		return samples[n / 2];
+	return (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+/*
+ * Image helpers
+ */
+static void make_image(struct bench_config *cfg, const char *path,
+		       const struct format *format, int data_blocks)
+{
+	char cmd[PATH_MAX * 2 + 64];
+
+	if (data_blocks > format->max_blocks)
+		data_blocks = format->max_blocks;
+
+	unlink(path);
+	snprintf(cmd, sizeof(cmd), "%s %s '%s' %d >/dev/null", cfg->mkfs,
+		 format->options, path, data_blocks);
+	if (system(cmd))
+		die("cannot create image '%s' with '%s'", path, cfg->mkfs);
+}
+
+static void bench_mount(const char *path)
+{
+	if (fs_mount(path))
+		die("cannot mount '%s'", path);
+}
+
+static void bench_umount(void)
+{
+	if (fs_umount())
+		die("cannot unmount");
+}
+
+static int bench_open(const char *filename)
+{
+	int fd = fs_open(filename);
+
+	if (fd < 0)
+		die("cannot open '%s'", filename);
+	return fd;
+}
+
+/* Number of data blocks of an image holding the file, with some spare ones */
+static int data_image_blocks(struct bench_config *cfg)
+{
+	return cfg->file_size / BENCH_BLOCK_SIZE + 16;
+}
+
+/* Image holding one file of @cfg->file_size bytes */
+static void make_data_image(struct bench_config *cfg, const char *path,
+			    const struct format *format)
+{
+	make_image(cfg, path, format, data_image_blocks(cfg));
+	bench_mount(path);
+	if (fs_create("bench"))
+		die("cannot create file");
+	bench_umount();
+}
+
+static void fill_pattern(char *buf, size_t len, unsigned int seed)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = 'a' + (seed + i) % 26;
+}
+
+/*
+ * Sequential I/O: stream the whole file in @io_size chunks
+ */
+static double seq_io(struct bench_config *cfg, int fd, size_t io_size,
+		     char *buf, int is_write)
+{
+	double start, elapsed;
+
+	if (fs_lseek(fd, 0))
+		die("cannot rewind");
+
+	start = now();
+	for (size_t done = 0; done < cfg->file_size; done += io_size) {
+		int ret;
+
+		if (is_write)
+			ret = fs_write(fd, buf, io_size);
+		else
+			ret = fs_read(fd, buf, io_size);
+		if (ret != (int)io_size)
+			die("short %s at offset %zu", is_write ? "write" : "read",
+			    done);
+	}
+	elapsed = now() - start;
+
+	return cfg->file_size / elapsed / (1024 * 1024);
+}
+
+/*
+ * Random I/O: @io_size-aligned accesses within the (already written) file
+ */
+static double rand_io(struct bench_config *cfg, int fd, size_t io_size,
+		      char *buf, int is_write)
+{
+	size_t slots = cfg->file_size / io_size;
+	size_t ops = slots;
+	unsigned int seed = cfg->seed;
+	double start, elapsed;
+
+	start = now();
+	for (size_t i = 0; i < ops; i++) {
+		size_t offset = (rand_r(&seed) % slots) * io_size;
+		int ret;
+
+		if (fs_lseek(fd, offset))
+			die("cannot seek to %zu", offset);
+		if (is_write)
+			ret = fs_write(fd, buf, io_size);
+		else
+			ret = fs_read(fd, buf, io_size);
+		if (ret != (int)io_size)
+			die("short %s at offset %zu", is_write ? "write" : "read",
+			    offset);
+	}
+	elapsed = now() - start;
+
+	return ops / elapsed;
+}
+
+static void run_io(struct bench_config *cfg, const struct format *format)
+{
+	char path[PATH_MAX + 16];
+	double samples[4][cfg->reps];
+	char name[64];
+	char *buf;
+
+	/* The original format cannot hold files that large */
+	if (data_image_blocks(cfg) > format->max_blocks)
+		return;
+
+	snprintf(path, sizeof(path), "%s/io.fs", cfg->workdir);
+
+	for (size_t s = 0; s < ARRAY_SIZE(io_sizes); s++) {
+		size_t io_size = io_sizes[s];
+
+		buf = malloc(io_size);
+		if (!buf)
+			die_perror("malloc");
+		fill_pattern(buf, io_size, s);
+
+		/*
+		 * Each repetition starts from a fresh image; the file is first
+		 * streamed in, then read back and accessed randomly within the
+		 * same mount.
+		 */
+		for (int r = 0; r < cfg->reps; r++) {
+			int fd;
+
+			make_data_image(cfg, path, format);
+			bench_mount(path);
+			fd = bench_open("bench");
+			samples[0][r] = seq_io(cfg, fd, io_size, buf, 1);
+			samples[1][r] = seq_io(cfg, fd, io_size, buf, 0);
+			samples[2][r] = rand_io(cfg, fd, io_size, buf, 0);
+			samples[3][r] = rand_io(cfg, fd, io_size, buf, 1);
+			fs_close(fd);
+			bench_umount();
+		}
+
+		snprintf(name, sizeof(name), "seq_write_%zu%s", io_size,
+			 format->suffix);
+		add_result(name, "MiB/s", median(samples[0], cfg->reps), 1);
+		snprintf(name, sizeof(name), "seq_read_%zu%s", io_size,
+			 format->suffix);
+		add_result(name, "MiB/s", median(samples[1], cfg->reps), 1);
+		snprintf(name, sizeof(name), "rand_read_%zu%s", io_size,
+			 format->suffix);
+		add_result(name, "ops/s", median(samples[2], cfg->reps), 1);
+		snprintf(name, sizeof(name), "rand_write_%zu%s", io_size,
+			 format->suffix);
+		add_result(name, "ops/s", median(samples[3], cfg->reps), 1);
+
+		free(buf);
+	}
+
+	unlink(path);
+}
+
+/*
+ * Metadata: create/delete and open/close rates
+ */
+static void run_meta(struct bench_config *cfg, const struct format *format)
+{
+	char path[PATH_MAX + 16];
+	double create_samples[cfg->reps], open_samples[cfg->reps];
+	char filename[FS_FILENAME_LEN];
+	char name[64];
+	const int rounds = 16;
+	const int opens = 20000;
+	double start;
+
+	snprintf(path, sizeof(path), "%s/meta.fs", cfg->workdir);
+	make_image(cfg, path, format, 128);
+
+	for (int r = 0; r < cfg->reps; r++) {
+		bench_mount(path);
+
+		start = now();
+		for (int round = 0; round < rounds; round++) {
+			for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+				snprintf(filename, sizeof(filename), "f%d", i);
+				if (fs_create(filename))
+					die("cannot create '%s'", filename);
+			}
+			for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+				snprintf(filename, sizeof(filename), "f%d", i);
+				if (fs_delete(filename))
+					die("cannot delete '%s'", filename);
+			}
+		}
+		create_samples[r] = 2.0 * rounds * FS_FILE_MAX_COUNT /
+			(now() - start);
+
+		if (fs_create("open"))
+			die("cannot create file");
+		start = now();
+		for (int i = 0; i < opens; i++) {
+			int fd = bench_open("open");
+
+			if (fs_close(fd))
+				die("cannot close");
+		}
+		open_samples[r] = opens / (now() - start);
+		if (fs_delete("open"))
+			die("cannot delete file");
+
+		bench_umount();
+	}
+
+	snprintf(name, sizeof(name), "create_delete%s", format->suffix);
+	add_result(name, "ops/s", median(create_samples, cfg->reps), 1);
+	snprintf(name, sizeof(name), "open_close%s", format->suffix);
+	add_result(name, "ops/s", median(open_samples, cfg->reps), 1);
+
+	unlink(path);
+}
+
+/*
+ * Mount time versus image size, and fs_info() cost
+ */
+static void run_mount(struct bench_config *cfg, const struct format *format)
+{
+	char path[PATH_MAX + 16];
+	char name[64];
+	const int mounts = 200;
+	const int infos = 200;
+	double samples[cfg->reps];
+	double start;
+	int saved_stdout, devnull;
+
+	snprintf(path, sizeof(path), "%s/mount.fs", cfg->workdir);
+
+	for (size_t s = 0; s < ARRAY_SIZE(mount_sizes); s++) {
+		if (mount_sizes[s] > format->max_blocks)
+			continue;
+		make_image(cfg, path, format, mount_sizes[s]);
+
+		for (int r = 0; r < cfg->reps; r++) {
+			start = now();
+			for (int i = 0; i < mounts; i++) {
+				bench_mount(path);
+				bench_umount();
+			}
+			samples[r] = (now() - start) / mounts * 1e6;
+		}
+		snprintf(name, sizeof(name), "mount_%d%s", mount_sizes[s],
+			 format->suffix);
+		add_result(name, "us", median(samples, cfg->reps), 0);
+	}
+
+	/* fs_info() prints, so silence stdout while timing it */
+	fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	devnull = open("/dev/null", O_WRONLY);
+	if (saved_stdout < 0 || devnull < 0)
+		die_perror("dup");
+
+	bench_mount(path);
+	for (int r = 0; r < cfg->reps; r++) {
+		dup2(devnull, STDOUT_FILENO);
+		start = now();
+		for (int i = 0; i < infos; i++)
+			fs_info();
+		fflush(stdout);
+		samples[r] = (now() - start) / infos * 1e6;
+		dup2(saved_stdout, STDOUT_FILENO);
+	}
+	bench_umount();
+
+	close(devnull);
+	close(saved_stdout);
+	snprintf(name, sizeof(name), "fs_info%s", format->suffix);
+	add_result(name, "us", median(samples, cfg->reps), 0);
+
+	unlink(path);
+}
+
+/*
+ * JSON output
+ */
+static void write_json(FILE *f, struct bench_config *cfg)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"benchmark\": \"bench_fs\",\n");
+	fprintf(f, "  \"file_size\": %zu,\n", cfg->file_size);
+	fprintf(f, "  \"reps\": %d,\n", cfg->reps);
+	fprintf(f, "  \"results\": [\n");
+	for (int i = 0; i < result_count; i++) {
+		fprintf(f, "    {\"name\": \"%s\", \"value\": %.3f, "
+			"\"unit\": \"%s\", \"better\": \"%s\"}%s\n",
+			results[i].name, results[i].value, results[i].unit,
+			results[i].higher_better ? "higher" : "lower",
+			i + 1 < result_count ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+/*
+ * Minimal reader for the JSON files produced above: every result object
+ * sits on its own line, so scanning line by line for the keys is enough.
+ */
+static int json_string(const char *line, const char *key, char *out,
+		       size_t len)
+{
+	char pattern[32];
+	const char *p, *end;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+	p = strstr(line, pattern);
+	if (!p)
+		return -1;
+	p += strlen(pattern);
+	end = strchr(p, '"');
+	if (!end || (size_t)(end - p) >= len)
+		return -1;
+	memcpy(out, p, end - p);
+	out[end - p] = '\0';
+	return 0;
+}
+
+static int read_json(const char *filename, struct result *out)
+{
+	char line[512], better[16];
+	FILE *f;
+	int n = 0;
+
+	f = fopen(filename, "r");
+	if (!f)
+		die_perror(filename);
+
+	while (fgets(line, sizeof(line), f) && n < MAX_RESULTS) {
+		const char *value = strstr(line, "\"value\": ");
+
+		if (!value || json_string(line, "name", out[n].name,
+					  sizeof(out[n].name)))
+			continue;
+		out[n].value = strtod(value + strlen("\"value\": "), NULL);
+		if (json_string(line, "unit", out[n].unit, sizeof(out[n].unit)))
+			out[n].unit[0] = '\0';
+		if (json_string(line, "better", better, sizeof(better)))
+			die("%s: result '%s' has no direction", filename,
+			    out[n].name);
+		out[n].higher_better = !strcmp(better, "higher");
+		n++;
+	}
+
+	fclose(f);
+	return n;
+}
+
+static int compare(const char *baseline, const char *current,
+		   double threshold)
+{
+	struct result base[MAX_RESULTS], cur[MAX_RESULTS];
+	int nbase, ncur, regressions = 0;
+
+	nbase = read_json(baseline, base);
+	ncur = read_json(current, cur);
+
+	printf("%-24s %12s %12s %9s\n", "benchmark", "baseline", "current",
+	       "change");
+	for (int i = 0; i < nbase; i++) {
+		struct result *c = NULL;
+		double change;
+		int regressed;
+
+		for (int j = 0; j < ncur; j++) {
+			if (!strcmp(base[i].name, cur[j].name)) {
+				c = &cur[j];
+				break;
+			}
+		}
+		if (!c) {
+			printf("%-24s %12.2f %12s %9s  MISSING\n", base[i].name,
+			       base[i].value, "-", "-");
+			regressions++;
+			continue;
+		}
+
+		change = base[i].value ?
+			(c->value - base[i].value) / base[i].value * 100 : 0;
+		if (base[i].higher_better)
+			regressed = change < -threshold;
+		else
+			regressed = change > threshold;
+		regressions += regressed;
+
+		printf("%-24s %12.2f %12.2f %+8.1f%%%s\n", base[i].name,
+		       base[i].value, c->value, change,
+		       regressed ? "  REGRESSION" : "");
+	}
+
+	printf("%d regression(s) beyond %.1f%%\n", regressions, threshold);
+	return regressions ? 1 : 0;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"Usage: %s run [-o <out.json>] [-s <file size>] [-r <reps>]\n"
+		"\t\t[-m <fs_make>] [-d <workdir>] [-S <seed>]\n"
+		"       %s compare <baseline.json> <current.json> "
+		"[<threshold %%>]\n", program, program);
+	exit(1);
+}
+
+static int bench_run(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.mkfs = "./fs_make.x",
+		.file_size = 1024 * 1024,
+		.reps = 3,
+		.seed = 150,
+	};
+	const char *tmpdir = getenv("TMPDIR");
+	/* File sizes are 32-bit */
+	size_t max_size = UINT32_MAX;
+	FILE *out = stdout;
+	int opt;
+
+	snprintf(cfg.workdir, sizeof(cfg.workdir), "%s/bench_fs.XXXXXX",
+		 tmpdir ? tmpdir : "/tmp");
+
+	while ((opt = getopt(argc, argv, "o:s:r:m:d:S:")) != -1) {
+		switch (opt) {
+		case 'o':
+			cfg.outfile = optarg;
+			break;
+		case 's':
+			cfg.file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.reps = atoi(optarg);
+			break;
+		case 'm':
+			cfg.mkfs = optarg;
+			break;
+		case 'd':
+			snprintf(cfg.workdir, sizeof(cfg.workdir),
+				 "%s/bench_fs.XXXXXX", optarg);
+			break;
+		case 'S':
+			cfg.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* The file must hold a whole number of the largest I/O size */
+	cfg.file_size -= cfg.file_size % io_sizes[ARRAY_SIZE(io_sizes) - 1];
+	if (cfg.file_size == 0 || cfg.file_size > max_size)
+		die("file size must be in [%zu, %zu]",
+		    io_sizes[ARRAY_SIZE(io_sizes) - 1], max_size);
+	if (cfg.reps < 1)
+		die("need at least one repetition");
+
+	if (!mkdtemp(cfg.workdir))
+		die_perror("mkdtemp");
+
+	fprintf(stderr, "bench_fs: file size %zu bytes, %d rep(s)\n",
+		cfg.file_size, cfg.reps);
+	for (size_t f = 0; f < ARRAY_SIZE(formats); f++) {
+		fprintf(stderr, "image format '%s'\n", formats[f].options);
+		run_io(&cfg, &formats[f]);
+		run_meta(&cfg, &formats[f]);
+		run_mount(&cfg, &formats[f]);
+	}
+
+	rmdir(cfg.workdir);
+
+	if (cfg.outfile) {
+		out = fopen(cfg.outfile, "w");
+		if (!out)
+			die_perror(cfg.outfile);
+	}
+	write_json(out, &cfg);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage(argv[0]);
+
+	if (!strcmp(argv[1], "run"))
+		return bench_run(argc - 1, argv + 1);
+
+	if (!strcmp(argv[1], "compare")) {
+		if (argc < 4)
+			usage(argv[0]);
+		return compare(argv[2], argv[3],
+			       argc > 4 ? atof(argv[4]) : DEFAULT_THRESHOLD);
+	}
+
+	usage(argv[0]);
+	return 1;
+}
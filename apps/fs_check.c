@@ -0,0 +1,1407 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fs_format.h>
+
+#define check_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	check_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define USAGE "Usage: [-r] [-j <threads>] <diskname>"
+
+#define EOC FS_FAT_EOC_V2
+
+/* Largest number of threads */
+#define MAX_THREADS 64
+
+/* Number of FAT blocks read at once */
+#define FAT_READ_CHUNK 64
+
+/* Owner of a pack cluster, the rest of the value being the pack index */
+#define OWNER_PACK 0x80000000
+
+/*
+ * The image is checked in passes:
+ * 1. the superblock, then the FAT, read by all threads;
+ * 2. the directory tree, whose tables are walked in order;
+ * 3. the chains, extent maps and chunk tables of the files, walked by all
+ *    threads;
+ * 4. the clusters found, claimed file by file in directory order, which
+ *    tells cross-links apart deterministically: the first file keeps the
+ *    cluster. The chain clusters and pack clusters are claimed first, the
+ *    data clusters of extent-mapped files (which may be shared) then;
+ * 5. the FAT entries, checked by all threads against the claims (leaks and
+ *    reference counts).
+ *
+ * Problems are fixed in memory as they are found, the first claim winning,
+ * and only written back to the image with -r.
+ */
+
+struct image {
+	int fd;
+	int version;
+	uint32_t total_blocks;
+	uint32_t fat_blocks;
+	uint32_t root_index;
+	uint32_t data_start;
+	uint32_t data_blocks;
+	uint32_t cluster_blocks;
+	uint32_t features;
+	uint32_t clusters;
+	uint32_t per_block;
+	/* FAT entries, EOC widened to 32 bits */
+	uint32_t *fat;
+	/* One flag per FAT block, set when it must be written back */
+	uint8_t *fat_dirty;
+	/* Item (index + 1) or pack (OWNER_PACK) owning each chain cluster */
+	uint32_t *owner;
+	/* Number of extents referring to each data cluster */
+	uint32_t *refs;
+};
+
+/* Run of consecutive clusters of a chain */
+struct span {
+	uint32_t start;
+	uint32_t length;
+};
+
+/* How the walk of a chain ended */
+enum chain_end {
+	CHAIN_EOC,
+	/* at a cluster number out of range, or a cluster not in a chain */
+	CHAIN_INVALID,
+	/* at a cluster already met */
+	CHAIN_CYCLE,
+};
+
+struct chain {
+	struct span *spans;
+	uint32_t span_count;
+	uint32_t span_capacity;
+	/* Number of clusters walked, then of those kept */
+	uint32_t length;
+	uint32_t kept;
+	int end;
+	/* Cluster the walk stopped at */
+	uint32_t bad;
+};
+
+enum item_type {
+	ITEM_DIR,
+	ITEM_CHAIN,
+	ITEM_PACKED,
+	ITEM_EXTENTS,
+	ITEM_COMPRESSED,
+};
+
+/* Directory entry found in the tree, and what its walk found */
+struct item {
+	char *path;
+	int type;
+	/* Where the entry is stored, and the directory holding it (-1: root) */
+	uint32_t block;
+	uint32_t slot;
+	int32_t parent;
+	struct dirEntryV2 entry;
+	/* The entry must be written back, or removed */
+	int dirty;
+	int removed;
+	/* Number of entries left in a directory */
+	uint32_t children;
+	/* Chain of the entry: data, extent map, chunk table or directory */
+	struct chain chain;
+	/* Extent map or chunk table that cannot be read, and why */
+	const char *damage;
+	/* The extent map or chunk table must be written back */
+	int meta_dirty;
+	struct fsExtent *extents;
+	uint32_t extent_count;
+	struct fsChunk *chunks;
+	uint32_t chunk_count;
+	struct chain *chunk_chains;
+};
+
+/* Pack cluster shared by packed files */
+struct pack {
+	uint32_t cluster;
+	/* First block of the cluster: header and bitmap */
+	uint8_t block[BLOCK_SIZE];
+	/* Slots claimed by the files found */
+	uint8_t *claimed;
+	int dirty;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	/* Clusters met by the walk in progress, one bit each */
+	uint8_t *seen;
+	/* Problems found in the FAT entries scanned */
+	uint32_t leaked;
+	uint32_t bad_refs;
+	uint32_t used;
+};
+
+static struct image img;
+static int repair;
+static int thread_count;
+static struct worker workers[MAX_THREADS];
+
+static struct item *items;
+static uint32_t item_count;
+static uint32_t item_capacity;
+/* Next item to walk, shared by the threads */
+static uint32_t next_item;
+
+static struct pack *packs;
+static uint32_t pack_count;
+
+static uint32_t problems;
+
+static void problem(const char *path, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (path)
+		printf("%s: ", path);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	problems++;
+}
+
+/*
+ * Changed-block bitmap of the image, when it is tracked (see fs_format.h):
+ * the repaired blocks are marked in it, so that they are part of the next
+ * delta
+ */
+static struct {
+	int fd;
+	struct cbtHeader header;
+	uint8_t *bitmap;
+} cbt = { .fd = -1 };
+
+static size_t cbt_bitmap_size(void)
+{
+	return ((size_t)img.total_blocks + 7) / 8;
+}
+
+static void cbt_write_header(void)
+{
+	if (pwrite(cbt.fd, &cbt.header, sizeof(cbt.header), 0) !=
+	    sizeof(cbt.header) || fsync(cbt.fd))
+		die_perror("pwrite");
+}
+
+/*
+ * Load the bitmap of @diskname, if any, flagged as open until the repairs
+ * are done: were they interrupted, every block would count as changed
+ */
+static void cbt_open(const char *diskname)
+{
+	char *name;
+
+	name = malloc(strlen(diskname) + sizeof(FS_CBT_SUFFIX));
+	if (!name)
+		die_perror("malloc");
+	strcpy(name, diskname);
+	strcat(name, FS_CBT_SUFFIX);
+	cbt.fd = open(name, O_RDWR);
+	if (cbt.fd < 0) {
+		free(name);
+		return;
+	}
+
+	cbt.bitmap = malloc(cbt_bitmap_size());
+	if (!cbt.bitmap)
+		die_perror("malloc");
+	if (pread(cbt.fd, &cbt.header, sizeof(cbt.header), 0) !=
+	    sizeof(cbt.header) ||
+	    memcmp(cbt.header.magic, FS_CBT_MAGIC, FS_SIG_LENGTH) ||
+	    cbt.header.totalBlocks != img.total_blocks ||
+	    pread(cbt.fd, cbt.bitmap, cbt_bitmap_size(), sizeof(cbt.header)) !=
+	    (ssize_t)cbt_bitmap_size()) {
+		check_error("invalid changed-block bitmap '%s', ignored", name);
+		close(cbt.fd);
+		cbt.fd = -1;
+	} else if (cbt.header.flags & FS_CBT_OPEN) {
+		/* Every block counts as changed already */
+		close(cbt.fd);
+		cbt.fd = -1;
+	} else {
+		cbt.header.flags |= FS_CBT_OPEN;
+		cbt_write_header();
+	}
+	free(name);
+}
+
+static void cbt_mark(uint32_t block)
+{
+	if (cbt.fd >= 0)
+		cbt.bitmap[block / 8] |= 1 << (block % 8);
+}
+
+static void cbt_close(void)
+{
+	if (cbt.fd < 0)
+		return;
+
+	if (pwrite(cbt.fd, cbt.bitmap, cbt_bitmap_size(), sizeof(cbt.header)) !=
+	    (ssize_t)cbt_bitmap_size())
+		die_perror("pwrite");
+	cbt.header.flags &= ~FS_CBT_OPEN;
+	cbt_write_header();
+	close(cbt.fd);
+	free(cbt.bitmap);
+}
+
+static void read_blocks(uint32_t block, uint32_t count, void *buf)
+{
+	size_t size = (size_t)count * BLOCK_SIZE;
+
+	if (pread(img.fd, buf, size, (off_t)block * BLOCK_SIZE) != (ssize_t)size)
+		die("short read");
+}
+
+static void write_block(uint32_t block, const void *buf)
+{
+	cbt_mark(block);
+	if (pwrite(img.fd, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) !=
+	    BLOCK_SIZE)
+		die_perror("pwrite");
+}
+
+static size_t cluster_size(void)
+{
+	return (size_t)img.cluster_blocks * BLOCK_SIZE;
+}
+
+static uint32_t clusters_for(size_t bytes)
+{
+	return (bytes + cluster_size() - 1) / cluster_size();
+}
+
+static void set_fat(uint32_t cluster, uint32_t value)
+{
+	img.fat[cluster] = value;
+	img.fat_dirty[cluster / img.per_block] = 1;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr && size)
+		die_perror("realloc");
+	return ptr;
+}
+
+/*
+ * Image
+ */
+
+static void read_superblock(void)
+{
+	uint8_t block[BLOCK_SIZE];
+	struct superblockV1 *v1 = (struct superblockV1 *)block;
+	struct superblockV2 *v2 = (struct superblockV2 *)block;
+	struct stat st;
+
+	if (fstat(img.fd, &st))
+		die_perror("fstat");
+	if (st.st_size < BLOCK_SIZE)
+		die("image too small");
+	read_blocks(FS_SUPERBLOCK_INDEX, 1, block);
+
+	if (!memcmp(v1->signature, FS_SIGNATURE_V1, FS_SIG_LENGTH)) {
+		img.version = FS_VERSION_1;
+		img.total_blocks = v1->totalBlocks;
+		img.root_index = v1->rootIndex;
+		img.data_start = v1->dataStart;
+		img.data_blocks = v1->dataBlocks;
+		img.fat_blocks = v1->fatBlocks;
+		img.cluster_blocks = 1;
+	} else if (!memcmp(v2->signature, FS_SIGNATURE_V2, FS_SIG_LENGTH)) {
+		if (v2->version != FS_VERSION_2)
+			die("superblock: unknown version %u", v2->version);
+		img.version = FS_VERSION_2;
+		img.total_blocks = v2->totalBlocks;
+		img.root_index = v2->rootIndex;
+		img.data_start = v2->dataStart;
+		img.data_blocks = v2->dataBlocks;
+		img.fat_blocks = v2->fatBlocks;
+		img.cluster_blocks = v2->clusterBlocks ? v2->clusterBlocks
+						       : FS_MIN_CLUSTER_BLOCKS;
+		img.features = v2->features;
+	} else {
+		die("superblock: invalid signature");
+	}
+
+	/* The superblock cannot be rebuilt, so any of these is fatal */
+	if (img.features & ~FS_FEATURES_SUPPORTED)
+		die("superblock: unknown features %#x", img.features);
+	if (img.cluster_blocks > FS_MAX_CLUSTER_BLOCKS ||
+	    img.data_blocks == 0 || img.data_blocks % img.cluster_blocks)
+		die("superblock: invalid cluster size %u", img.cluster_blocks);
+	img.clusters = img.data_blocks / img.cluster_blocks;
+	if (img.total_blocks != st.st_size / BLOCK_SIZE)
+		die("superblock: %u blocks, image has %lld", img.total_blocks,
+		    (long long)(st.st_size / BLOCK_SIZE));
+	if (img.fat_blocks != fsFatBlocks(img.version, img.clusters) ||
+	    img.root_index != img.fat_blocks + 1 ||
+	    img.data_start != img.root_index + 1 ||
+	    (uint64_t)img.data_start + img.data_blocks != img.total_blocks)
+		die("superblock: inconsistent layout");
+
+	img.per_block = img.version == FS_VERSION_1 ? FS_FAT_ENTRIES_V1
+						   : FS_FAT_ENTRIES_V2;
+}
+
+static void decode_fat(uint32_t block, const uint8_t *data)
+{
+	uint32_t first = block * img.per_block;
+
+	for (uint32_t j = 0; j < img.per_block && first + j < img.clusters;
+	     j++) {
+		if (img.version == FS_VERSION_1) {
+			uint16_t v = ((const uint16_t *)data)[j];
+
+			img.fat[first + j] = v == FS_FAT_EOC_V1 ? EOC : v;
+		} else {
+			img.fat[first + j] = ((const uint32_t *)data)[j];
+		}
+	}
+}
+
+static void encode_fat(uint32_t block, uint8_t *data)
+{
+	uint32_t first = block * img.per_block;
+
+	memset(data, 0, BLOCK_SIZE);
+	for (uint32_t j = 0; j < img.per_block && first + j < img.clusters;
+	     j++) {
+		uint32_t v = img.fat[first + j];
+
+		if (img.version == FS_VERSION_1)
+			((uint16_t *)data)[j] = v == EOC ? FS_FAT_EOC_V1 : v;
+		else
+			((uint32_t *)data)[j] = v;
+	}
+}
+
+/* Share [0, @count) between the threads: the part of worker @w */
+static void thread_range(struct worker *w, uint32_t count, uint32_t *from,
+			 uint32_t *to)
+{
+	uint32_t share = (count + thread_count - 1) / thread_count;
+
+	*from = (uint64_t)share * w->id < count ? share * w->id : count;
+	*to = count - *from < share ? count : *from + share;
+}
+
+static void run_threads(void *(*fn)(void *))
+{
+	for (int i = 0; i < thread_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]))
+			die("cannot create threads");
+	}
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(workers[i].thread, NULL);
+}
+
+static void *read_fat(void *arg)
+{
+	static __thread uint8_t data[FAT_READ_CHUNK * BLOCK_SIZE];
+	uint32_t from, to;
+
+	thread_range(arg, img.fat_blocks, &from, &to);
+	while (from < to) {
+		uint32_t n = to - from < FAT_READ_CHUNK ? to - from
+							: FAT_READ_CHUNK;
+
+		read_blocks(from + 1, n, data);
+		for (uint32_t i = 0; i < n; i++)
+			decode_fat(from + i, data + (size_t)i * BLOCK_SIZE);
+		from += n;
+	}
+
+	return NULL;
+}
+
+/*
+ * Chains
+ */
+
+/* Cluster @n of chain @c */
+static uint32_t chain_cluster(const struct chain *c, uint32_t n)
+{
+	for (uint32_t i = 0; i < c->span_count; i++) {
+		if (n < c->spans[i].length)
+			return c->spans[i].start + n;
+		n -= c->spans[i].length;
+	}
+
+	return EOC;
+}
+
+static void chain_add(struct chain *c, uint32_t cluster)
+{
+	struct span *last = c->span_count ? &c->spans[c->span_count - 1]
+					  : NULL;
+
+	c->length++;
+	if (last && last->start + last->length == cluster) {
+		last->length++;
+		return;
+	}
+	if (c->span_count == c->span_capacity) {
+		c->span_capacity = c->span_capacity ? c->span_capacity * 2 : 4;
+		c->spans = xrealloc(c->spans,
+				    c->span_capacity * sizeof(struct span));
+	}
+	c->spans[c->span_count++] = (struct span){ cluster, 1 };
+}
+
+/* Follow the chain starting at @first, as far as it is valid */
+static void walk_chain(struct worker *w, uint32_t first, struct chain *c)
+{
+	uint32_t cluster = first;
+
+	c->end = CHAIN_EOC;
+	while (cluster != EOC) {
+		uint32_t value = cluster < img.clusters ? img.fat[cluster] : 0;
+
+		/* Cluster 0 is reserved, and free or data clusters end chains */
+		if (cluster == 0 || cluster >= img.clusters || value == 0 ||
+		    FS_FAT_IS_REF(value)) {
+			c->end = CHAIN_INVALID;
+			c->bad = cluster;
+			break;
+		}
+		if (w->seen[cluster / 8] & (1 << (cluster % 8))) {
+			c->end = CHAIN_CYCLE;
+			c->bad = cluster;
+			break;
+		}
+		w->seen[cluster / 8] |= 1 << (cluster % 8);
+		chain_add(c, cluster);
+		cluster = value;
+	}
+	c->kept = c->length;
+
+	for (uint32_t i = 0; i < c->span_count; i++) {
+		for (uint32_t k = 0; k < c->spans[i].length; k++) {
+			uint32_t n = c->spans[i].start + k;
+
+			w->seen[n / 8] &= ~(1 << (n % 8));
+		}
+	}
+}
+
+/* Transfer @count bytes at @offset of the clusters of chain @c kept */
+static size_t chain_io(const struct chain *c, int write, size_t offset,
+		       void *buf, size_t count)
+{
+	uint8_t block[BLOCK_SIZE];
+	size_t done = 0;
+
+	while (done < count) {
+		size_t position = offset + done;
+		uint32_t n = position / BLOCK_SIZE;
+		uint32_t cluster;
+		uint32_t index;
+		size_t skip = position % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - skip < count - done
+			       ? BLOCK_SIZE - skip : count - done;
+
+		if (n / img.cluster_blocks >= c->kept)
+			break;
+		cluster = chain_cluster(c, n / img.cluster_blocks);
+		index = img.data_start + cluster * img.cluster_blocks +
+			n % img.cluster_blocks;
+		read_blocks(index, 1, block);
+		if (write) {
+			memcpy(block + skip, (uint8_t *)buf + done, chunk);
+			write_block(index, block);
+		} else {
+			memcpy((uint8_t *)buf + done, block + skip, chunk);
+		}
+		done += chunk;
+	}
+
+	return done;
+}
+
+static const char *owner_name(uint32_t owner)
+{
+	return owner & OWNER_PACK ? "a pack cluster" : items[owner - 1].path;
+}
+
+/* Claim the clusters of chain @c for item @i, up to a cross-linked one */
+static void claim_chain(uint32_t i, struct chain *c, const char *what)
+{
+	uint32_t n = 0;
+
+	for (uint32_t s = 0; s < c->span_count; s++) {
+		for (uint32_t k = 0; k < c->spans[s].length; k++, n++) {
+			uint32_t cluster = c->spans[s].start + k;
+
+			if (img.owner[cluster]) {
+				problem(items[i].path,
+					"%s cross-linked with %s at cluster %u",
+					what, owner_name(img.owner[cluster]),
+					cluster);
+				c->kept = n;
+				return;
+			}
+			img.owner[cluster] = i + 1;
+		}
+	}
+}
+
+/* Give the clusters of chain @c back, from the @keep-th one */
+static void release_chain(struct chain *c, uint32_t keep)
+{
+	for (uint32_t n = keep; n < c->kept; n++)
+		img.owner[chain_cluster(c, n)] = 0;
+	if (c->kept > keep)
+		c->kept = keep;
+}
+
+static void report_end(uint32_t i, const struct chain *c, const char *what)
+{
+	if (c->end == CHAIN_INVALID)
+		problem(items[i].path, "%s links to invalid cluster %u", what,
+			c->bad);
+	else if (c->end == CHAIN_CYCLE)
+		problem(items[i].path, "%s loops back to cluster %u", what,
+			c->bad);
+}
+
+/*
+ * End chain @c after its first @keep clusters, which it must have: return 1
+ * if it is then empty, and the reference to it must become EOC
+ */
+static int cut_chain(struct chain *c, uint32_t keep)
+{
+	release_chain(c, keep);
+	if (c->kept == c->length && c->end == CHAIN_EOC)
+		return 0;
+
+	c->length = c->kept;
+	c->end = CHAIN_EOC;
+	if (c->kept == 0)
+		return 1;
+	set_fat(chain_cluster(c, c->kept - 1), EOC);
+	return 0;
+}
+
+/*
+ * Directory tree
+ */
+
+static uint32_t add_item(const char *parent_path, int32_t parent,
+			 uint32_t block, uint32_t slot,
+			 const struct dirEntryV2 *entry)
+{
+	struct item *item;
+	size_t length;
+
+	if (item_count == item_capacity) {
+		item_capacity = item_capacity ? item_capacity * 2 : 256;
+		items = xrealloc(items, item_capacity * sizeof(struct item));
+	}
+	item = &items[item_count];
+	memset(item, 0, sizeof(*item));
+	item->block = block;
+	item->slot = slot;
+	item->parent = parent;
+	item->entry = *entry;
+
+	length = (parent_path ? strlen(parent_path) + 1 : 0) + FS_FILENAME_LEN;
+	item->path = malloc(length);
+	if (!item->path)
+		die_perror("malloc");
+	snprintf(item->path, length, "%s%s%.*s", parent_path ? parent_path : "",
+		 parent_path ? "/" : "", FS_FILENAME_LEN, entry->fileName);
+
+	if (entry->flags & FS_DIR_DIRECTORY)
+		item->type = ITEM_DIR;
+	else if (entry->flags & FS_DIR_COMPRESSED)
+		item->type = ITEM_COMPRESSED;
+	else if (entry->flags & FS_DIR_EXTENTS)
+		item->type = ITEM_EXTENTS;
+	else if (entry->flags & FS_DIR_PACKED)
+		item->type = ITEM_PACKED;
+	else
+		item->type = ITEM_CHAIN;
+
+	return item_count++;
+}
+
+static int valid_name(const char *name)
+{
+	return memchr(name, '\0', FS_FILENAME_LEN) != NULL;
+}
+
+/* Remove the entry of item @i, whose content cannot be recovered */
+static void remove_item(uint32_t i)
+{
+	items[i].removed = 1;
+	if (items[i].parent >= 0)
+		items[items[i].parent].children--;
+}
+
+static void read_root(void)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	read_blocks(img.root_index, 1, block);
+	for (uint32_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct dirEntryV2 entry;
+
+		if (img.version == FS_VERSION_1) {
+			struct dirEntryV1 *v1 = (struct dirEntryV1 *)block + i;
+
+			memset(&entry, 0, sizeof(entry));
+			memcpy(entry.fileName, v1->fileName, FS_FILENAME_LEN);
+			entry.fileSize = v1->fileSize;
+			entry.firstBlock = v1->firstBlock == FS_FAT_EOC_V1
+					   ? EOC : v1->firstBlock;
+		} else {
+			entry = ((struct dirEntryV2 *)block)[i];
+		}
+		if (entry.fileName[0] == '\0')
+			continue;
+
+		if (!valid_name(entry.fileName)) {
+			uint32_t n = add_item(NULL, -1, img.root_index, i,
+					      &entry);
+
+			problem(items[n].path, "invalid name");
+			remove_item(n);
+			continue;
+		}
+		add_item(NULL, -1, img.root_index, i, &entry);
+	}
+}
+
+/* Check directory @i, and list the entries of its table */
+static void read_dir(uint32_t i)
+{
+	struct item *d = &items[i];
+	uint32_t blocks = d->entry.fileSize / BLOCK_SIZE;
+	uint8_t block[BLOCK_SIZE];
+
+	walk_chain(&workers[0], d->entry.firstBlock, &d->chain);
+	claim_chain(i, &d->chain, "table chain");
+	d = &items[i];
+
+	if (d->entry.fileSize == 0 || d->entry.fileSize % BLOCK_SIZE) {
+		problem(d->path, "invalid table size %u", d->entry.fileSize);
+	} else if (d->chain.kept < clusters_for(d->entry.fileSize)) {
+		report_end(i, &d->chain, "table chain");
+		problem(d->path, "table chain shorter than its %u blocks",
+			blocks);
+	} else {
+		report_end(i, &d->chain, "table chain");
+		cut_chain(&d->chain, d->chain.kept);
+
+		for (uint32_t n = 0; n < blocks; n++) {
+			uint32_t cluster = chain_cluster(&d->chain,
+						n / img.cluster_blocks);
+			uint32_t index = img.data_start +
+				cluster * img.cluster_blocks +
+				n % img.cluster_blocks;
+
+			read_blocks(index, 1, block);
+			for (uint32_t k = 0; k < FS_DIR_ENTRIES_PER_BLOCK; k++) {
+				struct dirEntryV2 *e =
+					(struct dirEntryV2 *)block + k;
+				uint32_t child;
+
+				if (e->fileName[0] == '\0')
+					continue;
+				child = add_item(items[i].path, i, index, k, e);
+				items[i].children++;
+				if (!valid_name(e->fileName)) {
+					problem(items[child].path,
+						"invalid name");
+					remove_item(child);
+				}
+			}
+		}
+		return;
+	}
+
+	/* Its entries are lost, and their clusters leaked */
+	release_chain(&d->chain, 0);
+	remove_item(i);
+}
+
+/*
+ * Files
+ */
+
+/* Read the extent map of extent-mapped file @item */
+static void read_map(struct item *item)
+{
+	struct extentHeader header;
+	size_t size;
+
+	if (chain_io(&item->chain, 0, 0, &header, sizeof(header)) !=
+	    sizeof(header) ||
+	    memcmp(header.magic, FS_EXTENT_MAGIC, FS_EXTENT_MAGIC_LENGTH)) {
+		item->damage = "invalid extent map";
+		return;
+	}
+	if (header.count > img.clusters) {
+		item->damage = "invalid extent count";
+		return;
+	}
+
+	size = (size_t)header.count * sizeof(struct fsExtent);
+	item->extents = xrealloc(NULL, size);
+	if (chain_io(&item->chain, 0, sizeof(header), item->extents, size) !=
+	    size) {
+		item->damage = "extent map truncated";
+		return;
+	}
+	item->extent_count = header.count;
+}
+
+/* Read the chunk table of compressed file @item, and walk its chunks */
+static void read_chunks(struct worker *w, struct item *item)
+{
+	struct compressHeader header;
+	size_t size;
+
+	if (chain_io(&item->chain, 0, 0, &header, sizeof(header)) !=
+	    sizeof(header) ||
+	    memcmp(header.magic, FS_COMPRESS_MAGIC, FS_COMPRESS_MAGIC_LENGTH) ||
+	    header.chunkSize != FS_COMPRESS_CHUNK) {
+		item->damage = "invalid chunk table";
+		return;
+	}
+	if (header.count > UINT32_MAX / FS_COMPRESS_CHUNK + 1) {
+		item->damage = "invalid chunk count";
+		return;
+	}
+
+	size = (size_t)header.count * sizeof(struct fsChunk);
+	item->chunks = xrealloc(NULL, size);
+	if (chain_io(&item->chain, 0, sizeof(header), item->chunks, size) !=
+	    size) {
+		item->damage = "chunk table truncated";
+		return;
+	}
+	item->chunk_count = header.count;
+
+	item->chunk_chains = calloc(header.count ? header.count : 1,
+				    sizeof(struct chain));
+	if (!item->chunk_chains)
+		die_perror("calloc");
+	for (uint32_t n = 0; n < item->chunk_count; n++)
+		walk_chain(w, item->chunks[n].first, &item->chunk_chains[n]);
+}
+
+static void *walk_items(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t i;
+
+	while ((i = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) <
+	       item_count) {
+		struct item *item = &items[i];
+
+		if (item->type == ITEM_DIR || item->type == ITEM_PACKED ||
+		    item->removed)
+			continue;
+		walk_chain(w, item->entry.firstBlock, &item->chain);
+		if (item->entry.firstBlock == EOC)
+			continue;
+		if (item->type == ITEM_EXTENTS)
+			read_map(item);
+		else if (item->type == ITEM_COMPRESSED)
+			read_chunks(w, item);
+	}
+
+	return NULL;
+}
+
+/* Make @item an empty file, its content being lost */
+static void empty_item(uint32_t i, const char *why)
+{
+	struct item *item = &items[i];
+
+	problem(item->path, "%s, file emptied", why);
+	release_chain(&item->chain, 0);
+	item->entry.firstBlock = EOC;
+	item->entry.fileSize = 0;
+	item->entry.flags &= ~(FS_DIR_PACKED | FS_DIR_EXTENTS |
+			       FS_DIR_COMPRESSED);
+	item->type = ITEM_CHAIN;
+	item->extent_count = 0;
+	item->chunk_count = 0;
+	item->dirty = 1;
+}
+
+static void check_plain(uint32_t i)
+{
+	struct item *item = &items[i];
+	uint32_t needed = clusters_for(item->entry.fileSize);
+
+	claim_chain(i, &item->chain, "chain");
+	report_end(i, &item->chain, "chain");
+
+	if (item->chain.kept > needed) {
+		problem(item->path, "chain longer than file size %u",
+			item->entry.fileSize);
+	} else if (item->chain.kept < needed) {
+		problem(item->path, "file size %u exceeds its chain of %u "
+			"clusters", item->entry.fileSize, item->chain.kept);
+		item->entry.fileSize = item->chain.kept * cluster_size();
+		item->dirty = 1;
+	}
+	if (cut_chain(&item->chain, item->chain.kept < needed
+					? item->chain.kept : needed)) {
+		item->entry.firstBlock = EOC;
+		item->dirty = 1;
+	}
+}
+
+static uint32_t pack_slot_count(void)
+{
+	return cluster_size() / FS_PACK_SLOT_SIZE;
+}
+
+/* Pack holding cluster @cluster, read the first time, NULL if invalid */
+static struct pack *find_pack(uint32_t i, uint32_t cluster)
+{
+	struct pack *pack;
+	struct packHeader *header;
+	size_t bytes = sizeof(struct packHeader) + (pack_slot_count() + 7) / 8;
+
+	if (img.owner[cluster] & OWNER_PACK)
+		return &packs[img.owner[cluster] & ~OWNER_PACK];
+	if (img.owner[cluster]) {
+		problem(items[i].path, "pack cluster %u cross-linked with %s",
+			cluster, owner_name(img.owner[cluster]));
+		return NULL;
+	}
+	if (img.fat[cluster] != EOC) {
+		problem(items[i].path, "pack cluster %u not allocated",
+			cluster);
+		return NULL;
+	}
+
+	packs = xrealloc(packs, (pack_count + 1) * sizeof(struct pack));
+	pack = &packs[pack_count];
+	memset(pack, 0, sizeof(*pack));
+	pack->cluster = cluster;
+	read_blocks(img.data_start + cluster * img.cluster_blocks, 1,
+		    pack->block);
+	header = (struct packHeader *)pack->block;
+	if (memcmp(header->magic, FS_PACK_MAGIC, FS_PACK_MAGIC_LENGTH) ||
+	    header->headerSlots != (bytes + FS_PACK_SLOT_SIZE - 1) /
+				   FS_PACK_SLOT_SIZE) {
+		problem(items[i].path, "invalid pack cluster %u", cluster);
+		return NULL;
+	}
+	pack->claimed = calloc((pack_slot_count() + 7) / 8, 1);
+	if (!pack->claimed)
+		die_perror("calloc");
+
+	img.owner[cluster] = OWNER_PACK | pack_count;
+	return &packs[pack_count++];
+}
+
+static int slot_used(const uint8_t *bitmap, uint32_t slot)
+{
+	return bitmap[slot / 8] & (1 << (slot % 8));
+}
+
+static void check_packed(uint32_t i)
+{
+	struct item *item = &items[i];
+	uint32_t cluster = item->entry.firstBlock;
+	uint32_t first = item->entry.slot;
+	uint32_t count = item->entry.fileSize == 0 ? 1 :
+		(item->entry.fileSize + FS_PACK_SLOT_SIZE - 1) /
+		FS_PACK_SLOT_SIZE;
+	uint32_t per_block = BLOCK_SIZE / FS_PACK_SLOT_SIZE;
+	struct packHeader *header;
+	struct pack *pack;
+	int unmarked = 0;
+
+	if (item->entry.fileSize > FS_PACK_MAX_SIZE) {
+		empty_item(i, "packed file too large");
+		return;
+	}
+	if (cluster == 0 || cluster >= img.clusters) {
+		empty_item(i, "invalid pack cluster");
+		return;
+	}
+	pack = find_pack(i, cluster);
+	if (!pack) {
+		empty_item(i, "pack cluster lost");
+		return;
+	}
+	header = (struct packHeader *)pack->block;
+	if (first < header->headerSlots ||
+	    first + count > pack_slot_count() ||
+	    first / per_block != (first + count - 1) / per_block) {
+		empty_item(i, "invalid slots");
+		return;
+	}
+
+	for (uint32_t s = first; s < first + count; s++) {
+		if (slot_used(pack->claimed, s)) {
+			empty_item(i, "slots shared with another file");
+			for (uint32_t t = first; t < s; t++)
+				pack->claimed[t / 8] &= ~(1 << (t % 8));
+			return;
+		}
+		pack->claimed[s / 8] |= 1 << (s % 8);
+		unmarked |= !slot_used(header->bitmap, s);
+	}
+	if (unmarked)
+		problem(item->path, "slots not marked in use in pack cluster %u",
+			cluster);
+}
+
+static void check_extents_map(uint32_t i)
+{
+	struct item *item = &items[i];
+	uint32_t needed;
+
+	claim_chain(i, &item->chain, "extent map chain");
+	report_end(i, &item->chain, "extent map chain");
+	needed = clusters_for(sizeof(struct extentHeader) +
+			      (size_t)item->extent_count *
+			      sizeof(struct fsExtent));
+
+	/* A file without data may have no extent map at all */
+	if (item->entry.firstBlock == EOC)
+		needed = 0;
+
+	if (item->damage) {
+		empty_item(i, item->damage);
+	} else if (item->chain.kept < needed) {
+		empty_item(i, "extent map chain too short");
+	} else if (cut_chain(&item->chain, item->chain.kept)) {
+		empty_item(i, "extent map lost");
+	}
+}
+
+static void check_extents_data(uint32_t i)
+{
+	struct item *item = &items[i];
+	uint32_t needed = clusters_for(item->entry.fileSize);
+	uint32_t total = 0;
+	uint32_t n;
+
+	for (n = 0; n < item->extent_count; n++) {
+		struct fsExtent *e = &item->extents[n];
+		uint32_t k;
+
+		if (e->start == 0 || e->length == 0 || e->start >= img.clusters ||
+		    e->length > img.clusters - e->start) {
+			problem(item->path, "extent %u is invalid", n);
+			break;
+		}
+		for (k = 0; k < e->length && !img.owner[e->start + k]; k++)
+			;
+		if (k < e->length) {
+			problem(item->path, "extent %u cross-linked with %s "
+				"at cluster %u", n,
+				owner_name(img.owner[e->start + k]),
+				e->start + k);
+			break;
+		}
+		total += e->length;
+	}
+	if (n < item->extent_count) {
+		item->extent_count = n;
+		item->meta_dirty = 1;
+	}
+
+	/* Clusters past the file size are dropped, from the last extent */
+	if (total > needed) {
+		problem(item->path, "extents longer than file size %u",
+			item->entry.fileSize);
+		while (total > needed) {
+			struct fsExtent *last =
+				&item->extents[item->extent_count - 1];
+			uint32_t drop = total - needed < last->length
+					? total - needed : last->length;
+
+			last->length -= drop;
+			total -= drop;
+			if (last->length == 0)
+				item->extent_count--;
+		}
+		item->meta_dirty = 1;
+	} else if (total < needed) {
+		problem(item->path, "file size %u exceeds its extents of %u "
+			"clusters", item->entry.fileSize, total);
+		item->entry.fileSize = total * cluster_size();
+		item->dirty = 1;
+	}
+
+	for (n = 0; n < item->extent_count; n++) {
+		for (uint32_t k = 0; k < item->extents[n].length; k++)
+			img.refs[item->extents[n].start + k]++;
+	}
+}
+
+static void check_compressed(uint32_t i)
+{
+	struct item *item = &items[i];
+	uint32_t expected = (item->entry.fileSize + FS_COMPRESS_CHUNK - 1) /
+			    FS_COMPRESS_CHUNK;
+	uint32_t count;
+	uint32_t n;
+
+	claim_chain(i, &item->chain, "chunk table chain");
+	report_end(i, &item->chain, "chunk table chain");
+	if (item->damage) {
+		empty_item(i, item->damage);
+		return;
+	}
+	if (item->entry.firstBlock != EOC &&
+	    item->chain.kept < clusters_for(sizeof(struct compressHeader) +
+			(size_t)item->chunk_count * sizeof(struct fsChunk))) {
+		empty_item(i, "chunk table chain too short");
+		return;
+	}
+	if (cut_chain(&item->chain, item->chain.kept)) {
+		empty_item(i, "chunk table lost");
+		return;
+	}
+
+	count = item->chunk_count < expected ? item->chunk_count : expected;
+	if (item->chunk_count > expected)
+		problem(item->path, "more chunks than file size %u",
+			item->entry.fileSize);
+
+	/* A chunk that cannot be read ends the file */
+	for (n = 0; n < count; n++) {
+		struct chain *c = &item->chunk_chains[n];
+		uint32_t length = item->chunks[n].length;
+
+		claim_chain(i, c, "chunk chain");
+		report_end(i, c, "chunk chain");
+		if (length > 2 * FS_COMPRESS_CHUNK ||
+		    c->kept < clusters_for(length)) {
+			problem(item->path, "chunk %u lost", n);
+			release_chain(c, 0);
+			break;
+		}
+		if (cut_chain(c, c->kept)) {
+			item->chunks[n].first = EOC;
+			item->meta_dirty = 1;
+		}
+	}
+	if (n != item->chunk_count) {
+		item->chunk_count = n;
+		item->meta_dirty = 1;
+	}
+	if (n < expected) {
+		if (n == count)
+			problem(item->path, "file size %u exceeds its %u chunks",
+				item->entry.fileSize, n);
+		item->entry.fileSize = n * FS_COMPRESS_CHUNK;
+		item->dirty = 1;
+	}
+}
+
+/*
+ * FAT entries
+ */
+
+static void *scan_fat(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t from, to;
+
+	/* By whole FAT blocks, so that each thread marks its own ones dirty */
+	thread_range(w, img.fat_blocks, &from, &to);
+	from *= img.per_block;
+	to = (uint64_t)to * img.per_block < img.clusters ? to * img.per_block
+							 : img.clusters;
+
+	for (uint32_t c = from > 0 ? from : 1; c < to; c++) {
+		if (img.refs[c]) {
+			if (img.fat[c] != FS_FAT_REF(img.refs[c])) {
+				w->bad_refs++;
+				set_fat(c, FS_FAT_REF(img.refs[c]));
+			}
+		} else if (!img.owner[c] && img.fat[c]) {
+			w->leaked++;
+			set_fat(c, 0);
+		}
+		w->used += img.fat[c] != 0;
+	}
+
+	return NULL;
+}
+
+static void check_packs(void)
+{
+	for (uint32_t p = 0; p < pack_count; p++) {
+		struct pack *pack = &packs[p];
+		struct packHeader *header = (struct packHeader *)pack->block;
+		uint32_t leaked = 0;
+
+		for (uint32_t s = header->headerSlots; s < pack_slot_count();
+		     s++) {
+			int claimed = slot_used(pack->claimed, s);
+
+			if (claimed != !!slot_used(header->bitmap, s))
+				pack->dirty = 1;
+			leaked += !claimed && slot_used(header->bitmap, s);
+			if (claimed)
+				header->bitmap[s / 8] |= 1 << (s % 8);
+			else
+				header->bitmap[s / 8] &= ~(1 << (s % 8));
+		}
+		if (leaked)
+			problem(NULL, "pack cluster %u: %u leaked slots",
+				pack->cluster, leaked);
+	}
+}
+
+static void check_children(void)
+{
+	for (uint32_t i = 0; i < item_count; i++) {
+		struct item *d = &items[i];
+
+		if (d->type != ITEM_DIR || d->removed ||
+		    d->entry.aux == d->children)
+			continue;
+		problem(d->path, "entry count %u, table holds %u",
+			d->entry.aux, d->children);
+		d->entry.aux = d->children;
+		d->dirty = 1;
+	}
+}
+
+/*
+ * Repairs
+ */
+
+static void write_entry(const struct item *item)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	read_blocks(item->block, 1, block);
+	if (img.version == FS_VERSION_1) {
+		struct dirEntryV1 *e = (struct dirEntryV1 *)block + item->slot;
+
+		memset(e, 0, sizeof(*e));
+		if (!item->removed) {
+			memcpy(e->fileName, item->entry.fileName,
+			       FS_FILENAME_LEN);
+			e->fileSize = item->entry.fileSize;
+			e->firstBlock = item->entry.firstBlock == EOC
+					? FS_FAT_EOC_V1
+					: item->entry.firstBlock;
+		}
+	} else {
+		struct dirEntryV2 *e = (struct dirEntryV2 *)block + item->slot;
+
+		memset(e, 0, sizeof(*e));
+		if (!item->removed)
+			*e = item->entry;
+		/* Lookups in tables go on probing past removed entries */
+		else if (item->parent >= 0)
+			e->flags = FS_DIR_DELETED;
+	}
+	write_block(item->block, block);
+}
+
+static void write_meta(const struct item *item)
+{
+	if (item->type == ITEM_EXTENTS) {
+		struct extentHeader header;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, FS_EXTENT_MAGIC, FS_EXTENT_MAGIC_LENGTH);
+		header.count = item->extent_count;
+		chain_io(&item->chain, 1, 0, &header, sizeof(header));
+		chain_io(&item->chain, 1, sizeof(header), item->extents,
+			 item->extent_count * sizeof(struct fsExtent));
+	} else if (item->type == ITEM_COMPRESSED) {
+		struct compressHeader header;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, FS_COMPRESS_MAGIC,
+		       FS_COMPRESS_MAGIC_LENGTH);
+		header.count = item->chunk_count;
+		header.chunkSize = FS_COMPRESS_CHUNK;
+		chain_io(&item->chain, 1, 0, &header, sizeof(header));
+		chain_io(&item->chain, 1, sizeof(header), item->chunks,
+			 item->chunk_count * sizeof(struct fsChunk));
+	}
+}
+
+static void write_repairs(void)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	for (uint32_t i = 0; i < item_count; i++) {
+		/* Removed entries below removed directories are gone already */
+		if (items[i].parent >= 0 && items[items[i].parent].removed)
+			continue;
+		if (items[i].meta_dirty && !items[i].removed)
+			write_meta(&items[i]);
+		if (items[i].dirty || items[i].removed)
+			write_entry(&items[i]);
+	}
+	for (uint32_t p = 0; p < pack_count; p++) {
+		if (packs[p].dirty)
+			write_block(img.data_start +
+				    packs[p].cluster * img.cluster_blocks,
+				    packs[p].block);
+	}
+	for (uint32_t b = 0; b < img.fat_blocks; b++) {
+		if (!img.fat_dirty[b])
+			continue;
+		encode_fat(b, block);
+		write_block(b + 1, block);
+	}
+	if (fsync(img.fd))
+		die_perror("fsync");
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t leaked = 0, bad_refs = 0, used = 0, files = 0;
+	char *diskname, *end;
+	long count;
+	int opt;
+
+	thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		case 'j':
+			count = strtol(optarg, &end, 0);
+			if (*end != '\0' || count < 1 || count > MAX_THREADS)
+				die("thread count invalid, range is [1, %d]",
+				    MAX_THREADS);
+			thread_count = count;
+			break;
+		default:
+			die(USAGE);
+		}
+	}
+	if (optind + 1 != argc)
+		die(USAGE);
+	if (thread_count < 1)
+		thread_count = 1;
+	if (thread_count > MAX_THREADS)
+		thread_count = MAX_THREADS;
+	diskname = argv[optind];
+
+	img.fd = open(diskname, repair ? O_RDWR : O_RDONLY);
+	if (img.fd < 0)
+		die_perror("open");
+	read_superblock();
+
+	img.fat = malloc((size_t)img.clusters * sizeof(uint32_t));
+	img.fat_dirty = calloc(img.fat_blocks, 1);
+	img.owner = calloc(img.clusters, sizeof(uint32_t));
+	img.refs = calloc(img.clusters, sizeof(uint32_t));
+	if (!img.fat || !img.fat_dirty || !img.owner || !img.refs)
+		die_perror("malloc");
+	for (int i = 0; i < thread_count; i++) {
+		workers[i].id = i;
+		workers[i].seen = calloc(img.clusters / 8 + 1, 1);
+		if (!workers[i].seen)
+			die_perror("calloc");
+	}
+
+	run_threads(read_fat);
+	if (img.fat[0] != EOC) {
+		problem(NULL, "cluster 0 not reserved");
+		set_fat(0, EOC);
+	}
+
+	/* Directories are found in the order of the tree, before files */
+	read_root();
+	for (uint32_t i = 0; i < item_count; i++) {
+		if (items[i].type == ITEM_DIR && !items[i].removed)
+			read_dir(i);
+	}
+
+	run_threads(walk_items);
+
+	for (uint32_t i = 0; i < item_count; i++) {
+		if (items[i].removed || items[i].type == ITEM_DIR)
+			continue;
+		files++;
+		if (items[i].type == ITEM_CHAIN)
+			check_plain(i);
+		else if (items[i].type == ITEM_PACKED)
+			check_packed(i);
+		else if (items[i].type == ITEM_EXTENTS)
+			check_extents_map(i);
+		else
+			check_compressed(i);
+	}
+	for (uint32_t i = 0; i < item_count; i++) {
+		if (!items[i].removed && items[i].type == ITEM_EXTENTS)
+			check_extents_data(i);
+	}
+
+	run_threads(scan_fat);
+	for (int i = 0; i < thread_count; i++) {
+		leaked += workers[i].leaked;
+		bad_refs += workers[i].bad_refs;
+		used += workers[i].used;
+	}
+	if (leaked)
+		problem(NULL, "%u leaked clusters", leaked);
+	if (bad_refs)
+		problem(NULL, "%u clusters with wrong reference counts",
+			bad_refs);
+	check_packs();
+	check_children();
+
+	if (repair && problems) {
+		cbt_open(diskname);
+		write_repairs();
+		cbt_close();
+	}
+
+	printf("%s: %u files, %u/%u clusters in use, %u problems%s\n",
+	       diskname, files, used, img.clusters, problems,
+	       repair && problems ? " repaired" : "");
+
+	close(img.fd);
+
+	return problems && !repair;
+}
@@ -0,0 +1,229 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_ext.h>
+#include <fs_format.h>
+
+#define delta_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	delta_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/*
+ * A delta file holds the blocks of an image changed since a checkpoint: a
+ * struct delta_header, followed by block_count records made of a block
+ * index (32 bits) and the content of that block.
+ */
+#define DELTA_MAGIC "ECS150DT"
+
+struct delta_header {
+	char magic[FS_SIG_LENGTH];
+	uint32_t total_blocks;
+	uint32_t block_count;
+	char checkpoint[FS_CBT_NAME_LEN];
+	/* identity of the checkpoint, which the target image must be at */
+	uint64_t checkpoint_id;
+} __attribute__((packed));
+
+#define USAGE "Usage: checkpoint <diskname> <name>\n" \
+	"       export <diskname> <delta>\n" \
+	"       apply <delta> <diskname>"
+
+static void read_all(int fd, void *buf, size_t size, off_t offset)
+{
+	if (pread(fd, buf, size, offset) != (ssize_t)size)
+		die("short read");
+}
+
+static void write_all(int fd, const void *buf, size_t size)
+{
+	if (write(fd, buf, size) != (ssize_t)size)
+		die_perror("write");
+}
+
+/* Number of blocks of the image open as @fd */
+static uint32_t image_blocks(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	return st.st_size / BLOCK_SIZE;
+}
+
+/* Identity of the last checkpoint of the image open as @fd */
+static uint64_t image_checkpoint(int fd)
+{
+	union {
+		struct superblockV1 v1;
+		struct superblockV2 v2;
+	} sb;
+
+	read_all(fd, &sb, sizeof(sb), 0);
+	if (!memcmp(sb.v1.signature, FS_SIGNATURE_V1, FS_SIG_LENGTH))
+		return sb.v1.checkpointId;
+	if (!memcmp(sb.v2.signature, FS_SIGNATURE_V2, FS_SIG_LENGTH))
+		return sb.v2.checkpointId;
+	die("invalid superblock");
+}
+
+static void checkpoint(const char *diskname, const char *name)
+{
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_checkpoint(name)) {
+		fs_umount();
+		die("Cannot create checkpoint '%s'", name);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Tracking changes of '%s' since checkpoint '%s'\n", diskname,
+	       name);
+}
+
+static void export(const char *diskname, const char *deltaname)
+{
+	struct cbtHeader cbt;
+	struct delta_header header;
+	uint8_t block[BLOCK_SIZE];
+	uint8_t *bitmap;
+	char *cbtname;
+	int image, cbt_fd, delta;
+	size_t size;
+
+	image = open(diskname, O_RDONLY);
+	if (image < 0)
+		die_perror("open");
+
+	cbtname = malloc(strlen(diskname) + sizeof(FS_CBT_SUFFIX));
+	if (!cbtname)
+		die_perror("malloc");
+	strcpy(cbtname, diskname);
+	strcat(cbtname, FS_CBT_SUFFIX);
+	cbt_fd = open(cbtname, O_RDONLY);
+	if (cbt_fd < 0)
+		die("'%s' has no checkpoint", diskname);
+
+	read_all(cbt_fd, &cbt, sizeof(cbt), 0);
+	if (memcmp(cbt.magic, FS_CBT_MAGIC, FS_SIG_LENGTH) ||
+	    cbt.totalBlocks != image_blocks(image))
+		die("invalid changed-block bitmap '%s'", cbtname);
+
+	size = ((size_t)cbt.totalBlocks + 7) / 8;
+	bitmap = malloc(size);
+	if (!bitmap)
+		die_perror("malloc");
+	read_all(cbt_fd, bitmap, size, sizeof(cbt));
+	if (cbt.flags & FS_CBT_OPEN) {
+		fprintf(stderr, "'%s' is mounted or was not unmounted cleanly, "
+			"exporting every block\n", diskname);
+		memset(bitmap, 0xFF, size);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DELTA_MAGIC, FS_SIG_LENGTH);
+	header.total_blocks = cbt.totalBlocks;
+	memcpy(header.checkpoint, cbt.checkpoint, FS_CBT_NAME_LEN);
+	header.checkpoint_id = cbt.id;
+	for (uint32_t n = 0; n < cbt.totalBlocks; n++)
+		header.block_count += (bitmap[n / 8] >> (n % 8)) & 1;
+
+	delta = open(deltaname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (delta < 0)
+		die_perror("open");
+	write_all(delta, &header, sizeof(header));
+	for (uint32_t n = 0; n < cbt.totalBlocks; n++) {
+		if (!((bitmap[n / 8] >> (n % 8)) & 1))
+			continue;
+		read_all(image, block, BLOCK_SIZE, (off_t)n * BLOCK_SIZE);
+		write_all(delta, &n, sizeof(n));
+		write_all(delta, block, BLOCK_SIZE);
+	}
+	if (close(delta))
+		die_perror("close");
+
+	printf("Exported %u/%u blocks changed since checkpoint '%s'\n",
+	       header.block_count, header.total_blocks, header.checkpoint);
+
+	free(bitmap);
+	free(cbtname);
+	close(cbt_fd);
+	close(image);
+}
+
+static void apply(const char *deltaname, const char *diskname)
+{
+	struct delta_header header;
+	uint8_t block[BLOCK_SIZE];
+	int image, delta;
+	uint32_t n;
+
+	delta = open(deltaname, O_RDONLY);
+	if (delta < 0)
+		die_perror("open");
+	image = open(diskname, O_RDWR);
+	if (image < 0)
+		die_perror("open");
+
+	if (read(delta, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, DELTA_MAGIC, FS_SIG_LENGTH))
+		die("invalid delta '%s'", deltaname);
+	if (header.total_blocks != image_blocks(image))
+		die("delta is for an image of %u blocks", header.total_blocks);
+	/* the blocks left out are only right if unchanged since the checkpoint */
+	if (image_checkpoint(image) != header.checkpoint_id)
+		die("'%s' is not at checkpoint '%s'", diskname,
+		    header.checkpoint);
+
+	for (uint32_t i = 0; i < header.block_count; i++) {
+		if (read(delta, &n, sizeof(n)) != sizeof(n) ||
+		    read(delta, block, BLOCK_SIZE) != BLOCK_SIZE ||
+		    n >= header.total_blocks)
+			die("truncated delta '%s'", deltaname);
+		if (pwrite(image, block, BLOCK_SIZE, (off_t)n * BLOCK_SIZE)
+		    != BLOCK_SIZE)
+			die_perror("pwrite");
+	}
+	if (close(image))
+		die_perror("close");
+
+	printf("Applied %u blocks changed since checkpoint '%s'\n",
+	       header.block_count, header.checkpoint);
+
+	close(delta);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 4)
+		die(USAGE);
+
+	if (!strcmp(argv[1], "checkpoint"))
+		checkpoint(argv[2], argv[3]);
+	else if (!strcmp(argv[1], "export"))
+		export(argv[2], argv[3]);
+	else if (!strcmp(argv[1], "apply"))
+		apply(argv[2], argv[3]);
+	else
+		die(USAGE);
+
+	return 0;
+}
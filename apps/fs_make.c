@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fs_format.h>
+
+#define make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Number of zeroed blocks written at once, on devices without holes */
+#define ZERO_CHUNK 64
+
+struct layout {
+	int version;
+	uint32_t data_blocks;
+	uint32_t cluster_blocks;
+	uint32_t features;
+	uint32_t fat_blocks;
+	uint32_t root_index;
+	uint32_t data_start;
+	uint32_t total_blocks;
+};
+
+/* Features that -O can turn on and off */
+static const struct {
+	const char *name;
+	uint32_t flag;
+} features[] = {
+	{ "pack",	FS_FEATURE_PACK },
+	{ "dirs",	FS_FEATURE_DIRS },
+	{ "extents",	FS_FEATURE_EXTENTS },
+	{ "compress",	FS_FEATURE_COMPRESS },
+	{ "dedup",	FS_FEATURE_DEDUP },
+};
+
+/* Features of version 2 images unless -O says otherwise */
+#define DEFAULT_FEATURES (FS_FEATURE_PACK | FS_FEATURE_DIRS)
+
+#define USAGE "Usage: [-F 16|32] [-c <blocks per cluster>] " \
+	"[-O [^]<feature>,...] [-p] <diskname> <data block count>"
+
+/* Apply a comma-separated list of features, each prefixed by ^ to clear it */
+static void parse_features(char *list, uint32_t *flags)
+{
+	char *name;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		int clear = name[0] == '^';
+		size_t i;
+
+		if (clear)
+			name++;
+		for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+			if (!strcmp(name, features[i].name))
+				break;
+		}
+		if (i == sizeof(features) / sizeof(features[0]))
+			die("unknown feature '%s'", name);
+
+		if (clear)
+			*flags &= ~features[i].flag;
+		else
+			*flags |= features[i].flag;
+	}
+}
+
+static void write_block(int fd, uint32_t index, const void *buf)
+{
+	if (pwrite(fd, buf, BLOCK_SIZE, (off_t)index * BLOCK_SIZE) !=
+	    BLOCK_SIZE)
+		die_perror("pwrite");
+}
+
+static void write_superblock(int fd, struct layout *l)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	memset(block, 0, BLOCK_SIZE);
+	if (l->version == FS_VERSION_1) {
+		struct superblockV1 *sb = (struct superblockV1 *)block;
+
+		memcpy(sb->signature, FS_SIGNATURE_V1, FS_SIG_LENGTH);
+		sb->totalBlocks = l->total_blocks;
+		sb->rootIndex = l->root_index;
+		sb->dataStart = l->data_start;
+		sb->dataBlocks = l->data_blocks;
+		sb->fatBlocks = l->fat_blocks;
+	} else {
+		struct superblockV2 *sb = (struct superblockV2 *)block;
+
+		memcpy(sb->signature, FS_SIGNATURE_V2, FS_SIG_LENGTH);
+		sb->version = FS_VERSION_2;
+		sb->totalBlocks = l->total_blocks;
+		sb->rootIndex = l->root_index;
+		sb->dataStart = l->data_start;
+		sb->dataBlocks = l->data_blocks;
+		sb->fatBlocks = l->fat_blocks;
+		sb->clusterBlocks = l->cluster_blocks;
+		sb->features = l->features;
+	}
+	write_block(fd, FS_SUPERBLOCK_INDEX, block);
+}
+
+/*
+ * Only the first FAT block holds a nonzero entry, the reserved first
+ * cluster: the other ones, like the empty root directory, are all zeroes
+ */
+static void write_fat(int fd, struct layout *l)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	memset(block, 0, BLOCK_SIZE);
+	if (l->version == FS_VERSION_1)
+		((uint16_t *)block)[0] = FS_FAT_EOC_V1;
+	else
+		((uint32_t *)block)[0] = FS_FAT_EOC_V2;
+	write_block(fd, 1, block);
+}
+
+static void write_zeroes(int fd, uint32_t index, uint32_t blocks)
+{
+	static uint8_t zeroes[ZERO_CHUNK * BLOCK_SIZE];
+
+	while (blocks) {
+		uint32_t n = blocks < ZERO_CHUNK ? blocks : ZERO_CHUNK;
+
+		if (pwrite(fd, zeroes, (size_t)n * BLOCK_SIZE,
+			   (off_t)index * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE)
+			die_perror("pwrite");
+		index += n;
+		blocks -= n;
+	}
+}
+
+/*
+ * Give the image its size without writing its zeroed blocks: a regular file
+ * is left with holes, which read as zeroes, and its blocks are only
+ * allocated if asked to (they then read as zeroes too). On anything else,
+ * the zeroed metadata blocks must be written, but the data blocks are free
+ * and their content does not matter.
+ */
+static void size_image(int fd, struct layout *l, int preallocate)
+{
+	off_t size = (off_t)l->total_blocks * BLOCK_SIZE;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode)) {
+		/* FAT blocks but the first one, and root directory */
+		write_zeroes(fd, 2, l->fat_blocks);
+		return;
+	}
+
+	if (ftruncate(fd, size))
+		die_perror("ftruncate");
+	if (preallocate && fallocate(fd, 0, 0, size)) {
+		if (errno != EOPNOTSUPP)
+			die_perror("fallocate");
+		make_error("cannot preallocate, image left sparse");
+	}
+}
+
+/*
+ * Remove the file with suffix @suffix kept next to a previous image named
+ * @diskname, which describes a filesystem that no longer exists
+ */
+static void remove_sidecar(const char *diskname, const char *suffix)
+{
+	char *name;
+
+	name = malloc(strlen(diskname) + strlen(suffix) + 1);
+	if (!name)
+		die_perror("malloc");
+	strcpy(name, diskname);
+	strcat(name, suffix);
+	if (unlink(name) && errno != ENOENT)
+		die_perror(name);
+	free(name);
+}
+
+int main(int argc, char **argv)
+{
+	struct layout l = { .version = FS_VERSION_1, .cluster_blocks = 1,
+			    .features = DEFAULT_FEATURES };
+	int features_set = 0, preallocate = 0;
+	uint32_t max_blocks;
+	char *diskname, *end;
+	unsigned long count;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "F:c:O:p")) != -1) {
+		switch (opt) {
+		case 'F':
+			if (!strcmp(optarg, "16"))
+				l.version = FS_VERSION_1;
+			else if (!strcmp(optarg, "32"))
+				l.version = FS_VERSION_2;
+			else
+				die("FAT entry size must be 16 or 32 bits");
+			break;
+		case 'c':
+			count = strtoul(optarg, &end, 0);
+			if (*end != '\0' || count < FS_MIN_CLUSTER_BLOCKS ||
+			    count > FS_MAX_CLUSTER_BLOCKS)
+				die("cluster size invalid, range is [%d, %d] blocks",
+				    FS_MIN_CLUSTER_BLOCKS, FS_MAX_CLUSTER_BLOCKS);
+			l.cluster_blocks = count;
+			break;
+		case 'O':
+			parse_features(optarg, &l.features);
+			features_set = 1;
+			break;
+		case 'p':
+			preallocate = 1;
+			break;
+		default:
+			die(USAGE);
+		}
+	}
+
+	if (optind + 2 != argc)
+		die(USAGE);
+	if (l.version == FS_VERSION_1 && l.cluster_blocks != 1)
+		die("clusters require the 32-bit format (-F 32)");
+	if (l.version == FS_VERSION_1 && features_set)
+		die("features require the 32-bit format (-F 32)");
+	if (l.version == FS_VERSION_1)
+		l.features = 0;
+	/* Shared clusters are counted by the FAT entries of extent-mapped data */
+	if ((l.features & FS_FEATURE_DEDUP) && !(l.features & FS_FEATURE_EXTENTS))
+		die("dedup requires extents (-O extents,dedup)");
+
+	diskname = argv[optind];
+	max_blocks = l.version == FS_VERSION_1 ? FS_MAX_DATA_BLOCKS_V1
+					       : FS_MAX_DATA_BLOCKS_V2;
+	count = strtoul(argv[optind + 1], &end, 0);
+	if (*end != '\0' || count < 1 || count > max_blocks)
+		die("data block count invalid, range is [1, %u]", max_blocks);
+
+	/* The data region is made of whole clusters */
+	l.data_blocks = count;
+	if (l.data_blocks % l.cluster_blocks) {
+		if (l.data_blocks > max_blocks / l.cluster_blocks * l.cluster_blocks)
+			die("data block count invalid, range is [1, %u]", max_blocks);
+		l.data_blocks += l.cluster_blocks - l.data_blocks % l.cluster_blocks;
+	}
+	l.fat_blocks = fsFatBlocks(l.version, l.data_blocks / l.cluster_blocks);
+	l.root_index = l.fat_blocks + 1;
+	l.data_start = l.root_index + 1;
+	l.total_blocks = l.data_start + l.data_blocks;
+
+	fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+	remove_sidecar(diskname, FS_CBT_SUFFIX);
+	remove_sidecar(diskname, FS_DDT_SUFFIX);
+
+	size_image(fd, &l, preallocate);
+	write_superblock(fd, &l);
+	write_fat(fd, &l);
+
+	if (close(fd))
+		die_perror("close");
+
+	printf("Created virtual disk '%s' with '%u' data blocks\n", diskname,
+	       l.data_blocks);
+
+	return 0;
+}
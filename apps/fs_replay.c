@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_ext.h>
+#include <fs_sim.h>
+#include <fs_trace.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+static const char *op_names[] = {
+	[FS_TRACE_MOUNT]	= "mount",
+	[FS_TRACE_UMOUNT]	= "umount",
+	[FS_TRACE_INFO]		= "info",
+	[FS_TRACE_CREATE]	= "create",
+	[FS_TRACE_DELETE]	= "delete",
+	[FS_TRACE_LS]		= "ls",
+	[FS_TRACE_OPEN]		= "open",
+	[FS_TRACE_CLOSE]	= "close",
+	[FS_TRACE_STAT]		= "stat",
+	[FS_TRACE_LSEEK]	= "lseek",
+	[FS_TRACE_WRITE]	= "write",
+	[FS_TRACE_READ]		= "read",
+	[FS_TRACE_MKDIR]	= "mkdir",
+	[FS_TRACE_RMDIR]	= "rmdir",
+	[FS_TRACE_LSDIR]	= "lsdir",
+	[FS_TRACE_READ_VIEW]	= "view",
+	[FS_TRACE_RELEASE_VIEW]	= "release",
+	[FS_TRACE_EXPORT]	= "export",
+	[FS_TRACE_IMPORT]	= "import",
+	[FS_TRACE_CLONE]	= "clone",
+	[FS_TRACE_CHECKPOINT]	= "checkpt",
+	[FS_TRACE_COMPRESS]	= "compress",
+	[FS_TRACE_FSTAT]	= "fstat",
+	[FS_TRACE_CREATE_MANY]	= "mcreate",
+	[FS_TRACE_DELETE_MANY]	= "mdelete",
+	[FS_TRACE_STAT_MANY]	= "mstat",
+	[FS_TRACE_PWRITE]	= "pwrite",
+	[FS_TRACE_PREAD]	= "pread",
+	[FS_TRACE_WRITEV]	= "writev",
+	[FS_TRACE_READV]	= "readv",
+	[FS_TRACE_OPEN_APPEND]	= "oappend",
+	[FS_TRACE_FSYNC]	= "fsync",
+	[FS_TRACE_TRUNCATE]	= "truncate",
+};
+
+#define OP_COUNT ARRAY_SIZE(op_names)
+
+/* Latencies measured for one operation type, in ns */
+struct op_stats {
+	uint64_t *samples;
+	size_t count;
+	size_t capacity;
+	/* Sum of the durations recorded in the trace */
+	uint64_t recorded;
+	long mismatches;
+};
+
+struct replay {
+	const char *diskname;
+	int timed;
+	double speed;
+	int verbose;
+	/* Recorded file descriptor -> replayed file descriptor */
+	int fds[FS_OPEN_MAX_COUNT];
+	int mounted;
+	char *buf;
+	size_t buf_size;
+	int saved_stdout;
+	int devnull;
+	struct op_stats stats[OP_COUNT];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	uint64_t now = now_ns();
+	struct timespec ts;
+
+	if (now >= deadline)
+		return;
+	ts.tv_sec = (deadline - now) / 1000000000ULL;
+	ts.tv_nsec = (deadline - now) % 1000000000ULL;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static const char *op_name(unsigned int op)
+{
+	if (op < OP_COUNT && op_names[op])
+		return op_names[op];
+	return "unknown";
+}
+
+static FILE *open_trace(const char *filename, struct fs_trace_header *header)
+{
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f)
+		die_perror(filename);
+	if (fread(header, sizeof(*header), 1, f) != 1 ||
+	    memcmp(header->magic, FS_TRACE_MAGIC, sizeof(header->magic)))
+		die("'%s' is not a libfs trace", filename);
+	if (header->version < 1 || header->version > FS_TRACE_VERSION ||
+	    header->record_size < offsetof(struct fs_trace_record, offset))
+		die("'%s' uses unsupported trace version %u", filename,
+		    header->version);
+	return f;
+}
+
+static int read_record(FILE *f, struct fs_trace_header *header,
+		       struct fs_trace_record *rec)
+{
+	size_t size = header->record_size < sizeof(*rec) ? header->record_size
+							 : sizeof(*rec);
+
+	/* Fields added after the writer are left to 0 */
+	memset(rec, 0, sizeof(*rec));
+	if (fread(rec, size, 1, f) != 1)
+		return -1;
+	/* Skip fields added by newer writers */
+	if (header->record_size > sizeof(*rec))
+		fseek(f, header->record_size - sizeof(*rec), SEEK_CUR);
+	rec->name[FS_TRACE_NAME_LEN - 1] = '\0';
+	return 0;
+}
+
+/*
+ * Replay
+ */
+static int map_fd(struct replay *r, int fd)
+{
+	if (fd >= 0 && fd < FS_OPEN_MAX_COUNT && r->fds[fd] >= 0)
+		return r->fds[fd];
+	/* Unknown descriptor: replay the call with it unchanged */
+	return fd;
+}
+
+static char *get_buf(struct replay *r, size_t size)
+{
+	if (size > r->buf_size) {
+		free(r->buf);
+		r->buf = malloc(size);
+		if (!r->buf)
+			die_perror("malloc");
+		memset(r->buf, 'r', size);
+		r->buf_size = size;
+	}
+	return r->buf;
+}
+
+static void quiet(struct replay *r, int on)
+{
+	if (r->verbose)
+		return;
+	fflush(stdout);
+	dup2(on ? r->devnull : r->saved_stdout, STDOUT_FILENO);
+}
+
+static int64_t execute(struct replay *r, struct fs_trace_record *rec)
+{
+	int fd = map_fd(r, rec->fd);
+	int64_t ret;
+
+	switch (rec->op) {
+	case FS_TRACE_MOUNT:
+		ret = fs_mount(r->diskname);
+		if (!ret)
+			r->mounted = 1;
+		return ret;
+	case FS_TRACE_UMOUNT:
+		ret = fs_umount();
+		if (!ret)
+			r->mounted = 0;
+		return ret;
+	case FS_TRACE_INFO:
+		quiet(r, 1);
+		ret = fs_info();
+		quiet(r, 0);
+		return ret;
+	case FS_TRACE_CREATE:
+		return fs_create(rec->name);
+	case FS_TRACE_DELETE:
+		return fs_delete(rec->name);
+	case FS_TRACE_LS:
+		quiet(r, 1);
+		ret = fs_ls();
+		quiet(r, 0);
+		return ret;
+	case FS_TRACE_OPEN:
+	case FS_TRACE_OPEN_APPEND:
+		if (rec->op == FS_TRACE_OPEN)
+			ret = fs_open(rec->name);
+		else
+			ret = fs_open_append(rec->name);
+		if (rec->result >= 0 && rec->result < FS_OPEN_MAX_COUNT)
+			r->fds[rec->result] = ret;
+		return ret;
+	case FS_TRACE_CLOSE:
+		ret = fs_close(fd);
+		if (!ret && rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT)
+			r->fds[rec->fd] = -1;
+		return ret;
+	case FS_TRACE_STAT:
+		return fs_stat(fd);
+	case FS_TRACE_LSEEK:
+		return fs_lseek(fd, rec->arg);
+	case FS_TRACE_WRITE:
+		return fs_write(fd, get_buf(r, rec->arg), rec->arg);
+	case FS_TRACE_READ:
+		return fs_read(fd, get_buf(r, rec->arg), rec->arg);
+	case FS_TRACE_PWRITE:
+		return fs_pwrite(fd, get_buf(r, rec->arg), rec->arg, rec->offset);
+	case FS_TRACE_PREAD:
+		return fs_pread(fd, get_buf(r, rec->arg), rec->arg, rec->offset);
+	case FS_TRACE_WRITEV:
+	case FS_TRACE_READV: {
+		/* Only the total length of the buffers is recorded */
+		struct iovec iov = { get_buf(r, rec->arg), rec->arg };
+
+		if (rec->op == FS_TRACE_WRITEV)
+			return fs_writev(fd, &iov, 1);
+		return fs_readv(fd, &iov, 1);
+	}
+	case FS_TRACE_FSYNC:
+		return fs_fsync(fd);
+	case FS_TRACE_TRUNCATE:
+		return fs_truncate(fd, rec->arg);
+	case FS_TRACE_MKDIR:
+		return fs_mkdir(rec->name);
+	case FS_TRACE_RMDIR:
+		return fs_rmdir(rec->name);
+	case FS_TRACE_LSDIR:
+		quiet(r, 1);
+		ret = fs_lsdir(rec->name);
+		quiet(r, 0);
+		return ret;
+	case FS_TRACE_READ_VIEW: {
+		/*
+		 * Records do not tell which view a release is for: views are
+		 * released right away, and releases replayed as no-ops
+		 */
+		struct fs_view view;
+
+		ret = fs_read_view(fd, rec->arg, &view);
+		if (ret >= 0)
+			fs_release_view(&view);
+		return ret;
+	}
+	case FS_TRACE_RELEASE_VIEW:
+		return rec->result;
+	case FS_TRACE_CLONE: {
+		char *dst = strchr(rec->name, '\t');
+
+		if (!dst)
+			return -1;
+		*dst++ = '\0';
+		ret = fs_clone(rec->name, dst);
+		dst[-1] = '\t';
+		return ret;
+	}
+	case FS_TRACE_COMPRESS:
+		return fs_compress(fd);
+	case FS_TRACE_FSTAT: {
+		struct fs_file_stat st;
+
+		return fs_fstat(fd, &st);
+	}
+	case FS_TRACE_CREATE_MANY:
+	case FS_TRACE_DELETE_MANY:
+	case FS_TRACE_STAT_MANY: {
+		/* Batches are recorded name by name, each replayed on its own */
+		const char *name = rec->name;
+		int result;
+
+		if (rec->op == FS_TRACE_CREATE_MANY)
+			ret = fs_create_many(&name, 1, &result);
+		else if (rec->op == FS_TRACE_DELETE_MANY)
+			ret = fs_delete_many(&name, 1, &result);
+		else
+			ret = fs_stat_many(&name, 1, &result);
+		return ret < 0 ? ret : result;
+	}
+	case FS_TRACE_CHECKPOINT:
+		return fs_checkpoint(rec->name);
+	case FS_TRACE_EXPORT:
+		return fs_export_to_fd(fd, r->devnull);
+	case FS_TRACE_IMPORT: {
+		/* Import as many bytes as the recorded call did, from a sparse file */
+		FILE *src = tmpfile();
+
+		if (!src)
+			die_perror("tmpfile");
+		if (rec->result > 0 && ftruncate(fileno(src), rec->result))
+			die_perror("ftruncate");
+		ret = fs_import_from_fd(fileno(src), rec->name);
+		fclose(src);
+		return ret;
+	}
+	}
+
+	die("unknown operation %u in trace", rec->op);
+}
+
+static void add_sample(struct op_stats *s, uint64_t ns)
+{
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? s->capacity * 2 : 1024;
+		s->samples = realloc(s->samples, s->capacity * sizeof(uint64_t));
+		if (!s->samples)
+			die_perror("realloc");
+	}
+	s->samples[s->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(struct replay *r, uint64_t elapsed)
+{
+	struct fs_sim_stats sim;
+	long mismatches = 0;
+
+	printf("%-8s %8s %10s %10s %10s %10s %12s %6s\n", "op", "count",
+	       "mean(us)", "p50(us)", "p99(us)", "max(us)", "recorded(us)",
+	       "diff");
+	for (size_t op = 0; op < OP_COUNT; op++) {
+		struct op_stats *s = &r->stats[op];
+		uint64_t total = 0;
+
+		if (!s->count)
+			continue;
+
+		qsort(s->samples, s->count, sizeof(uint64_t), cmp_u64);
+		for (size_t i = 0; i < s->count; i++)
+			total += s->samples[i];
+
+		printf("%-8s %8zu %10.2f %10.2f %10.2f %10.2f %12.2f %6ld\n",
+		       op_name(op), s->count, total / 1e3 / s->count,
+		       s->samples[s->count / 2] / 1e3,
+		       s->samples[(size_t)(0.99 * (s->count - 1))] / 1e3,
+		       s->samples[s->count - 1] / 1e3,
+		       s->recorded / 1e3 / s->count, s->mismatches);
+		mismatches += s->mismatches;
+		free(s->samples);
+	}
+	printf("replayed in %.3f ms, %ld result(s) differ from the trace\n",
+	       elapsed / 1e6, mismatches);
+
+	if (!fs_sim_stats(&sim))
+		printf("device: %llu reads (%llu blocks), %llu writes "
+		       "(%llu blocks), %llu seeks, %llu errors, busy %.3f ms\n",
+		       (unsigned long long)sim.reads,
+		       (unsigned long long)sim.read_blocks,
+		       (unsigned long long)sim.writes,
+		       (unsigned long long)sim.write_blocks,
+		       (unsigned long long)sim.seeks,
+		       (unsigned long long)sim.errors, sim.busy_ns / 1e6);
+}
+
+static void replay(struct replay *r, const char *tracename)
+{
+	struct fs_trace_header header;
+	struct fs_trace_record rec;
+	uint64_t origin;
+	FILE *f;
+
+	f = open_trace(tracename, &header);
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		r->fds[i] = -1;
+	fflush(stdout);
+	r->saved_stdout = dup(STDOUT_FILENO);
+	r->devnull = open("/dev/null", O_WRONLY);
+	if (r->saved_stdout < 0 || r->devnull < 0)
+		die_perror("dup");
+
+	origin = now_ns();
+	while (!read_record(f, &header, &rec)) {
+		struct op_stats *s;
+		uint64_t start;
+		int64_t ret;
+
+		if (rec.op >= OP_COUNT || !op_names[rec.op])
+			die("unknown operation %u in trace", rec.op);
+
+		if (r->timed)
+			sleep_until(origin + rec.timestamp / r->speed);
+
+		start = now_ns();
+		ret = execute(r, &rec);
+		s = &r->stats[rec.op];
+		add_sample(s, now_ns() - start);
+		s->recorded += rec.duration;
+
+		if (ret != rec.result) {
+			s->mismatches++;
+			if (r->verbose)
+				fprintf(stderr, "%s(%d, '%s', %llu): got %lld, "
+					"trace has %lld\n", op_name(rec.op), rec.fd,
+					rec.name, (unsigned long long)rec.arg,
+					(long long)ret, (long long)rec.result);
+		}
+	}
+
+	/* The recorded session may have ended without cleaning up */
+	if (r->mounted) {
+		for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+			if (r->fds[i] >= 0)
+				fs_close(r->fds[i]);
+		}
+		fs_umount();
+	}
+
+	close(r->devnull);
+	close(r->saved_stdout);
+	fclose(f);
+	free(r->buf);
+
+	report(r, now_ns() - origin);
+}
+
+/*
+ * Dump
+ */
+static void dump(const char *tracename)
+{
+	struct fs_trace_header header;
+	struct fs_trace_record rec;
+	FILE *f;
+
+	f = open_trace(tracename, &header);
+	printf("%14s %10s %-8s %4s %10s %10s %8s %s\n", "time(us)", "dur(us)",
+	       "op", "fd", "arg", "offset", "result", "name");
+	while (!read_record(f, &header, &rec)) {
+		printf("%14.3f %10.3f %-8s %4d %10llu %10llu %8lld %s\n",
+		       rec.timestamp / 1e3, rec.duration / 1e3, op_name(rec.op),
+		       rec.fd, (unsigned long long)rec.arg,
+		       (unsigned long long)rec.offset, (long long)rec.result,
+		       rec.name);
+	}
+	fclose(f);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"Usage: %s [-t] [-s <speed>] [-v] [-D <device>] <diskname> "
+		"<trace file>\n"
+		"       %s -d <trace file>\n"
+		"\t-t\treplay with the original timing (default: as fast as possible)\n"
+		"\t-s\tspeed factor applied to the original timing\n"
+		"\t-v\tshow the output of info/ls and every mismatching result\n"
+		"\t-D\treplay on a simulated device (see fs_sim.h), e.g. 'hdd'\n"
+		"\t-d\tprint the content of a trace\n", program, program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay r = { .speed = 1.0 };
+	int dump_only = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ts:vdD:")) != -1) {
+		switch (opt) {
+		case 't':
+			r.timed = 1;
+			break;
+		case 's':
+			r.speed = atof(optarg);
+			if (r.speed <= 0)
+				die("invalid speed '%s'", optarg);
+			break;
+		case 'v':
+			r.verbose = 1;
+			break;
+		case 'd':
+			dump_only = 1;
+			break;
+		case 'D':
+			if (fs_sim_start(optarg))
+				die("invalid device '%s'", optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (dump_only) {
+		if (optind + 1 != argc)
+			usage(argv[0]);
+		dump(argv[optind]);
+		return 0;
+	}
+
+	if (optind + 2 != argc)
+		usage(argv[0]);
+	r.diskname = argv[optind];
+	replay(&r, argv[optind + 1]);
+
+	return 0;
+}
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_server.h>
+
+#define server_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	server_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Maximum number of clients connected at the same time */
+#define MAX_CLIENTS 64
+
+/* Time a client is given to make room for a reply, in ms */
+#define SEND_TIMEOUT 1000
+
+struct client {
+	int sock;
+	/* Shared memory region, NULL until the client said hello */
+	uint8_t *shm;
+	/* Shared memory sent along with the hello request, -1 until then */
+	int memfd;
+	/*
+	 * Requests received so far, the first one with its inline payload,
+	 * possibly followed by the start of the next ones
+	 */
+	uint8_t in[sizeof(struct fs_server_request) + FS_SERVER_INLINE_MAX];
+	size_t in_length;
+	/* File descriptors of libfs opened by the client */
+	uint8_t fds[FS_OPEN_MAX_COUNT];
+};
+
+static struct client clients[MAX_CLIENTS];
+static int client_count;
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int signum)
+{
+	(void)signum;
+	stopping = 1;
+}
+
+/*
+ * Send @count bytes to non-blocking socket @sock, waiting a little for room
+ * when it is full: a client that does not read its replies is given up
+ */
+static int send_all(int sock, const void *buf, size_t count)
+{
+	const uint8_t *p = buf;
+
+	while (count > 0) {
+		ssize_t n = send(sock, p, count, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+			int ret = poll(&pfd, 1, SEND_TIMEOUT);
+
+			if (ret == 0 || (ret < 0 && errno != EINTR))
+				return -1;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Run fs_info() or fs_ls(), collecting what they print into @text and
+ * setting the length of @reply to its size
+ */
+static int run_printing(int (*call)(void), char **text,
+			struct fs_server_reply *reply)
+{
+	int memfd, saved, ret;
+	off_t size;
+
+	*text = NULL;
+	reply->length = 0;
+
+	memfd = memfd_create("fs_server", MFD_CLOEXEC);
+	if (memfd < 0)
+		return -1;
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	if (saved < 0 || dup2(memfd, STDOUT_FILENO) < 0) {
+		close(memfd);
+		return -1;
+	}
+	ret = call();
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	size = lseek(memfd, 0, SEEK_END);
+	if (size > 0) {
+		*text = malloc(size);
+		if (*text && pread(memfd, *text, size, 0) == size)
+			reply->length = size;
+	}
+	close(memfd);
+
+	return ret;
+}
+
+/* Map the shared memory region sent along with the first request @req */
+static int hello(struct client *c, const struct fs_server_request *req)
+{
+	struct fs_server_reply reply = { 0 };
+	struct stat st;
+	int seals;
+
+	if (req->op != FS_SERVER_HELLO || c->memfd < 0)
+		return -1;
+
+	/*
+	 * A region that could shrink would crash the server when accessed,
+	 * and only a memfd can be sealed
+	 */
+	seals = fcntl(c->memfd, F_GET_SEALS);
+	if (fstat(c->memfd, &st) || st.st_size < FS_SERVER_SHM_SIZE ||
+	    seals == -1 || !(seals & F_SEAL_SHRINK))
+		return -1;
+	c->shm = mmap(NULL, FS_SERVER_SHM_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, c->memfd, 0);
+	close(c->memfd);
+	c->memfd = -1;
+	if (c->shm == MAP_FAILED) {
+		c->shm = NULL;
+		return -1;
+	}
+
+	return send_all(c->sock, &reply, sizeof(reply));
+}
+
+static int owns(struct client *c, int32_t fd)
+{
+	return fd >= 0 && fd < FS_OPEN_MAX_COUNT && c->fds[fd];
+}
+
+/*
+ * Length of the request at the start of the input of client @c, with its
+ * inline payload: 0 if its header is not fully received yet, -1 if it is
+ * invalid
+ */
+static ssize_t request_length(struct client *c)
+{
+	struct fs_server_request req;
+
+	if (c->in_length < sizeof(req))
+		return 0;
+	memcpy(&req, c->in, sizeof(req));
+
+	/* Check the sizes of the payloads before anything else */
+	if (req.op == FS_SERVER_WRITE || req.op == FS_SERVER_READ) {
+		size_t max = req.flags & FS_SERVER_SHM ? FS_SERVER_SHM_SIZE
+						       : FS_SERVER_INLINE_MAX;
+
+		if (req.arg > max)
+			return -1;
+		if (req.op == FS_SERVER_WRITE && !(req.flags & FS_SERVER_SHM))
+			return sizeof(req) + req.arg;
+	}
+
+	return sizeof(req);
+}
+
+/*
+ * Serve the request at the start of the input of client @c, fully
+ * received, return -1 to disconnect it
+ */
+static int serve(struct client *c)
+{
+	struct fs_server_request req;
+	struct fs_server_reply reply = { 0 };
+	uint8_t data[FS_SERVER_INLINE_MAX];
+	const void *payload = NULL;
+	char *text = NULL;
+	int ret;
+
+	memcpy(&req, c->in, sizeof(req));
+	if (!c->shm)
+		return hello(c, &req);
+	if (!memchr(req.name, '\0', FS_FILENAME_LEN))
+		return -1;
+
+	switch (req.op) {
+	case FS_SERVER_INFO:
+		reply.result = run_printing(fs_info, &text, &reply);
+		payload = text;
+		break;
+	case FS_SERVER_LS:
+		reply.result = run_printing(fs_ls, &text, &reply);
+		payload = text;
+		break;
+	case FS_SERVER_CREATE:
+		reply.result = fs_create(req.name);
+		break;
+	case FS_SERVER_DELETE:
+		reply.result = fs_delete(req.name);
+		break;
+	case FS_SERVER_OPEN:
+		ret = fs_open(req.name);
+		if (ret >= 0)
+			c->fds[ret] = 1;
+		reply.result = ret;
+		break;
+	case FS_SERVER_CLOSE:
+		reply.result = owns(c, req.fd) ? fs_close(req.fd) : -1;
+		if (reply.result == 0)
+			c->fds[req.fd] = 0;
+		break;
+	case FS_SERVER_STAT:
+		reply.result = owns(c, req.fd) ? fs_stat(req.fd) : -1;
+		break;
+	case FS_SERVER_LSEEK:
+		reply.result = owns(c, req.fd) ? fs_lseek(req.fd, req.arg) : -1;
+		break;
+	case FS_SERVER_WRITE:
+		reply.result = owns(c, req.fd) ?
+			fs_write(req.fd, req.flags & FS_SERVER_SHM ? c->shm :
+				 c->in + sizeof(req), req.arg) : -1;
+		break;
+	case FS_SERVER_READ:
+		reply.result = owns(c, req.fd) ?
+			fs_read(req.fd, req.flags & FS_SERVER_SHM ? c->shm : data,
+				req.arg) : -1;
+		if (!(req.flags & FS_SERVER_SHM) && reply.result > 0) {
+			reply.length = reply.result;
+			payload = data;
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	ret = send_all(c->sock, &reply, sizeof(reply));
+	if (!ret && reply.length)
+		ret = send_all(c->sock, payload, reply.length);
+	free(text);
+
+	return ret;
+}
+
+/*
+ * Receive what client @c sent, without waiting, and serve the requests it
+ * completes: return -1 to disconnect it
+ */
+static int receive(struct client *c)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	for (;;) {
+		struct iovec iov = { c->in + c->in_length,
+				     sizeof(c->in) - c->in_length };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		struct cmsghdr *cmsg;
+		ssize_t n, length;
+
+		n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return -1;
+		c->in_length += n;
+
+		/* Only the hello request comes with a file descriptor */
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS ||
+			    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+				return -1;
+			if (c->shm || c->memfd >= 0) {
+				int fd;
+
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+				close(fd);
+				return -1;
+			}
+			memcpy(&c->memfd, CMSG_DATA(cmsg), sizeof(int));
+		}
+		if (msg.msg_flags & MSG_CTRUNC)
+			return -1;
+
+		/*
+		 * What is left is the start of a request, which fits in the
+		 * buffer, so that there is always room for more
+		 */
+		while ((length = request_length(c)) != 0) {
+			if (length < 0 || (size_t)length > c->in_length)
+				break;
+			if (serve(c))
+				return -1;
+			c->in_length -= length;
+			memmove(c->in, c->in + length, c->in_length);
+		}
+		if (length < 0)
+			return -1;
+	}
+}
+
+/* Forget client @i, closing the files it left open */
+static void drop_client(int i)
+{
+	struct client *c = &clients[i];
+
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++) {
+		if (c->fds[fd])
+			fs_close(fd);
+	}
+	if (c->shm)
+		munmap(c->shm, FS_SERVER_SHM_SIZE);
+	if (c->memfd >= 0)
+		close(c->memfd);
+	close(c->sock);
+
+	clients[i] = clients[--client_count];
+}
+
+static void accept_client(int listener)
+{
+	int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+	if (sock < 0)
+		return;
+	if (client_count == MAX_CLIENTS) {
+		server_error("too many clients");
+		close(sock);
+		return;
+	}
+
+	memset(&clients[client_count], 0, sizeof(struct client));
+	clients[client_count].memfd = -1;
+	clients[client_count++].sock = sock;
+}
+
+/* Listen on the socket of @diskname, unless another server already does */
+static int listen_on(const char *diskname, struct sockaddr_un *addr)
+{
+	struct sockaddr_un tmp = { .sun_family = AF_UNIX };
+	int sock;
+
+	addr->sun_family = AF_UNIX;
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s", diskname,
+		     FS_SERVER_SUFFIX) >= (int)sizeof(addr->sun_path) ||
+	    snprintf(tmp.sun_path, sizeof(tmp.sun_path), "%s.%d",
+		     addr->sun_path, getpid()) >= (int)sizeof(tmp.sun_path))
+		die("disk name '%s' too long", diskname);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	if (!connect(sock, (struct sockaddr *)addr, sizeof(*addr)))
+		die("'%s' is already served", diskname);
+	close(sock);
+
+	/*
+	 * Only show the socket once it accepts connections, replacing the one
+	 * left behind by a server that did not exit cleanly
+	 */
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	unlink(tmp.sun_path);
+	if (bind(sock, (struct sockaddr *)&tmp, sizeof(tmp)) ||
+	    listen(sock, SOMAXCONN))
+		die_perror("bind");
+	if (rename(tmp.sun_path, addr->sun_path)) {
+		unlink(tmp.sun_path);
+		die_perror("rename");
+	}
+
+	return sock;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int listener;
+
+	if (argc != 2)
+		die("Usage: %s <diskname>", argv[0]);
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	listener = listen_on(argv[1], &addr);
+
+	/* Let poll() be interrupted, so as to unmount the image cleanly */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Serving '%s' on '%s'\n", argv[1], addr.sun_path);
+	fflush(stdout);
+
+	while (!stopping) {
+		fds[0] = (struct pollfd){ .fd = listener, .events = POLLIN };
+		for (int i = 0; i < client_count; i++)
+			fds[i + 1] = (struct pollfd){ .fd = clients[i].sock,
+						      .events = POLLIN };
+
+		if (poll(fds, client_count + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+
+		/* Backwards, as dropping a client moves the last one */
+		for (int i = client_count - 1; i >= 0; i--) {
+			if (fds[i + 1].revents && receive(&clients[i]))
+				drop_client(i);
+		}
+		if (fds[0].revents & POLLIN)
+			accept_client(listener);
+	}
+
+	while (client_count > 0)
+		drop_client(client_count - 1);
+	close(listener);
+	unlink(addr.sun_path);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Unmounted '%s'\n", argv[1]);
+
+	return 0;
+}
@@ -0,0 +1,569 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define workload_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	workload_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Maximum number of jobs in a job file */
+#define MAX_JOBS 32
+
+/* Maximum number of entries in a bssplit= list */
+#define MAX_BS_SPLIT 8
+
+/* Maximum number of threads per job */
+#define MAX_THREADS 64
+
+/* Upper bound on a single I/O, keeps per-thread buffers reasonable */
+#define MAX_BS (1024 * 1024)
+
+enum pattern {
+	PATTERN_SEQ,
+	PATTERN_RAND,
+};
+
+struct bs_split {
+	size_t size;
+	/* Percentage of operations using this size */
+	int weight;
+};
+
+struct job {
+	char name[32];
+	enum pattern pattern;
+	/* Percentage of reads set by the rw mode, -1 for the mixed modes */
+	int mode_mix;
+	/* Percentage of reads of the mixed modes (rwmixread) */
+	int rwmixread;
+	/* Percentage of operations that are reads (0-100), from both above */
+	int read_mix;
+	struct bs_split bs[MAX_BS_SPLIT];
+	int bs_count;
+	int nrfiles;
+	size_t filesize;
+	int threads;
+	/* Run time in seconds, and optional per-thread operation cap */
+	double runtime;
+	long number_ios;
+	/* Pause between two operations of a thread, in microseconds */
+	long thinktime;
+	unsigned int seed;
+};
+
+/* Latency samples of one operation type, in nanoseconds */
+struct lat_log {
+	uint64_t *samples;
+	size_t count;
+	size_t capacity;
+	uint64_t bytes;
+};
+
+struct worker {
+	struct job *job;
+	int *fds;
+	int index;
+	unsigned int seed;
+	/* Per-file position for sequential patterns */
+	size_t *cursor;
+	struct lat_log reads;
+	struct lat_log writes;
+	long errors;
+};
+
+/*
+ * libfs keeps all of its state in globals and is not thread-safe: every
+ * call into it is serialized here. Latencies are measured around the lock,
+ * so they include the time spent waiting for other threads, like an
+ * in-process client would observe.
+ */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Job file parsing
+ */
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+/* Parse a size such as "4096", "4k", "1m" or "2g" */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t value = strtoul(s, &end, 0);
+
+	switch (tolower((unsigned char)*end)) {
+	case 'k':
+		value *= 1024;
+		break;
+	case 'm':
+		value *= 1024 * 1024;
+		break;
+	case 'g':
+		value *= 1024 * 1024 * 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		die("invalid size '%s'", s);
+	}
+	return value;
+}
+
+/* Parse "4k/60:16k/30:64k/10" into a size distribution */
+static void parse_bssplit(struct job *job, char *value)
+{
+	char *saveptr, *item;
+	int total = 0;
+
+	job->bs_count = 0;
+	for (item = strtok_r(value, ":", &saveptr); item;
+	     item = strtok_r(NULL, ":", &saveptr)) {
+		char *slash = strchr(item, '/');
+
+		if (job->bs_count == MAX_BS_SPLIT)
+			die("too many bssplit entries");
+		if (!slash)
+			die("bssplit entry '%s' lacks a /weight", item);
+		*slash = '\0';
+		job->bs[job->bs_count].size = parse_size(item);
+		job->bs[job->bs_count].weight = atoi(slash + 1);
+		total += job->bs[job->bs_count].weight;
+		job->bs_count++;
+	}
+	if (total != 100)
+		die("bssplit weights of job '%s' add up to %d, not 100",
+		    job->name, total);
+}
+
+static void parse_rw(struct job *job, const char *value)
+{
+	static const struct {
+		const char *name;
+		enum pattern pattern;
+		int mode_mix;
+	} modes[] = {
+		{ "read",	PATTERN_SEQ,	100 },
+		{ "write",	PATTERN_SEQ,	0 },
+		{ "rw",		PATTERN_SEQ,	-1 },
+		{ "randread",	PATTERN_RAND,	100 },
+		{ "randwrite",	PATTERN_RAND,	0 },
+		{ "randrw",	PATTERN_RAND,	-1 },
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (!strcmp(value, modes[i].name)) {
+			job->pattern = modes[i].pattern;
+			job->mode_mix = modes[i].mode_mix;
+			return;
+		}
+	}
+	die("unknown rw mode '%s'", value);
+}
+
+static void set_option(struct job *job, const char *key, char *value)
+{
+	if (!strcmp(key, "rw")) {
+		parse_rw(job, value);
+	} else if (!strcmp(key, "rwmixread")) {
+		job->rwmixread = atoi(value);
+	} else if (!strcmp(key, "bs")) {
+		job->bs[0].size = parse_size(value);
+		job->bs[0].weight = 100;
+		job->bs_count = 1;
+	} else if (!strcmp(key, "bssplit")) {
+		parse_bssplit(job, value);
+	} else if (!strcmp(key, "nrfiles")) {
+		job->nrfiles = atoi(value);
+	} else if (!strcmp(key, "filesize")) {
+		job->filesize = parse_size(value);
+	} else if (!strcmp(key, "threads") || !strcmp(key, "numjobs")) {
+		job->threads = atoi(value);
+	} else if (!strcmp(key, "runtime")) {
+		job->runtime = atof(value);
+	} else if (!strcmp(key, "number_ios")) {
+		job->number_ios = atol(value);
+	} else if (!strcmp(key, "thinktime")) {
+		job->thinktime = atol(value);
+	} else if (!strcmp(key, "seed")) {
+		job->seed = strtoul(value, NULL, 0);
+	} else {
+		die("unknown option '%s'", key);
+	}
+}
+
+static void check_job(struct job *job)
+{
+	if (job->rwmixread < 0 || job->rwmixread > 100)
+		die("%s: rwmixread must be in [0, 100]", job->name);
+	/* rwmixread only matters to the mixed modes, wherever it was set */
+	job->read_mix = job->mode_mix < 0 ? job->rwmixread : job->mode_mix;
+	if (job->nrfiles < 1 || job->nrfiles > FS_OPEN_MAX_COUNT)
+		die("%s: nrfiles must be in [1, %d]", job->name,
+		    FS_OPEN_MAX_COUNT);
+	if (job->threads < 1 || job->threads > MAX_THREADS)
+		die("%s: threads must be in [1, %d]", job->name, MAX_THREADS);
+	if (job->runtime <= 0 && job->number_ios <= 0)
+		die("%s: need a runtime or number_ios", job->name);
+	for (int i = 0; i < job->bs_count; i++) {
+		if (job->bs[i].size == 0 || job->bs[i].size > MAX_BS ||
+		    job->bs[i].size > job->filesize)
+			die("%s: block size %zu out of range", job->name,
+			    job->bs[i].size);
+	}
+}
+
+/*
+ * Job files follow fio's layout: a [global] section holding defaults,
+ * then one section per job. Lines starting with '#' or ';' are comments.
+ */
+static int parse_jobfile(const char *filename, struct job *jobs)
+{
+	struct job global = {
+		.pattern = PATTERN_RAND,
+		.mode_mix = 100,
+		.rwmixread = 50,
+		.bs = { { 4096, 100 } },
+		.bs_count = 1,
+		.nrfiles = 1,
+		.filesize = 1024 * 1024,
+		.threads = 1,
+		.runtime = 5,
+		.seed = 150,
+	};
+	struct job *cur = NULL;
+	char line[256];
+	int count = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		die_perror(filename);
+
+	while (fgets(line, sizeof(line), f)) {
+		char *s = trim(line), *eq;
+
+		lineno++;
+		if (*s == '\0' || *s == '#' || *s == ';')
+			continue;
+
+		if (*s == '[') {
+			char *end = strchr(s, ']');
+
+			if (!end)
+				die("%s:%d: unterminated section", filename, lineno);
+			*end = '\0';
+			if (!strcmp(s + 1, "global")) {
+				cur = &global;
+				continue;
+			}
+			if (count == MAX_JOBS)
+				die("%s:%d: too many jobs", filename, lineno);
+			cur = &jobs[count++];
+			*cur = global;
+			snprintf(cur->name, sizeof(cur->name), "%s", s + 1);
+			continue;
+		}
+
+		if (!cur)
+			die("%s:%d: option outside of a section", filename, lineno);
+		eq = strchr(s, '=');
+		if (!eq)
+			die("%s:%d: expected key=value", filename, lineno);
+		*eq = '\0';
+		set_option(cur, trim(s), trim(eq + 1));
+	}
+
+	fclose(f);
+
+	for (int i = 0; i < count; i++)
+		check_job(&jobs[i]);
+
+	return count;
+}
+
+/*
+ * Workers
+ */
+static void lat_add(struct lat_log *log, uint64_t ns, size_t bytes)
+{
+	if (log->count == log->capacity) {
+		log->capacity = log->capacity ? log->capacity * 2 : 4096;
+		log->samples = realloc(log->samples,
+				       log->capacity * sizeof(uint64_t));
+		if (!log->samples)
+			die_perror("realloc");
+	}
+	log->samples[log->count++] = ns;
+	log->bytes += bytes;
+}
+
+static size_t pick_bs(struct worker *w)
+{
+	int roll = rand_r(&w->seed) % 100;
+
+	for (int i = 0; i < w->job->bs_count; i++) {
+		roll -= w->job->bs[i].weight;
+		if (roll < 0)
+			return w->job->bs[i].size;
+	}
+	return w->job->bs[0].size;
+}
+
+static size_t pick_offset(struct worker *w, int file, size_t bs)
+{
+	size_t offset;
+
+	if (w->job->pattern == PATTERN_RAND)
+		return (rand_r(&w->seed) % (w->job->filesize / bs)) * bs;
+
+	offset = w->cursor[file];
+	if (offset + bs > w->job->filesize)
+		offset = 0;
+	w->cursor[file] = offset + bs;
+	return offset;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct job *job = w->job;
+	uint64_t deadline = now_ns() + (uint64_t)(job->runtime * 1e9);
+	char *buf;
+
+	buf = malloc(MAX_BS);
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 'a' + w->index % 26, MAX_BS);
+
+	for (long op = 0; job->number_ios <= 0 || op < job->number_ios; op++) {
+		int file = rand_r(&w->seed) % job->nrfiles;
+		int is_read = (int)(rand_r(&w->seed) % 100) < job->read_mix;
+		size_t bs = pick_bs(w);
+		size_t offset = pick_offset(w, file, bs);
+		uint64_t start, end;
+		int ret;
+
+		if (job->runtime > 0 && now_ns() >= deadline)
+			break;
+
+		start = now_ns();
+		pthread_mutex_lock(&fs_lock);
+		ret = fs_lseek(w->fds[file], offset);
+		if (!ret) {
+			if (is_read)
+				ret = fs_read(w->fds[file], buf, bs);
+			else
+				ret = fs_write(w->fds[file], buf, bs);
+		}
+		pthread_mutex_unlock(&fs_lock);
+		end = now_ns();
+
+		if (ret != (int)bs)
+			w->errors++;
+		else
+			lat_add(is_read ? &w->reads : &w->writes, end - start, bs);
+
+		if (job->thinktime > 0)
+			usleep(job->thinktime);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Reporting
+ */
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void lat_merge(struct lat_log *dst, struct lat_log *src)
+{
+	for (size_t i = 0; i < src->count; i++)
+		lat_add(dst, src->samples[i], 0);
+	dst->bytes += src->bytes;
+	free(src->samples);
+}
+
+static void report(const char *op, struct lat_log *log, double elapsed)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+
+	if (!log->count)
+		return;
+
+	qsort(log->samples, log->count, sizeof(uint64_t), cmp_u64);
+
+	printf("  %-5s: ios=%zu, bw=%.2f MiB/s, iops=%.0f\n", op, log->count,
+	       log->bytes / elapsed / (1024 * 1024), log->count / elapsed);
+	printf("         lat (usec): min=%.1f",
+	       log->samples[0] / 1e3);
+	for (size_t i = 0; i < ARRAY_SIZE(pcts); i++) {
+		size_t idx = (size_t)(pcts[i] / 100 * (log->count - 1));
+
+		printf(", p%g=%.1f", pcts[i], log->samples[idx] / 1e3);
+	}
+	printf(", max=%.1f\n", log->samples[log->count - 1] / 1e3);
+}
+
+/*
+ * Job setup: create and fill the job's files so that reads and random
+ * writes always land within existing data.
+ */
+static void job_filename(struct job *job, int i, char *out)
+{
+	snprintf(out, FS_FILENAME_LEN, "%.9s.%d", job->name,
+		 i % FS_OPEN_MAX_COUNT);
+}
+
+static void prepare_files(struct job *job, int *fds)
+{
+	char filename[FS_FILENAME_LEN];
+	char *buf;
+
+	buf = calloc(1, MAX_BS);
+	if (!buf)
+		die_perror("calloc");
+
+	for (int i = 0; i < job->nrfiles; i++) {
+		job_filename(job, i, filename);
+		fs_create(filename);
+		fds[i] = fs_open(filename);
+		if (fds[i] < 0)
+			die("%s: cannot open '%s'", job->name, filename);
+
+		for (size_t done = fs_stat(fds[i]); done < job->filesize;) {
+			size_t chunk = job->filesize - done;
+			int ret;
+
+			if (chunk > MAX_BS)
+				chunk = MAX_BS;
+			fs_lseek(fds[i], done);
+			ret = fs_write(fds[i], buf, chunk);
+			if (ret <= 0)
+				die("%s: cannot lay out '%s' (disk full?)",
+				    job->name, filename);
+			done += ret;
+		}
+	}
+
+	free(buf);
+}
+
+static void run_job(struct job *job)
+{
+	struct worker workers[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	struct lat_log reads = { 0 }, writes = { 0 };
+	int fds[FS_OPEN_MAX_COUNT];
+	long errors = 0;
+	uint64_t start;
+	double elapsed;
+
+	prepare_files(job, fds);
+
+	start = now_ns();
+	for (int t = 0; t < job->threads; t++) {
+		struct worker *w = &workers[t];
+
+		memset(w, 0, sizeof(*w));
+		w->job = job;
+		w->fds = fds;
+		w->index = t;
+		w->seed = job->seed + t;
+		w->cursor = calloc(job->nrfiles, sizeof(size_t));
+		if (!w->cursor)
+			die_perror("calloc");
+		if (pthread_create(&threads[t], NULL, worker_run, w))
+			die("cannot start thread");
+	}
+
+	for (int t = 0; t < job->threads; t++) {
+		pthread_join(threads[t], NULL);
+		lat_merge(&reads, &workers[t].reads);
+		lat_merge(&writes, &workers[t].writes);
+		errors += workers[t].errors;
+		free(workers[t].cursor);
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	for (int i = 0; i < job->nrfiles; i++)
+		fs_close(fds[i]);
+
+	printf("%s: threads=%d, files=%d x %zu bytes, runtime=%.2fs\n",
+	       job->name, job->threads, job->nrfiles, job->filesize, elapsed);
+	report("read", &reads, elapsed);
+	report("write", &writes, elapsed);
+	if (errors)
+		printf("  errors=%ld\n", errors);
+
+	free(reads.samples);
+	free(writes.samples);
+}
+
+int main(int argc, char **argv)
+{
+	struct job jobs[MAX_JOBS];
+	int count;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <diskname> <job file>\n", argv[0]);
+		exit(1);
+	}
+
+	count = parse_jobfile(argv[2], jobs);
+	if (!count)
+		die("no job in '%s'", argv[2]);
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+
+	for (int i = 0; i < count; i++)
+		run_job(&jobs[i]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include <fs.h>
+#include <fs_ext.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -34,6 +35,54 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Names <prefix>0 to <prefix><count - 1> of a batch of script commands */
+static char **batch_names(const char *prefix, int count)
+{
+	char **names = calloc(count > 0 ? count : 1, sizeof(char *));
+
+	if (!names)
+		die_perror("calloc");
+	for (int i = 0; i < count; i++) {
+		names[i] = malloc(FS_FILENAME_LEN);
+		if (!names[i])
+			die_perror("malloc");
+		snprintf(names[i], FS_FILENAME_LEN, "%s%d", prefix, i);
+	}
+
+	return names;
+}
+
+static void free_batch_names(char **names, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+/* Run a batched call of libfs on <prefix>0 to <prefix><count - 1> */
+static int run_batch(int (*call)(const char **, size_t, int *),
+		     const char *prefix, const char *count_arg)
+{
+	int count = count_arg ? atoi(count_arg) : 0;
+	char **names;
+	int *results;
+	int ret;
+
+	if (!prefix || count < 1)
+		die("Batch commands take a prefix and a count");
+	names = batch_names(prefix, count);
+	results = malloc(count * sizeof(int));
+	if (!results)
+		die_perror("malloc");
+
+	ret = call((const char **)names, count, results);
+
+	free(results);
+	free_batch_names(names, count);
+
+	return ret;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -122,6 +171,66 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "CREATE_MANY") == 0) {
+			count = run_batch(fs_create_many, command_args[1],
+					  command_args[2]);
+			if (count < 0) {
+				fs_umount();
+				die("Cannot create files");
+			}
+
+			printf("CREATE_MANY created %d files.\n", count);
+
+		} else if (strcmp(command, "DELETE_MANY") == 0) {
+			count = run_batch(fs_delete_many, command_args[1],
+					  command_args[2]);
+			if (count < 0) {
+				fs_umount();
+				die("Cannot delete files");
+			}
+
+			printf("DELETE_MANY deleted %d files.\n", count);
+
+		} else if (strcmp(command, "STAT_MANY") == 0) {
+			count = run_batch(fs_stat_many, command_args[1],
+					  command_args[2]);
+			if (count < 0) {
+				fs_umount();
+				die("Cannot stat files");
+			}
+
+			printf("STAT_MANY found %d files.\n", count);
+
+		} else if (strcmp(command, "MKDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_mkdir(fs_filename)) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			printf("MKDIR successful.\n");
+
+		} else if (strcmp(command, "RMDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_rmdir(fs_filename)) {
+				fs_umount();
+				die("Cannot remove directory");
+			}
+
+			printf("RMDIR successful.\n");
+
+		} else if (strcmp(command, "CLONE") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_clone(fs_filename, command_args[2])) {
+				fs_umount();
+				die("Cannot clone file");
+			}
+
+			printf("CLONE successful.\n");
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
@@ -134,6 +243,34 @@ void thread_fs_script(void *arg)
 
 			printf("OPEN successful.\n");
 
+		} else if (strcmp(command, "APPEND") == 0) {
+			fs_filename = command_args[1];
+
+			fs_fd = fs_open_append(fs_filename);
+
+			if (fs_fd < 0) {
+				fs_umount();
+				die("Cannot open file");
+			}
+
+			printf("APPEND successful.\n");
+
+		} else if (strcmp(command, "FSYNC") == 0) {
+			if (fs_fsync(fs_fd)) {
+				fs_umount();
+				die("Cannot sync file");
+			}
+
+			printf("FSYNC successful.\n");
+
+		} else if (strcmp(command, "COMPRESS") == 0) {
+			if (fs_compress(fs_fd)) {
+				fs_umount();
+				die("Cannot compress file");
+			}
+
+			printf("COMPRESS successful.\n");
+
 		} else if (strcmp(command, "CLOSE") == 0) {
 			if (fs_close(fs_fd)) {
 				fs_umount();
@@ -152,6 +289,16 @@ void thread_fs_script(void *arg)
 				printf("SEEK successful.\n");
 			}
 
+		} else if (strcmp(command, "TRUNCATE") == 0) {
+			offset = atoi(command_args[1]);
+
+			if (fs_truncate(fs_fd, offset)) {
+				fs_umount();
+				die("Cannot truncate file");
+			} else {
+				printf("TRUNCATE successful.\n");
+			}
+
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
@@ -192,6 +339,47 @@ void thread_fs_script(void *arg)
 			}
 			printf("Wrote %d bytes to file.\n", count);
 
+		} else if (strcmp(command, "PWRITE") == 0) {
+			offset = atoi(command_args[1]);
+			data = command_args[2];
+
+			if (!data) {
+				fs_umount();
+				die("Could not find data to write");
+			}
+
+			count = fs_pwrite(fs_fd, data, strlen(data), offset);
+			if (count < 0) {
+				fs_umount();
+				die("write error");
+			}
+			printf("Wrote %d bytes to file at offset %d.\n", count, offset);
+
+		} else if (strcmp(command, "PREAD") == 0) {
+			offset = atoi(command_args[1]);
+			data = command_args[2];
+
+			if (!data) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			data_size = strlen(data);
+			read_buf = calloc(data_size + 1, sizeof(char));
+			count = fs_pread(fs_fd, read_buf, data_size, offset);
+			if (count < 0) {
+				fs_umount();
+				die("read error");
+			}
+
+			if (memcmp(data, read_buf, data_size + 1) == 0)
+				printf("Read %d bytes from file at offset %d. Compared %d correct.\n",
+				       count, offset, data_size);
+			else
+				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+			free(read_buf);
+
 		} else if (strcmp(command, "READ") == 0) {
 			int read_req_length = atoi(command_args[1]);
 			data_source = command_args[2];
@@ -273,6 +461,7 @@ void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
+	struct fs_file_stat st;
 	int fs_fd;
 	int stat;
 
@@ -305,6 +494,10 @@ void thread_fs_stat(void *arg)
 		return;
 	}
 
+	/* Not every image tells how much space files take */
+	if (fs_fstat(fs_fd, &st))
+		st.physical_size = 0;
+
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -314,12 +507,15 @@ void thread_fs_stat(void *arg)
 		die("cannot unmount diskname");
 
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	if (st.physical_size)
+		printf("Disk space used is %zu bytes%s\n", st.physical_size,
+		       st.compressed ? " (compressed)" : "");
 }
 
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
 	int stat, read;
 
@@ -348,15 +544,17 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+
+	/* The content goes straight from the image to stdout */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+	read = fs_export_to_fd(fs_fd, STDOUT_FILENO);
+	if (read != stat) {
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot read file (%d/%d bytes)", read, stat);
 	}
 
-	read = fs_read(fs_fd, buf, stat);
-
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -364,13 +562,66 @@ void thread_fs_cat(void *arg)
 
 	if (fs_umount())
 		die("cannot unmount diskname");
+}
+
+/* Same as cat, but through a read view of the file rather than a copy */
+void thread_fs_view(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	struct fs_view view;
+	int fs_fd;
+	int stat, read;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+	if (!stat) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+
+	read = fs_read_view(fs_fd, stat, &view);
+	if (read < 0) {
+		fs_umount();
+		die("Cannot read file");
+	}
+
+	/* The view outlives the file descriptor */
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	printf("Read file '%s' (%d/%d bytes, %d pieces)\n", filename, read,
+	       stat, view.iovcnt);
 	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
+	for (int i = 0; i < view.iovcnt; i++)
+		fwrite(view.iov[i].iov_base, 1, view.iov[i].iov_len, stdout);
 	fflush(stdout);
 
-	free(buf);
+	if (fs_release_view(&view))
+		die("Cannot release view");
+	if (fs_umount())
+		die("cannot unmount diskname");
 }
 
 void thread_fs_rm(void *arg)
@@ -401,10 +652,10 @@ void thread_fs_rm(void *arg)
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fd, fs_fd;
+	char *diskname, *filename;
 	struct stat st;
 	int written;
+	int fd;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -421,43 +672,25 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
+	 * - mount, create a new file and copy the content of the host file
+	 *   into it (straight from file to image), and umount
 	 */
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
+	written = fs_import_from_fd(fd, filename);
+	if (written < 0) {
 		fs_umount();
 		die("Cannot create file");
 	}
 
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
-
-	written = fs_write(fs_fd, buf, st.st_size);
-
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
-	}
-
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
 	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
 		   st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
@@ -467,14 +700,19 @@ void thread_fs_ls(void *arg)
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [<directory>]");
 
 	diskname = t_arg->argv[0];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc < 2)
+		fs_ls();
+	else if (fs_lsdir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -516,6 +754,7 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "view",	thread_fs_view },
 	{ "stat",	thread_fs_stat },
 	{ "script",	thread_fs_script }
 };
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "disk.h"
+#include "fs_format.h"
+#include "sim.h"
+
+static int bdevFd = -1;
+// read-only mapping of the whole image, created on first use
+static uint8_t *bdevImage;
+static size_t bdevImageSize;
+
+// changed-block tracking (see fs_format.h), cbtFd is -1 when not tracking
+static char *cbtPath;
+static int cbtFd = -1;
+static struct cbtHeader cbtHeader;
+static uint8_t *cbtBitmap;
+
+static size_t cbtBitmapSize(void) {
+    return ((size_t)block_disk_count() + 7) / 8;
+}
+
+static int cbtWriteHeader(void) {
+    if (pwrite(cbtFd, &cbtHeader, sizeof(cbtHeader), 0) != sizeof(cbtHeader)) {
+        perror("pwrite");
+        return -1;
+    }
+    return 0;
+}
+
+static void cbtStop(void) {
+    free(cbtBitmap);
+    cbtBitmap = NULL;
+    if (cbtFd != -1) {
+        close(cbtFd);
+        cbtFd = -1;
+    }
+}
+
+// Resume tracking if the image has a changed-block bitmap
+static void cbtResume(void) {
+    size_t size = cbtBitmapSize();
+
+    cbtFd = open(cbtPath, O_RDWR);
+    if (cbtFd < 0) {
+        return;
+    }
+
+    cbtBitmap = malloc(size);
+    if (cbtBitmap == NULL ||
+        pread(cbtFd, &cbtHeader, sizeof(cbtHeader), 0) != sizeof(cbtHeader) ||
+        memcmp(cbtHeader.magic, FS_CBT_MAGIC, FS_SIG_LENGTH) != 0 ||
+        cbtHeader.totalBlocks != (uint32_t)block_disk_count() ||
+        pread(cbtFd, cbtBitmap, size, sizeof(cbtHeader)) != (ssize_t)size) {
+        fprintf(stderr, "%s: invalid changed-block bitmap, ignored\n", cbtPath);
+        cbtStop();
+        return;
+    }
+
+    // the changes made before an unclean unmount are unknown
+    if (cbtHeader.flags & FS_CBT_OPEN) {
+        memset(cbtBitmap, 0xFF, size);
+    }
+    cbtHeader.flags |= FS_CBT_OPEN;
+    if (cbtWriteHeader() == -1) {
+        cbtStop();
+    }
+}
+
+static void cbtMark(uint32_t block, uint32_t count) {
+    if (cbtBitmap == NULL) {
+        return;
+    }
+    for (uint32_t n = block; n < block + count; n++) {
+        cbtBitmap[n / 8] |= 1 << (n % 8);
+    }
+}
+
+static int cbtClose(void) {
+    size_t size = cbtBitmapSize();
+    int ret = 0;
+
+    if (cbtFd == -1) {
+        return 0;
+    }
+
+    cbtHeader.flags &= ~FS_CBT_OPEN;
+    if (pwrite(cbtFd, cbtBitmap, size, sizeof(cbtHeader)) != (ssize_t)size ||
+        cbtWriteHeader() == -1) {
+        ret = -1;
+    }
+    cbtStop();
+
+    return ret;
+}
+
+int bdevOpen(const char *diskname) {
+    if (bdevFd != -1) {
+        return -1;
+    }
+
+    bdevFd = open(diskname, O_RDWR);
+    if (bdevFd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    cbtPath = malloc(strlen(diskname) + sizeof(FS_CBT_SUFFIX));
+    if (cbtPath == NULL) {
+        close(bdevFd);
+        bdevFd = -1;
+        return -1;
+    }
+    strcpy(cbtPath, diskname);
+    strcat(cbtPath, FS_CBT_SUFFIX);
+    cbtResume();
+
+    return 0;
+}
+
+int bdevCheckpoint(const char *name, uint64_t id) {
+    size_t size = cbtBitmapSize();
+
+    if (bdevFd == -1 || name == NULL || strlen(name) >= FS_CBT_NAME_LEN) {
+        return -1;
+    }
+
+    cbtStop();
+    cbtFd = open(cbtPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    cbtBitmap = calloc(size, 1);
+    if (cbtFd < 0 || cbtBitmap == NULL) {
+        cbtStop();
+        return -1;
+    }
+
+    memset(&cbtHeader, 0, sizeof(cbtHeader));
+    memcpy(cbtHeader.magic, FS_CBT_MAGIC, FS_SIG_LENGTH);
+    cbtHeader.totalBlocks = block_disk_count();
+    cbtHeader.flags = FS_CBT_OPEN;
+    strcpy(cbtHeader.checkpoint, name);
+    cbtHeader.id = id;
+    if (cbtWriteHeader() == -1 ||
+        pwrite(cbtFd, cbtBitmap, size, sizeof(cbtHeader)) != (ssize_t)size) {
+        cbtStop();
+        unlink(cbtPath);
+        return -1;
+    }
+
+    return 0;
+}
+
+int bdevClose(void) {
+    int ret;
+
+    if (bdevFd == -1) {
+        return -1;
+    }
+
+    ret = cbtClose();
+    free(cbtPath);
+    cbtPath = NULL;
+
+    if (bdevImage != NULL) {
+        munmap(bdevImage, bdevImageSize);
+        bdevImage = NULL;
+    }
+    close(bdevFd);
+    bdevFd = -1;
+
+    return ret;
+}
+
+// Move @count blocks between @buf and the image, going on after short
+// transfers
+static int bdevTransfer(int write, uint32_t block, uint32_t count,
+                        void *buf) {
+    size_t total = (size_t)count * BLOCK_SIZE;
+    off_t offset = (off_t)block * BLOCK_SIZE;
+    size_t done = 0;
+
+    if (bdevFd == -1 || (uint64_t)block + count > (uint64_t)block_disk_count()) {
+        return -1;
+    }
+    if (simRequest(write, block, count) == -1) {
+        return -1;
+    }
+    if (write) {
+        cbtMark(block, count);
+    }
+
+    while (done < total) {
+        ssize_t ret = write ? pwrite(bdevFd, (char *)buf + done, total - done,
+                                     offset + done)
+                            : pread(bdevFd, (char *)buf + done, total - done,
+                                    offset + done);
+
+        if (ret <= 0) {
+            perror(write ? "pwrite" : "pread");
+            return -1;
+        }
+        done += ret;
+    }
+
+    return 0;
+}
+
+int bdevRead(uint32_t block, uint32_t count, void *buf) {
+    return bdevTransfer(0, block, count, buf);
+}
+
+int bdevWrite(uint32_t block, uint32_t count, const void *buf) {
+    return bdevTransfer(1, block, count, (void *)buf);
+}
+
+int bdevReadBlock(uint32_t block, void *buf) {
+    if (simRequest(0, block, 1) == -1) {
+        return -1;
+    }
+    return block_read(block, buf);
+}
+
+const void *bdevMap(uint32_t block, uint32_t count) {
+    if (bdevFd == -1 || (uint64_t)block + count > (uint64_t)block_disk_count()) {
+        return NULL;
+    }
+    // the blocks are read from the device when the view is made
+    if (simRequest(0, block, count) == -1) {
+        return NULL;
+    }
+
+    if (bdevImage == NULL) {
+        size_t size = (size_t)block_disk_count() * BLOCK_SIZE;
+        void *image = mmap(NULL, size, PROT_READ, MAP_SHARED, bdevFd, 0);
+
+        if (image == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        bdevImage = image;
+        bdevImageSize = size;
+    }
+
+    return bdevImage + (size_t)block * BLOCK_SIZE;
+}
+
+// Ways of moving bytes between the image and another file, fastest first
+enum copyMode {
+    // copy_file_range(), between regular files
+    COPY_RANGE,
+    // sendfile() or splice(), when the other end is a socket or a pipe
+    COPY_PIPE,
+    // read() and write() through a buffer
+    COPY_BOUNCE,
+};
+
+// Whether a failure of the in-kernel calls means that they cannot be used
+// with these files, rather than a real I/O error
+static int copyUnsupported(int error) {
+    return error == EINVAL || error == EXDEV || error == ENOSYS ||
+           error == EOPNOTSUPP || error == EBADF || error == ESPIPE;
+}
+
+// Write the @count bytes of bounce buffer @buf to @fd, or to the image at
+// byte @position for an import, and return how many were written: fewer
+// only on failure
+static size_t bounceWrite(int out, int fd, const uint8_t *buf, size_t count,
+                          off_t position) {
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t n = out ? write(fd, buf + done, count - done)
+                        : pwrite(bdevFd, buf + done, count - done,
+                                 position + done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+// Move up to @count bytes between byte @offset of the image and the current
+// position of @fd, trying the in-kernel paths before the bounce buffer
+static ssize_t bdevCopy(int out, uint64_t offset, size_t count, int fd) {
+    enum copyMode mode = COPY_RANGE;
+    off_t position = offset;
+    uint8_t bounce[BLOCK_SIZE * 16];
+    size_t done = 0;
+
+    if (bdevFd == -1 ||
+        offset + count > (uint64_t)block_disk_count() * BLOCK_SIZE) {
+        return -1;
+    }
+    if (count > 0 && simRequest(!out, offset / BLOCK_SIZE,
+                                (offset + count - 1) / BLOCK_SIZE -
+                                    offset / BLOCK_SIZE + 1) == -1) {
+        return -1;
+    }
+
+    while (done < count) {
+        size_t left = count - done;
+        ssize_t n;
+
+        if (mode == COPY_RANGE) {
+            n = out ? copy_file_range(bdevFd, &position, fd, NULL, left, 0)
+                    : copy_file_range(fd, NULL, bdevFd, &position, left, 0);
+        } else if (mode == COPY_PIPE) {
+            n = out ? sendfile(fd, bdevFd, &position, left)
+                    : splice(fd, NULL, bdevFd, &position, left, 0);
+        } else {
+            if (left > sizeof(bounce)) {
+                left = sizeof(bounce);
+            }
+            n = out ? pread(bdevFd, bounce, left, position)
+                    : read(fd, bounce, left);
+            // what was read from @fd cannot be read again: all of it is
+            // written, or the copy ends there
+            if (n > 0) {
+                size_t written = bounceWrite(out, fd, bounce, n, position);
+
+                position += written;
+                if (written < (size_t)n) {
+                    perror(out ? "export" : "import");
+                    done += written;
+                    return done ? (ssize_t)done : -1;
+                }
+            }
+        }
+
+        if (n < 0 && mode != COPY_BOUNCE && done == 0 &&
+            copyUnsupported(errno)) {
+            mode++;
+            continue;
+        }
+        if (n < 0) {
+            perror(out ? "export" : "import");
+            return done ? (ssize_t)done : -1;
+        }
+        // end of @fd
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+ssize_t bdevCopyOut(uint64_t offset, size_t count, int fd) {
+    return bdevCopy(1, offset, count, fd);
+}
+
+ssize_t bdevCopyIn(int fd, uint64_t offset, size_t count) {
+    if (count > 0 && offset + count <= (uint64_t)block_disk_count() * BLOCK_SIZE) {
+        cbtMark(offset / BLOCK_SIZE,
+                (offset + count - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1);
+    }
+    return bdevCopy(0, offset, count, fd);
+}
@@ -0,0 +1,46 @@
+#ifndef _BDEV_H
+#define _BDEV_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Range I/O on the mounted image, next to the one-block-at-a-time API of
+ * disk.h (which cannot be modified). The image is opened a second time, so
+ * both APIs see the same data through the page cache and can be mixed
+ * freely.
+ *
+ * All requests go through the simulated device of fs_sim.h, if any, and
+ * fail when it makes them fail.
+ */
+
+// Open @diskname for range I/O, once block_disk_open() accepted it, and
+// resume tracking its changed blocks if it has a checkpoint
+int bdevOpen(const char *diskname);
+
+// Close the image, writing back the changed-block bitmap
+int bdevClose(void);
+
+// Transfer @count consecutive blocks starting at block @block
+int bdevRead(uint32_t block, uint32_t count, void *buf);
+int bdevWrite(uint32_t block, uint32_t count, const void *buf);
+
+// Read-only view of @count consecutive blocks starting at block @block,
+// valid until bdevClose(). Writes made through either API show through it.
+const void *bdevMap(uint32_t block, uint32_t count);
+
+// Copy @count bytes from byte @offset of the image to the current position of
+// @fd, or the other way around, in the kernel when the files allow it.
+// Return the number of bytes copied, which is smaller than @count if the end
+// of @fd is reached first, or -1.
+ssize_t bdevCopyOut(uint64_t offset, size_t count, int fd);
+ssize_t bdevCopyIn(int fd, uint64_t offset, size_t count);
+
+// block_read(), through the simulated device
+int bdevReadBlock(uint32_t block, void *buf);
+
+// Start tracking the blocks changed from now on, under checkpoint @name of
+// identity @id
+int bdevCheckpoint(const char *name, uint64_t id);
+
+#endif /* _BDEV_H */
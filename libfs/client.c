@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_server.h"
+
+/*
+ * Client side of fs_server.x (see fs_server.h): the API of fs.h, every call
+ * being forwarded to the server of the mounted image. Like libfs, it is not
+ * thread-safe.
+ */
+
+static int serverFd = -1;
+static uint8_t *shm;
+// file descriptors opened through the connection
+static int openCount;
+
+static int sendAll(const void *buf, size_t count) {
+    const uint8_t *p = buf;
+
+    while (count > 0) {
+        ssize_t n = send(serverFd, p, count, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int recvAll(void *buf, size_t count) {
+    uint8_t *p = buf;
+
+    while (count > 0) {
+        ssize_t n = recv(serverFd, p, count, 0);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+// Drop the connection, after which every call fails: once a request or a
+// reply was cut short, the stream cannot be trusted anymore
+static void disconnect(void) {
+    if (shm != NULL) {
+        munmap(shm, FS_SERVER_SHM_SIZE);
+        shm = NULL;
+    }
+    if (serverFd != -1) {
+        close(serverFd);
+        serverFd = -1;
+    }
+    openCount = 0;
+}
+
+// Send @request, followed by the @count bytes of @payload, and receive its
+// reply. The bytes following the reply are left to the caller.
+static int exchange(struct fs_server_request *request, const void *payload,
+                    size_t count, struct fs_server_reply *reply) {
+    if (serverFd == -1) {
+        return -1;
+    }
+    if (sendAll(request, sizeof(*request)) == -1 ||
+        (count > 0 && sendAll(payload, count) == -1) ||
+        recvAll(reply, sizeof(*reply)) == -1) {
+        disconnect();
+        return -1;
+    }
+
+    return 0;
+}
+
+// Call taking a file name, or a file descriptor and an argument
+static int simpleCall(enum fs_server_op op, const char *name, int fd,
+                      uint64_t arg) {
+    struct fs_server_request request = {.op = op, .fd = fd, .arg = arg};
+    struct fs_server_reply reply;
+
+    if (name != NULL) {
+        if (strlen(name) >= FS_FILENAME_LEN) {
+            return -1;
+        }
+        strcpy(request.name, name);
+    }
+    if (exchange(&request, NULL, 0, &reply) == -1) {
+        return -1;
+    }
+
+    return reply.result;
+}
+
+// Call printing text, which is printed here instead
+static int printingCall(enum fs_server_op op) {
+    struct fs_server_request request = {.op = op, .fd = -1};
+    struct fs_server_reply reply;
+    char *text;
+
+    if (exchange(&request, NULL, 0, &reply) == -1) {
+        return -1;
+    }
+    text = malloc(reply.length ? reply.length : 1);
+    if (text == NULL || recvAll(text, reply.length) == -1) {
+        free(text);
+        disconnect();
+        return -1;
+    }
+    fwrite(text, 1, reply.length, stdout);
+    free(text);
+
+    return reply.result;
+}
+
+// Create the shared memory region, and pass it to the server
+static int hello(void) {
+    struct fs_server_request request = {.op = FS_SERVER_HELLO, .fd = -1};
+    struct fs_server_reply reply;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int memfd = memfd_create("fs_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    // the server must not find the region shrunk under its feet
+    if (memfd < 0 || ftruncate(memfd, FS_SERVER_SHM_SIZE) == -1 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == -1) {
+        goto fail;
+    }
+    shm = mmap(NULL, FS_SERVER_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               memfd, 0);
+    if (shm == MAP_FAILED) {
+        shm = NULL;
+        goto fail;
+    }
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    if (sendmsg(serverFd, &msg, MSG_NOSIGNAL) != sizeof(request) ||
+        recvAll(&reply, sizeof(reply)) == -1 || reply.result != 0) {
+        goto fail;
+    }
+    close(memfd);
+
+    return 0;
+
+fail:
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    return -1;
+}
+
+int fs_mount(const char *diskname) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (serverFd != -1 || diskname == NULL ||
+        strlen(diskname) + sizeof(FS_SERVER_SUFFIX) > sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, diskname);
+    strcat(addr.sun_path, FS_SERVER_SUFFIX);
+
+    serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serverFd < 0) {
+        return -1;
+    }
+    if (connect(serverFd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        hello() == -1) {
+        disconnect();
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_umount(void) {
+    // the server closes the file descriptors of a client that leaves, but
+    // libfs refuses to unmount with open files
+    if (serverFd == -1 || openCount > 0) {
+        return -1;
+    }
+
+    disconnect();
+    return 0;
+}
+
+int fs_info(void) {
+    return printingCall(FS_SERVER_INFO);
+}
+
+int fs_create(const char *filename) {
+    return simpleCall(FS_SERVER_CREATE, filename, -1, 0);
+}
+
+int fs_delete(const char *filename) {
+    return simpleCall(FS_SERVER_DELETE, filename, -1, 0);
+}
+
+int fs_ls(void) {
+    return printingCall(FS_SERVER_LS);
+}
+
+int fs_open(const char *filename) {
+    int fd = simpleCall(FS_SERVER_OPEN, filename, -1, 0);
+
+    if (fd >= 0) {
+        openCount++;
+    }
+    return fd;
+}
+
+int fs_close(int fd) {
+    int ret = simpleCall(FS_SERVER_CLOSE, NULL, fd, 0);
+
+    if (ret == 0) {
+        openCount--;
+    }
+    return ret;
+}
+
+int fs_stat(int fd) {
+    return simpleCall(FS_SERVER_STAT, NULL, fd, 0);
+}
+
+int fs_lseek(int fd, size_t offset) {
+    return simpleCall(FS_SERVER_LSEEK, NULL, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+    struct fs_server_request request = {.op = FS_SERVER_WRITE, .fd = fd};
+    struct fs_server_reply reply;
+    size_t done = 0;
+
+    // checked before anything is sent, as the server could not tell
+    if (serverFd == -1 || buf == NULL) {
+        return -1;
+    }
+
+    if (count <= FS_SERVER_INLINE_MAX) {
+        request.arg = count;
+        if (exchange(&request, buf, count, &reply) == -1) {
+            return -1;
+        }
+        return reply.result;
+    }
+
+    request.flags = FS_SERVER_SHM;
+    while (done < count) {
+        size_t n = count - done < FS_SERVER_SHM_SIZE ? count - done
+                                                     : FS_SERVER_SHM_SIZE;
+
+        memcpy(shm, (uint8_t *)buf + done, n);
+        request.arg = n;
+        if (exchange(&request, NULL, 0, &reply) == -1 || reply.result < 0) {
+            return done ? (int)done : -1;
+        }
+        if ((size_t)reply.result > n) {
+            disconnect();
+            return -1;
+        }
+        done += reply.result;
+        if ((size_t)reply.result < n) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+int fs_read(int fd, void *buf, size_t count) {
+    struct fs_server_request request = {.op = FS_SERVER_READ, .fd = fd};
+    struct fs_server_reply reply;
+    size_t done = 0;
+
+    // checked before anything is sent, as the server could not tell
+    if (serverFd == -1 || buf == NULL) {
+        return -1;
+    }
+
+    if (count <= FS_SERVER_INLINE_MAX) {
+        request.arg = count;
+        if (exchange(&request, NULL, 0, &reply) == -1) {
+            return -1;
+        }
+        if (reply.length > count || recvAll(buf, reply.length) == -1) {
+            disconnect();
+            return -1;
+        }
+        return reply.result;
+    }
+
+    request.flags = FS_SERVER_SHM;
+    while (done < count) {
+        size_t n = count - done < FS_SERVER_SHM_SIZE ? count - done
+                                                     : FS_SERVER_SHM_SIZE;
+
+        request.arg = n;
+        if (exchange(&request, NULL, 0, &reply) == -1 || reply.result < 0) {
+            return done ? (int)done : -1;
+        }
+        if ((size_t)reply.result > n) {
+            disconnect();
+            return -1;
+        }
+        memcpy((uint8_t *)buf + done, shm, reply.result);
+        done += reply.result;
+        if ((size_t)reply.result < n) {
+            break;
+        }
+    }
+
+    return done;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "fs_format.h"
+
+// Open-addressing hash table of records, indexed by the first word of their
+// hash; free slots have cluster 0, which is never allocated
+static struct dedupRecord *table;
+static uint32_t capacity;
+static uint32_t count;
+static uint32_t dataClusters;
+static char *indexPath;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+void dedupHash(const void *data, size_t count, uint64_t hash[2]) {
+    const uint8_t *bytes = data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t blocks = count / 16;
+
+    for (size_t i = 0; i < blocks; i++) {
+        memcpy(&k1, bytes + i * 16, sizeof(k1));
+        memcpy(&k2, bytes + i * 16 + 8, sizeof(k2));
+
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // the last 0 to 15 bytes
+    const uint8_t *tail = bytes + blocks * 16;
+    k1 = 0;
+    k2 = 0;
+    for (size_t i = count & 15; i > 8; i--) {
+        k2 |= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    }
+    if (count & 15) {
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (size_t i = (count & 15) < 8 ? count & 15 : 8; i > 0; i--) {
+        k1 |= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    }
+    if (count & 15) {
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= count;
+    h2 ^= count;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+// Slot holding @hash, or the free slot where it belongs
+static struct dedupRecord *findSlot(const uint64_t hash[2]) {
+    uint32_t i = hash[0] & (capacity - 1);
+
+    while (table[i].cluster != 0 &&
+           (table[i].hash[0] != hash[0] || table[i].hash[1] != hash[1])) {
+        i = (i + 1) & (capacity - 1);
+    }
+
+    return &table[i];
+}
+
+// Double the table when it becomes three quarters full
+static int grow(void) {
+    struct dedupRecord *old = table;
+    uint32_t oldCapacity = capacity;
+
+    if ((uint64_t)(count + 1) * 4 <= (uint64_t)capacity * 3) {
+        return 0;
+    }
+
+    table = calloc((size_t)capacity * 2, sizeof(struct dedupRecord));
+    if (table == NULL) {
+        table = old;
+        return -1;
+    }
+    capacity *= 2;
+    for (uint32_t i = 0; i < oldCapacity; i++) {
+        if (old[i].cluster != 0) {
+            uint64_t hash[2] = {old[i].hash[0], old[i].hash[1]};
+
+            *findSlot(hash) = old[i];
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+int dedupInsert(const uint64_t hash[2], uint32_t cluster) {
+    struct dedupRecord *slot;
+
+    if (table == NULL || cluster == 0 || grow() == -1) {
+        return -1;
+    }
+
+    slot = findSlot(hash);
+    if (slot->cluster == 0) {
+        count++;
+    }
+    slot->hash[0] = hash[0];
+    slot->hash[1] = hash[1];
+    slot->cluster = cluster;
+
+    return 0;
+}
+
+uint32_t dedupLookup(const uint64_t hash[2]) {
+    if (table == NULL) {
+        return 0;
+    }
+
+    return findSlot(hash)->cluster;
+}
+
+static void dedupFree(void) {
+    free(table);
+    free(indexPath);
+    table = NULL;
+    indexPath = NULL;
+    capacity = 0;
+    count = 0;
+}
+
+int dedupOpen(const char *diskname, uint32_t clusters) {
+    struct dedupHeader header;
+    struct dedupRecord record;
+    FILE *file;
+
+    if (table != NULL) {
+        return -1;
+    }
+
+    indexPath = malloc(strlen(diskname) + sizeof(FS_DDT_SUFFIX));
+    capacity = 1024;
+    table = calloc(capacity, sizeof(struct dedupRecord));
+    if (indexPath == NULL || table == NULL) {
+        dedupFree();
+        return -1;
+    }
+    strcpy(indexPath, diskname);
+    strcat(indexPath, FS_DDT_SUFFIX);
+    dataClusters = clusters;
+
+    file = fopen(indexPath, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, FS_DDT_MAGIC, FS_SIG_LENGTH) != 0 ||
+        header.clusters != clusters) {
+        fprintf(stderr, "%s: invalid deduplication index, ignored\n",
+                indexPath);
+        fclose(file);
+        return 0;
+    }
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (fread(&record, sizeof(record), 1, file) != 1) {
+            break;
+        }
+        uint64_t hash[2] = {record.hash[0], record.hash[1]};
+        if (record.cluster != 0 && record.cluster < clusters &&
+            dedupInsert(hash, record.cluster) == -1) {
+            break;
+        }
+    }
+    fclose(file);
+
+    return 0;
+}
+
+int dedupClose(int (*keep)(uint32_t cluster)) {
+    struct dedupHeader header;
+    FILE *file;
+    int ret = 0;
+
+    if (table == NULL) {
+        return -1;
+    }
+
+    memcpy(header.magic, FS_DDT_MAGIC, FS_SIG_LENGTH);
+    header.clusters = dataClusters;
+    header.count = 0;
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (table[i].cluster != 0 && keep(table[i].cluster)) {
+            table[header.count++] = table[i];
+        }
+    }
+
+    file = fopen(indexPath, "wb");
+    if (file == NULL ||
+        fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(table, sizeof(struct dedupRecord), header.count, file) !=
+            header.count) {
+        perror(indexPath);
+        ret = -1;
+    }
+    if (file != NULL && fclose(file) != 0) {
+        ret = -1;
+    }
+    dedupFree();
+
+    return ret;
+}
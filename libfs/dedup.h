@@ -0,0 +1,31 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Deduplication index: content hash of the data clusters written whole,
+ * kept in memory while the image is mounted and saved next to it when it is
+ * unmounted. The index is only a hint, the content of a cluster it returns
+ * must be checked before the cluster is shared.
+ */
+
+// 128-bit hash of the @count bytes of @data (MurmurHash3, x64 variant)
+void dedupHash(const void *data, size_t count, uint64_t hash[2]);
+
+// Load the index of image @diskname, of @clusters data clusters, if it has
+// one, or start an empty one
+int dedupOpen(const char *diskname, uint32_t clusters);
+
+// Save the index, with only the clusters for which @keep() returns true,
+// and free it
+int dedupClose(int (*keep)(uint32_t cluster));
+
+// Cluster recorded with content @hash, 0 if none
+uint32_t dedupLookup(const uint64_t hash[2]);
+
+// Record that cluster @cluster holds content @hash
+int dedupInsert(const uint64_t hash[2], uint32_t cluster);
+
+#endif /* _DEDUP_H */
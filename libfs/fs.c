@@ -1,611 +1,5137 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "bdev.h"
+#include "dedup.h"
 #include "disk.h"
 #include "fs.h"
+#include "fs_ext.h"
+#include "fs_format.h"
+#include "ioq.h"
+#include "lz.h"
+#include "trace.h"
 
 /* TODO: Phase 1 */
-#define SUPERBLOCK_INDEX 0
-#define ENTRIES_PER_BLOCK BLOCK_SIZE / 2
-#define FAT_EOC 0xFFFF
-#define SIGNATURE "ECS150FS"
-#define SIG_LENGTH 8
-#define UNUSED_LENGTH_SUPER 4079
-#define UNUSED_LENGTH_ROOT 10
-
-// Define superblock
-// source:
-// https://www.geeksforgeeks.org/structure-member-alignment-padding-and-data-packing/
+#define FAT_EOC FS_FAT_EOC_V2
+
+// Largest number of consecutive FAT blocks written back at once
+#define FAT_FLUSH_RUN 16
+
+// Largest number of FAT blocks kept in memory, and memory their entries use
+#define FAT_CACHE_PAGES 1024
+#define FAT_CACHE_BYTES (32 * BLOCK_SIZE)
+
+// In-memory superblock: on-disk version 1 fields are widened when mounting
+// so that the rest of the code does not depend on the image version
 struct superblock {
-    char signature[SIG_LENGTH];
-    uint16_t totalBlocks;
-    uint16_t rootIndex;
-    uint16_t dataStart;
-    uint16_t dataBlocks;
-    uint8_t fatBlocks;
-    uint8_t unused[UNUSED_LENGTH_SUPER];
-} __attribute__((packed));
+    int version;
+    uint32_t totalBlocks;
+    uint32_t rootIndex;
+    uint32_t dataStart;
+    uint32_t dataBlocks;
+    uint32_t fatBlocks;
+    // allocation unit, in blocks (always 1 on version 1 images)
+    uint32_t clusterBlocks;
+    uint32_t dataClusters;
+    uint32_t features;
+};
 
-// Define FAT
-struct fat {
-    uint16_t content;
-} __attribute__((packed));
+// Run of FAT entries: each entry of [start, start + length) is followed by
+// the next one, but the last, followed by @next
+struct fatRun {
+    uint32_t start;
+    uint32_t length;
+    uint32_t next;
+};
+
+// Define FAT page (a block of the FAT, one entry per cluster, FAT_EOC ends a
+// chain), decoded to in-memory values. Most chains being made of consecutive
+// clusters, entries are kept as runs sorted by start, those outside runs
+// being free; a page too fragmented for runs to save memory keeps a flat
+// array instead
+struct fatPage {
+    // index of the FAT block held, UINT32_MAX if none
+    uint32_t block;
+    // set when the block must be written back
+    int dirty;
+    // when it was last used, for eviction
+    uint64_t used;
+    // flat array of entries, NULL if they are kept as runs
+    uint32_t *content;
+    struct fatRun *runs;
+    uint32_t runCount;
+    uint32_t runCapacity;
+};
 
-// Define root directory
+// Define directory entry (in-memory entry, widened like the superblock),
+// used for the root directory and for subdirectories
 struct rootDir {
     char fileName[FS_FILENAME_LEN];
     uint32_t fileSize;
-    uint16_t firstBlock;
-    uint8_t unused[UNUSED_LENGTH_ROOT];
-} __attribute__((packed));
+    uint32_t firstBlock;
+    uint8_t flags;
+    uint16_t slot;
+    uint32_t aux;
+};
+
+// Directory holding the entries of the root directory block; subdirectories
+// are identified by their first cluster
+#define ROOT_DIR FAT_EOC
+
+// Where a directory entry is stored: disk block, and index within the block
+struct entryLoc {
+    uint32_t block;
+    unsigned int index;
+};
+
+// Extents of a file in file order, with the file cluster where each ends
+struct extentMap {
+    uint32_t count;
+    uint32_t capacity;
+    struct fsExtent *extents;
+    uint32_t *ends;
+    // first extent not written back yet, UINT32_MAX if none
+    uint32_t dirtyFrom;
+};
+
+// Chunk table of a compressed file, and its last accessed chunk
+struct chunkTable {
+    uint32_t count;
+    uint32_t capacity;
+    struct fsChunk *chunks;
+    // index of the chunk held by data, UINT32_MAX if none
+    uint32_t cached;
+    // whether data was modified since it was read
+    int dirty;
+    uint8_t *data;
+    // room for a compressed chunk
+    uint8_t *packed;
+};
+
+// Last cluster of a chain, remembered so that appends do not walk the chain
+struct chainTail {
+    // FAT_EOC while unknown
+    uint32_t cluster;
+    // offset in the file of the first byte of the cluster
+    size_t start;
+};
+
+// An open file, shared by every file descriptor opened on it
+struct openFile {
+    // directory holding the file, and up-to-date copy of its entry
+    uint32_t dir;
+    struct rootDir entry;
+    // extent map or chunk table, loaded on first access
+    struct extentMap *map;
+    struct chunkTable *chunks;
+    // last cluster of a chained file
+    struct chainTail tail;
+    // partial last block of a chained file being appended to, kept in memory
+    // until it fills up or the file is synced (NULL if there is none), and
+    // its offset in the file
+    uint8_t *tailBlock;
+    size_t tailBlockStart;
+    int tailDirty;
+    // file descriptors and read views referring to the file
+    int refs;
+    // read views, the file cannot be modified while there are any
+    int views;
+    struct openFile *next;
+};
 
 // define fd table
 struct fileDescriptor {
-    uint16_t offset;
-    int index;
+    size_t offset;
+    struct openFile *file;
     int inUse;
+    // every write goes to the end of the file (see fs_open_append())
+    int append;
 } __attribute__((packed));
 
+// A subdirectory in use: where the blocks of its hash table are
+struct dirInfo {
+    uint32_t first;
+    // directory holding it, and its name there
+    uint32_t parent;
+    char name[FS_FILENAME_LEN];
+    uint32_t blockCount;
+    uint32_t *blocks;
+    uint32_t entries;
+    // entries differs from the count stored in the directory entry
+    int dirty;
+};
+
+// Dentry cache: recently looked up entries of subdirectories, indexed by
+// directory and name
+#define DCACHE_SIZE 4096
+
+struct dentry {
+    int valid;
+    uint32_t dir;
+    struct entryLoc loc;
+    struct rootDir entry;
+};
+
+// Directory block modified during a batch of metadata updates
+struct batchBlock {
+    uint32_t block;
+    uint8_t data[BLOCK_SIZE];
+};
+
 static struct superblock *superBlockPtr;
-static struct fat *fatArr;
+// FAT blocks read so far: blocks are only read when first used, the least
+// recently used one making room for the next when all pages are taken
+static struct fatPage *fatPages;
+static uint32_t fatPageCount;
+// page holding each FAT block, -1 if it is not in memory
+static int32_t *fatSlots;
+static uint64_t fatClock;
+// memory used by the entries of the pages
+static size_t fatBytes;
 static struct rootDir *rootDirArray;
 static struct fileDescriptor *fdTable[FS_OPEN_MAX_COUNT];
 
+// files referred to by file descriptors or read views
+static struct openFile *openFiles;
+
+// number of read views not released yet
+static int viewCount;
+
+// where the search for a free FAT entry resumes
+static uint32_t fatHint;
+// pack cluster where small files are stored first, FAT_EOC if none yet
+static uint32_t packCluster;
+// subdirectories loaded since mounting
+static struct dirInfo *dirTable;
+static size_t dirCount;
+static size_t dirCapacity;
+static struct dentry *dcache;
+// batch of metadata updates in progress (see fs_create_many()): the root
+// directory, the FAT and the directory blocks it modifies are only written
+// back when it ends
+static int batching;
+static int rootDirty;
+static struct batchBlock *batchBlocks;
+static size_t batchCount;
+static size_t batchCapacity;
+
 int checkFileName(const char *filename) {
     // check if it is null terminated
     // check if the length of the filename is longer than FS_FILENAME_LEN
-    if (filename[strlen(filename)] != '\0' || strlen(filename) > FS_FILENAME_LEN) {
+    if (filename[strlen(filename)] != '\0' || strlen(filename) >= FS_FILENAME_LEN) {
         return -1;
     }
 
     return 0;
 }
 
-int fs_mount(const char *diskname) {
-    /* TODO: Phase 1 */
-    // OPEN diskfile
-    if (block_disk_open(diskname) == -1) {
-        return -1;
-    }
+// Size of a cluster, in bytes
+static size_t clusterSize(void) {
+    return (size_t)superBlockPtr->clusterBlocks * BLOCK_SIZE;
+}
 
-    superBlockPtr = (struct superblock *)malloc(sizeof(struct superblock)); 
-    if (superBlockPtr == NULL) {
-        return -1;
-    }
-    // read superblock 
-    if (block_read(SUPERBLOCK_INDEX, superBlockPtr) == -1) {
-        return -1;
-    }
+// Disk block holding byte @offset of a file, knowing that @cluster is the
+// cluster of the file that contains it
+static uint32_t clusterBlock(uint32_t cluster, size_t offset) {
+    return superBlockPtr->dataStart + cluster * superBlockPtr->clusterBlocks +
+           (offset % clusterSize()) / BLOCK_SIZE;
+}
 
-    //	check if the signature is equal to "ECS150FS"
-    for (unsigned int i = 0; i < sizeof(superBlockPtr->signature); i++) {
-        if (superBlockPtr->signature[i] != SIGNATURE[i]) {
-            return -1;
-        }
-    }
+static uint32_t fatEntriesPerBlock(void) {
+    return superBlockPtr->version == FS_VERSION_1 ? FS_FAT_ENTRIES_V1
+                                                  : FS_FAT_ENTRIES_V2;
+}
 
-    // check if the total number of blocks is equal to what the function
-    // block_disk_count() returns
-    if (superBlockPtr->totalBlocks != block_disk_count()) {
+// Convert a block index between its in-memory and version 1 on-disk values
+static uint32_t widenV1(uint16_t value) {
+    return value == FS_FAT_EOC_V1 ? FAT_EOC : value;
+}
+
+static uint16_t narrowV1(uint32_t value) {
+    return value == FAT_EOC ? FS_FAT_EOC_V1 : (uint16_t)value;
+}
+
+static int readSuperblock(void) {
+    uint8_t block[BLOCK_SIZE];
+    struct superblockV1 *v1 = (struct superblockV1 *)block;
+    struct superblockV2 *v2 = (struct superblockV2 *)block;
+
+    if (ioqReadBlock(FS_SUPERBLOCK_INDEX, block) == -1) {
         return -1;
     }
 
-    fatArr = (struct fat *)malloc(superBlockPtr->fatBlocks * sizeof(struct fat) * ENTRIES_PER_BLOCK);
-    rootDirArray = (struct rootDir *)malloc(FS_FILE_MAX_COUNT * sizeof(struct rootDir));
-    if (fatArr == NULL || rootDirArray == NULL) {
+    //	check the signature, which tells which version the image uses
+    if (memcmp(v1->signature, FS_SIGNATURE_V1, FS_SIG_LENGTH) == 0) {
+        superBlockPtr->version = FS_VERSION_1;
+        superBlockPtr->totalBlocks = v1->totalBlocks;
+        superBlockPtr->rootIndex = v1->rootIndex;
+        superBlockPtr->dataStart = v1->dataStart;
+        superBlockPtr->dataBlocks = v1->dataBlocks;
+        superBlockPtr->fatBlocks = v1->fatBlocks;
+        superBlockPtr->clusterBlocks = 1;
+        superBlockPtr->features = 0;
+    } else if (memcmp(v2->signature, FS_SIGNATURE_V2, FS_SIG_LENGTH) == 0 &&
+               v2->version == FS_VERSION_2) {
+        superBlockPtr->version = FS_VERSION_2;
+        superBlockPtr->totalBlocks = v2->totalBlocks;
+        superBlockPtr->rootIndex = v2->rootIndex;
+        superBlockPtr->dataStart = v2->dataStart;
+        superBlockPtr->dataBlocks = v2->dataBlocks;
+        superBlockPtr->fatBlocks = v2->fatBlocks;
+        // images made before clusters existed leave the field zeroed
+        superBlockPtr->clusterBlocks =
+            v2->clusterBlocks ? v2->clusterBlocks : FS_MIN_CLUSTER_BLOCKS;
+        superBlockPtr->features = v2->features;
+    } else {
         return -1;
     }
 
-    // read FAT block
-    int remainingEntries = superBlockPtr->dataBlocks % ENTRIES_PER_BLOCK;
-    for (unsigned int i = 1; i <= superBlockPtr->fatBlocks; i++) {
-        if (remainingEntries == 0) {
-            if (block_read(i, fatArr + ((i - 1) * ENTRIES_PER_BLOCK)) == -1) {
-                return -1;
-            }
-        } else if (remainingEntries != 0) {
-            if (i < superBlockPtr->fatBlocks) {
-                if (block_read(i, fatArr + ((i - 1) * ENTRIES_PER_BLOCK)) == -1) {
-                    return -1;
-                }
-            } else if (i == superBlockPtr->fatBlocks) {
-                if (block_read(i, fatArr + ((i - 1) * remainingEntries)) == -1) {
-                    return -1;
-                }
-            }
-        }
+    if ((superBlockPtr->features & ~FS_FEATURES_SUPPORTED) != 0 ||
+        superBlockPtr->clusterBlocks > FS_MAX_CLUSTER_BLOCKS ||
+        superBlockPtr->dataBlocks % superBlockPtr->clusterBlocks != 0) {
+        return -1;
     }
+    superBlockPtr->dataClusters =
+        superBlockPtr->dataBlocks / superBlockPtr->clusterBlocks;
 
-    // Read root directory
-    if (block_read(superBlockPtr->rootIndex, rootDirArray) == -1) {
+    // check if the total number of blocks is equal to what the function
+    // block_disk_count() returns, and that the layout adds up
+    if (superBlockPtr->totalBlocks != (uint32_t)block_disk_count() ||
+        superBlockPtr->dataBlocks == 0 ||
+        superBlockPtr->fatBlocks !=
+            fsFatBlocks(superBlockPtr->version, superBlockPtr->dataClusters) ||
+        superBlockPtr->rootIndex != superBlockPtr->fatBlocks + 1 ||
+        superBlockPtr->dataStart != superBlockPtr->rootIndex + 1 ||
+        (uint64_t)superBlockPtr->dataStart + superBlockPtr->dataBlocks !=
+            superBlockPtr->totalBlocks) {
         return -1;
     }
 
     return 0;
 }
 
-int fs_umount(void) {
-    /* TODO: Phase 1 */
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
-    }
+// First entry of FAT block @block
+static uint32_t fatPageFirst(uint32_t block) {
+    return block * fatEntriesPerBlock();
+}
 
-    if (block_disk_close() == -1) {
-        return -1;
-    }
-    // check if there are still open file descriptors
-    for (unsigned int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fdTable[i] != NULL) {
-            return -1;
-        }
-    }
+// Number of entries of FAT block @block, the last one being partially used
+static uint32_t fatPageEntries(uint32_t block) {
+    uint32_t first = fatPageFirst(block);
 
-    free(superBlockPtr);
-    free(fatArr);
-    free(rootDirArray);
+    return superBlockPtr->dataClusters - first < fatEntriesPerBlock()
+               ? superBlockPtr->dataClusters - first
+               : fatEntriesPerBlock();
+}
 
-    return 0;
+// Largest number of runs of a page, past which its flat array is kept instead
+static uint32_t fatRunsMax(void) {
+    return fatEntriesPerBlock() * sizeof(uint32_t) / sizeof(struct fatRun) / 2;
 }
 
-int fs_info(void) {
-    /* TODO: Phase 1 */
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
-    }
-    
-    // count free data blocks
-    int fatFreeEntriesCount = 0;
-    for (unsigned int i = 0; i < superBlockPtr->dataBlocks; i++) {
-        if (fatArr[i].content == 0 && fatArr[i].content != FAT_EOC) {
-            fatFreeEntriesCount += 1;
+// Memory used by the entries of @page
+static size_t fatPageBytes(const struct fatPage *page) {
+    return page->content != NULL ? fatEntriesPerBlock() * sizeof(uint32_t)
+                                 : page->runCapacity * sizeof(struct fatRun);
+}
+
+static void fatPageRelease(struct fatPage *page) {
+    fatBytes -= fatPageBytes(page);
+    free(page->content);
+    free(page->runs);
+    page->content = NULL;
+    page->runs = NULL;
+    page->runCount = 0;
+    page->runCapacity = 0;
+}
+
+// Number of runs needed to hold @content, the entries of FAT block @block
+static uint32_t fatCountRuns(uint32_t block, const uint32_t *content) {
+    uint32_t first = fatPageFirst(block);
+    uint32_t entries = fatPageEntries(block);
+    uint32_t count = 0;
+
+    for (uint32_t j = 0; j < entries; j++) {
+        if (content[j] == 0) {
+            continue;
         }
-    }
-    
-    // count free blocks in root dir
-    int rootDirFreeEntriesCount = 0;
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rootDirArray[i].fileName, "\0") == 0) {
-            rootDirFreeEntriesCount += 1;
+        // a run goes on as long as entries are followed by the next one
+        while (j + 1 < entries && content[j] == first + j + 1 &&
+               content[j + 1] != 0) {
+            j++;
         }
+        count++;
     }
 
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", superBlockPtr->totalBlocks);
-    printf("fat_blk_count=%d\n", superBlockPtr->fatBlocks);
-    printf("rdir_blk=%d\n", superBlockPtr->rootIndex);
-    printf("data_blk=%d\n", superBlockPtr->dataStart);
-    printf("data_blk_count=%d\n", superBlockPtr->dataBlocks);
-    printf("fat_free_ratio=%d/%d\n", fatFreeEntriesCount,
-           superBlockPtr->dataBlocks);
-    printf("rdir_free_ratio=%d/%d\n", rootDirFreeEntriesCount,
-           FS_FILE_MAX_COUNT);
-
-    return 0;
+    return count;
 }
 
-int fs_create(const char *filename) {
-    /* TODO: Phase 2 */
-    // check if FS is mounted
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
-    }
+// Store @content, the entries of @page, as runs if there are few enough of
+// them, or else as a flat array
+static int fatPageStore(struct fatPage *page, const uint32_t *content) {
+    uint32_t first = fatPageFirst(page->block);
+    uint32_t entries = fatPageEntries(page->block);
+    uint32_t count = fatCountRuns(page->block, content);
+    struct fatRun *runs;
 
-    // check if filename is valid
-    if (checkFileName(filename) == -1) {
-        return -1;
-    }
+    if (count > fatRunsMax()) {
+        uint32_t *flat = (uint32_t *)malloc(fatEntriesPerBlock() * sizeof(uint32_t));
 
-    // check if the file already exists
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rootDirArray[i].fileName, filename) == 0) {
+        if (flat == NULL) {
             return -1;
         }
+        memcpy(flat, content, fatEntriesPerBlock() * sizeof(uint32_t));
+        fatPageRelease(page);
+        page->content = flat;
+        fatBytes += fatPageBytes(page);
+        return 0;
     }
 
-    // check if root dir already contains FS_FILE_MAX_COUNT files
-    int freeSpace = 0;
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rootDirArray[i].fileName, "\0") == 0) {
-            freeSpace += 1;
-        }
-    }
-    if (freeSpace == 0) {
+    runs = (struct fatRun *)malloc((count ? count : 1) * sizeof(struct fatRun));
+    if (runs == NULL) {
         return -1;
     }
+    fatPageRelease(page);
+    page->runs = runs;
+    page->runCapacity = count ? count : 1;
+    for (uint32_t j = 0; j < entries; j++) {
+        struct fatRun *run = &runs[page->runCount];
 
-    // create new file
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (rootDirArray[i].fileName[0] == '\0') {
-            strcpy(rootDirArray[i].fileName, filename);
-            rootDirArray[i].fileSize = 0;
-            rootDirArray[i].firstBlock = FAT_EOC;
-            break;
+        if (content[j] == 0) {
+            continue;
+        }
+        run->start = first + j;
+        while (j + 1 < entries && content[j] == first + j + 1 &&
+               content[j + 1] != 0) {
+            j++;
         }
+        run->length = first + j + 1 - run->start;
+        run->next = content[j];
+        page->runCount++;
     }
-    block_write(superBlockPtr->rootIndex, rootDirArray);
+    fatBytes += fatPageBytes(page);
 
     return 0;
 }
 
-int fs_delete(const char *filename) {
-    /* TODO: Phase 2 */
-    // check if FS is mounted
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
-    }
+// Entries of @page, into @content
+static void fatPageExpand(const struct fatPage *page, uint32_t *content) {
+    uint32_t first = fatPageFirst(page->block);
 
-    // check if filename is valid
-    if (checkFileName(filename) == -1) {
-        return -1;
+    if (page->content != NULL) {
+        memcpy(content, page->content, fatEntriesPerBlock() * sizeof(uint32_t));
+        return;
     }
 
-    // check if the file is in root dir
-    int found = 0;
-    int targetIndex = 0;
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rootDirArray[i].fileName, filename) == 0) {
-            found = 1;
-            targetIndex = i;
-            break;
-        }
-    }
-    if (found == 0) {
-        return -1;
-    }
+    memset(content, 0, fatEntriesPerBlock() * sizeof(uint32_t));
+    for (uint32_t i = 0; i < page->runCount; i++) {
+        const struct fatRun *run = &page->runs[i];
 
-    // check if the file is currently open
-    for (unsigned int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fdTable[i] != NULL && fdTable[i]->index == found &&
-            fdTable[i]->inUse) {
-            return -1;
+        for (uint32_t k = 0; k + 1 < run->length; k++) {
+            content[run->start - first + k] = run->start + k + 1;
         }
+        content[run->start - first + run->length - 1] = run->next;
     }
-
-    // delete the file
-    strcpy(rootDirArray[targetIndex].fileName, "\0");
-    rootDirArray[targetIndex].fileSize = 0;
-    rootDirArray[targetIndex].firstBlock = 0;
-    block_write(superBlockPtr->rootIndex, rootDirArray);
-
-    return 0;
 }
 
-int fs_ls(void) {
-    /* TODO: Phase 2 */
-    // check if FS is mounted
-    // we can move this to a function later on
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
-    }
+// Last run of @page starting at or before entry @index, -1 if none
+static int32_t fatFindRun(const struct fatPage *page, uint32_t index) {
+    int32_t low = 0;
+    int32_t high = (int32_t)page->runCount - 1;
+    int32_t found = -1;
 
-    printf("FS LS:\n");
+    while (low <= high) {
+        int32_t mid = low + (high - low) / 2;
 
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (rootDirArray[i].fileName[0] != '\0') {
-            printf("file: %s, size: %d, data_blk: %d\n",
-                   rootDirArray[i].fileName, rootDirArray[i].fileSize,
-                   rootDirArray[i].firstBlock);
+        if (page->runs[mid].start <= index) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
         }
     }
 
-    return 0;
+    return found;
 }
 
-int fs_open(const char *filename) {
-    /* TODO: Phase 3 */
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
-    }
+// Set entry @index of @page, kept as runs, to @value, merging the runs it
+// joins: return -1 if that takes more runs than the page may hold
+static int fatRunSet(struct fatPage *page, uint32_t index, uint32_t value) {
+    // runs replacing those of [from, to), with their neighbors to merge
+    struct fatRun pieces[5];
+    uint32_t count = 0;
+    int32_t at = fatFindRun(page, index);
+    uint32_t from;
+    uint32_t to;
+    uint32_t merged = 0;
 
-    // check if file is valid
-    if (checkFileName(filename) == -1) {
-        return -1;
-    }
+    if (at >= 0 && index < page->runs[at].start + page->runs[at].length) {
+        struct fatRun old = page->runs[at];
 
-    // check if the file is in root dir
-    int found = 0;
-    int targetIndex = -1;
-    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rootDirArray[i].fileName, filename) == 0) {
-            found = 1;
-            targetIndex = i;
-            break;
+        from = at;
+        to = at + 1;
+        if (from > 0) {
+            pieces[count++] = page->runs[--from];
+        }
+        if (index > old.start) {
+            pieces[count++] = (struct fatRun){old.start, index - old.start, index};
+        }
+        if (value != 0) {
+            pieces[count++] = (struct fatRun){index, 1, value};
+        }
+        if (index + 1 < old.start + old.length) {
+            pieces[count++] = (struct fatRun){index + 1,
+                                              old.start + old.length - index - 1,
+                                              old.next};
         }
+    } else {
+        if (value == 0) {
+            return 0;
+        }
+        from = at + 1;
+        to = at + 1;
+        if (from > 0) {
+            pieces[count++] = page->runs[--from];
+        }
+        pieces[count++] = (struct fatRun){index, 1, value};
     }
-    if (!found) {
-        return -1;
+    if (to < page->runCount) {
+        pieces[count++] = page->runs[to++];
     }
 
-    // check if there already %FS_OPEN_MAX_COUNT files currently open
-    int availableFDCount = 0;
-    for (unsigned int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fdTable[i] == NULL) {
-            availableFDCount += 1;
+    // join each run to the previous one when it follows it
+    for (uint32_t i = 0; i < count; i++) {
+        if (merged > 0 &&
+            pieces[merged - 1].start + pieces[merged - 1].length == pieces[i].start &&
+            pieces[merged - 1].next == pieces[i].start) {
+            pieces[merged - 1].length += pieces[i].length;
+            pieces[merged - 1].next = pieces[i].next;
+        } else {
+            pieces[merged++] = pieces[i];
         }
     }
-    if (availableFDCount == 0) {
+
+    if (page->runCount - (to - from) + merged > fatRunsMax()) {
         return -1;
     }
+    if (page->runCount - (to - from) + merged > page->runCapacity) {
+        uint32_t capacity = page->runCapacity;
+        struct fatRun *runs;
 
-    // Find a free file descriptor
-    int fdIndex = -1;
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fdTable[i] == NULL) {
-            fdTable[i] = malloc(sizeof(struct fileDescriptor));
-            if (fdTable[i] == NULL) {
-                return -1;
-            }
-            fdIndex = i;
-            break;
+        while (capacity < page->runCount - (to - from) + merged) {
+            capacity = capacity * 2 < fatRunsMax() ? capacity * 2 : fatRunsMax();
         }
-    }
-    // free one couldn't be found
-    if (fdIndex == -1) {
-        return -1;
+        runs =
+            (struct fatRun *)realloc(page->runs, capacity * sizeof(struct fatRun));
+
+        if (runs == NULL) {
+            return -1;
+        }
+        fatBytes += (capacity - page->runCapacity) * sizeof(struct fatRun);
+        page->runs = runs;
+        page->runCapacity = capacity;
     }
 
-    // Initialize the file descriptor
-    fdTable[fdIndex]->offset = 0;
-    fdTable[fdIndex]->index = targetIndex;
-    fdTable[fdIndex]->inUse = 1;
+    memmove(&page->runs[from + merged], &page->runs[to],
+            (page->runCount - to) * sizeof(struct fatRun));
+    memcpy(&page->runs[from], pieces, merged * sizeof(struct fatRun));
+    page->runCount = page->runCount - (to - from) + merged;
 
-    return fdIndex;
+    return 0;
 }
 
-int fs_close(int fd) {
-    /* TODO: Phase 3 */
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
+// Encode @page into @block, as stored on the disk
+static void encodeFatPage(const struct fatPage *page, uint8_t *block) {
+    uint32_t content[FS_FAT_ENTRIES_V1];
+    uint32_t entries = fatPageEntries(page->block);
+
+    fatPageExpand(page, content);
+    memset(block, 0, BLOCK_SIZE);
+    for (uint32_t j = 0; j < entries; j++) {
+        if (superBlockPtr->version == FS_VERSION_1) {
+            ((uint16_t *)block)[j] = narrowV1(content[j]);
+        } else {
+            ((uint32_t *)block)[j] = content[j];
+        }
     }
+}
 
-    // Check if the file descriptor is valid
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || !fdTable[fd]->inUse) {
+// Drop the least recently used page, writing it back first if modified
+static int fatEvict(void) {
+    uint8_t data[BLOCK_SIZE];
+    struct fatPage *page = NULL;
+
+    for (uint32_t i = 0; i < fatPageCount; i++) {
+        if (fatPages[i].block != UINT32_MAX &&
+            (page == NULL || fatPages[i].used < page->used)) {
+            page = &fatPages[i];
+        }
+    }
+    if (page == NULL) {
         return -1;
     }
 
-    fdTable[fd]->inUse = 0;
-    free(fdTable[fd]);
-    fdTable[fd] = NULL;
+    if (page->dirty) {
+        encodeFatPage(page, data);
+        if (ioqWriteBlock(page->block + 1, data) == -1) {
+            return -1;
+        }
+    }
+    fatPageRelease(page);
+    fatSlots[page->block] = -1;
+    page->block = UINT32_MAX;
+    page->dirty = 0;
 
     return 0;
 }
 
-int fs_stat(int fd) {
-    /* TODO: Phase 3 */
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
-        return -1;
+// Page holding FAT block @block, read from the disk if needed, NULL if it
+// cannot be
+static struct fatPage *fatPage(uint32_t block) {
+    uint8_t data[BLOCK_SIZE];
+    uint32_t content[FS_FAT_ENTRIES_V1];
+    uint32_t entries = fatPageEntries(block);
+    uint32_t runs;
+    size_t bytes;
+    struct fatPage *page = NULL;
+
+    if (fatSlots[block] >= 0) {
+        page = &fatPages[fatSlots[block]];
+        page->used = ++fatClock;
+        return page;
     }
 
-    // Check if the file descriptor is valid
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || !fdTable[fd]->inUse) {
-        return -1;
+    if (ioqReadBlock(block + 1, data) == -1) {
+        return NULL;
+    }
+    memset(content, 0, sizeof(content));
+    for (uint32_t j = 0; j < entries; j++) {
+        if (superBlockPtr->version == FS_VERSION_1) {
+            content[j] = widenV1(((uint16_t *)data)[j]);
+        } else {
+            content[j] = ((uint32_t *)data)[j];
+        }
+    }
+
+    // make room for it, within both the number of pages and their memory
+    runs = fatCountRuns(block, content);
+    bytes = runs > fatRunsMax() ? fatEntriesPerBlock() * sizeof(uint32_t)
+                                : runs * sizeof(struct fatRun);
+    for (;;) {
+        for (uint32_t i = 0; page == NULL && i < fatPageCount; i++) {
+            if (fatPages[i].block == UINT32_MAX) {
+                page = &fatPages[i];
+            }
+        }
+        if (page != NULL && (fatBytes + bytes <= FAT_CACHE_BYTES || fatBytes == 0)) {
+            break;
+        }
+        if (fatEvict() == -1) {
+            return NULL;
+        }
     }
 
-    int fileSize = rootDirArray[fdTable[fd]->index].fileSize;
+    page->block = block;
+    if (fatPageStore(page, content) == -1) {
+        page->block = UINT32_MAX;
+        return NULL;
+    }
+    page->dirty = 0;
+    page->used = ++fatClock;
+    fatSlots[block] = page - fatPages;
 
-    return fileSize;
+    return page;
 }
 
-int fs_lseek(int fd, size_t offset) {
-    /* TODO: Phase 3 */
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
+// Get entry @index of the FAT into @value: return -1 if its block cannot be
+// read
+static int fatGet(uint32_t index, uint32_t *value) {
+    struct fatPage *page = fatPage(index / fatEntriesPerBlock());
+    int32_t at;
+
+    if (page == NULL) {
         return -1;
     }
+    if (page->content != NULL) {
+        *value = page->content[index % fatEntriesPerBlock()];
+        return 0;
+    }
 
-    // Check if the file descriptor is valid
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || !fdTable[fd]->inUse) {
-        return -1;
+    // outside runs, entries are free
+    at = fatFindRun(page, index);
+    if (at < 0 || index >= page->runs[at].start + page->runs[at].length) {
+        *value = 0;
+    } else if (index == page->runs[at].start + page->runs[at].length - 1) {
+        *value = page->runs[at].next;
+    } else {
+        *value = index + 1;
     }
+    return 0;
+}
 
-    // Check if offset is larger than the current file size
-    int fileSize = fs_stat(fd);
-    if (offset > (size_t)fileSize) {
+// Set entry @index of the FAT to @value: return -1, leaving it unchanged, if
+// its block cannot be read or its page cannot hold the new value
+static int fatSet(uint32_t index, uint32_t value) {
+    struct fatPage *page = fatPage(index / fatEntriesPerBlock());
+
+    if (page == NULL) {
         return -1;
     }
 
-    fdTable[fd]->offset = offset;
+    // a page with too many runs falls back to its flat array
+    if (page->content == NULL && fatRunSet(page, index, value) == 0) {
+        page->dirty = 1;
+        return 0;
+    }
+    if (page->content == NULL) {
+        uint32_t *flat = (uint32_t *)malloc(fatEntriesPerBlock() * sizeof(uint32_t));
+
+        if (flat == NULL) {
+            return -1;
+        }
+        fatPageExpand(page, flat);
+        fatPageRelease(page);
+        page->content = flat;
+        fatBytes += fatPageBytes(page);
+    }
+    page->content[index % fatEntriesPerBlock()] = value;
+    page->dirty = 1;
+
     return 0;
 }
 
+// Write the modified blocks of the FAT back, each run of consecutive ones
+// (such as those freed by a truncation) with a single write
+static int flushFat(void) {
+    static uint8_t run[FAT_FLUSH_RUN * BLOCK_SIZE];
+    struct fatPage *dirty[FAT_CACHE_PAGES];
+    uint32_t count = 0;
+    int ret = 0;
+
+    if (batching) {
+        return 0;
+    }
+
+    // gather the modified pages, sorted by block
+    for (uint32_t i = 0; i < fatPageCount; i++) {
+        uint32_t j = count;
 
-int findDataBlockIndex(int fd) {
+        if (fatPages[i].block == UINT32_MAX || !fatPages[i].dirty) {
+            continue;
+        }
+        for (; j > 0 && dirty[j - 1]->block > fatPages[i].block; j--) {
+            dirty[j] = dirty[j - 1];
+        }
+        dirty[j] = &fatPages[i];
+        count++;
+    }
 
-    int targetIndex = 0;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t n = 0;
 
-    int fileOffset = fdTable[fd]->offset; // current file offset
+        do {
+            encodeFatPage(dirty[i + n], run + (size_t)n * BLOCK_SIZE);
+            n++;
+        } while (i + n < count && n < FAT_FLUSH_RUN &&
+                 dirty[i + n]->block == dirty[i]->block + n);
 
-    int dataBlockNum;
-    dataBlockNum = (fileOffset / BLOCK_SIZE) + 1; // find the postion of the data block based on offset
+        if (ioqWrite(dirty[i]->block + 1, n, run) == -1) {
+            ret = -1;
+        } else {
+            for (uint32_t j = 0; j < n; j++) {
+                dirty[i + j]->dirty = 0;
+            }
+        }
 
-    int startIndex = rootDirArray[fdTable[fd]->index].firstBlock; // first data block index
+        // pages made flat by fragmentation go back to runs if they can
+        for (uint32_t j = 0; j < n; j++) {
+            if (dirty[i + j]->content != NULL &&
+                fatCountRuns(dirty[i + j]->block, dirty[i + j]->content) <=
+                    fatRunsMax()) {
+                uint32_t content[FS_FAT_ENTRIES_V1];
 
-    int count = 1;
-    while (fatArr[startIndex].content != 0 && fatArr[startIndex].content != FAT_EOC) {
-        if (count == dataBlockNum) {
-            break;
+                memcpy(content, dirty[i + j]->content,
+                       fatEntriesPerBlock() * sizeof(uint32_t));
+                fatPageStore(dirty[i + j], content);
+            }
         }
-        startIndex = fatArr[startIndex].content;
-        count += 1;
+        i += n;
     }
 
-    targetIndex = startIndex;
+    return ret;
+}
 
-    return targetIndex;
+// Convert a directory entry between its version 2 on-disk and in-memory forms
+static void decodeEntry(const struct dirEntryV2 *disk, struct rootDir *entry) {
+    memcpy(entry->fileName, disk->fileName, FS_FILENAME_LEN);
+    entry->fileSize = disk->fileSize;
+    entry->firstBlock = disk->firstBlock;
+    entry->flags = disk->flags;
+    entry->slot = disk->slot;
+    entry->aux = disk->aux;
 }
 
-int find_empty_FAT_entry(void) {
-    for (int i = 0; i < superBlockPtr->dataBlocks; i++) {
-        if (fatArr[i].content == 0)
-            return i;
-    }
-    return -1;
+static void encodeEntry(const struct rootDir *entry, struct dirEntryV2 *disk) {
+    memcpy(disk->fileName, entry->fileName, FS_FILENAME_LEN);
+    disk->fileSize = entry->fileSize;
+    disk->firstBlock = entry->firstBlock;
+    disk->flags = entry->flags;
+    disk->reserved = 0;
+    disk->slot = entry->slot;
+    disk->aux = entry->aux;
 }
 
-int fs_write(int fd, void *buf, size_t count) {
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
+static int readRootDir(void) {
+    uint8_t block[BLOCK_SIZE];
+
+    if (ioqReadBlock(superBlockPtr->rootIndex, block) == -1) {
         return -1;
     }
 
-    // Validate file descriptor
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL ||
-        fdTable[fd]->inUse == 0) {
-        return -1;
+    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (superBlockPtr->version == FS_VERSION_1) {
+            struct dirEntryV1 *entry = (struct dirEntryV1 *)block + i;
+
+            memcpy(rootDirArray[i].fileName, entry->fileName, FS_FILENAME_LEN);
+            rootDirArray[i].fileSize = entry->fileSize;
+            rootDirArray[i].firstBlock = widenV1(entry->firstBlock);
+            rootDirArray[i].flags = 0;
+            rootDirArray[i].slot = 0;
+            rootDirArray[i].aux = 0;
+        } else {
+            decodeEntry((struct dirEntryV2 *)block + i, &rootDirArray[i]);
+        }
     }
 
-    if (buf == NULL || count == 0) {
-        return -1;
+    return 0;
+}
+
+static int writeRootDir(void) {
+    uint8_t block[BLOCK_SIZE];
+
+    if (batching) {
+        rootDirty = 1;
+        return 0;
     }
 
-    if (rootDirArray[fdTable[fd]->index].firstBlock == FAT_EOC) {
-        int emptyFATIndex = -1;
-        for (int i = 0; i < superBlockPtr->dataBlocks; i++) {
-            if (fatArr[i].content == 0)
-                emptyFATIndex = i;
+    memset(block, 0, BLOCK_SIZE);
+    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (superBlockPtr->version == FS_VERSION_1) {
+            struct dirEntryV1 *entry = (struct dirEntryV1 *)block + i;
+
+            memcpy(entry->fileName, rootDirArray[i].fileName, FS_FILENAME_LEN);
+            entry->fileSize = rootDirArray[i].fileSize;
+            entry->firstBlock = narrowV1(rootDirArray[i].firstBlock);
+        } else {
+            encodeEntry(&rootDirArray[i], (struct dirEntryV2 *)block + i);
         }
-        if (emptyFATIndex == -1) {
-            return 0;
+    }
+
+    return ioqWriteBlock(superBlockPtr->rootIndex, block);
+}
+
+static void freeMountState(void) {
+    for (size_t i = 0; i < dirCount; i++) {
+        free(dirTable[i].blocks);
+    }
+    free(dirTable);
+    free(dcache);
+    for (uint32_t i = 0; fatPages != NULL && i < fatPageCount; i++) {
+        fatPageRelease(&fatPages[i]);
+    }
+    free(superBlockPtr);
+    free(fatPages);
+    free(fatSlots);
+    free(rootDirArray);
+    dirTable = NULL;
+    dirCount = 0;
+    dirCapacity = 0;
+    dcache = NULL;
+    superBlockPtr = NULL;
+    fatPages = NULL;
+    fatSlots = NULL;
+    rootDirArray = NULL;
+}
+
+// Undo a partial mount
+static int abortMount(void) {
+    freeMountState();
+    ioqClose();
+    bdevClose();
+    block_disk_close();
+    return -1;
+}
+
+// Cluster of the chain of @entry holding byte @offset, FAT_EOC past its end
+// or if the FAT cannot be read
+uint32_t findDataBlockIndex(struct rootDir *entry, size_t offset) {
+    // first cluster index
+    uint32_t clusterIndex = entry->firstBlock;
+
+    // follow the chain up to the cluster holding @offset
+    for (size_t i = 0; i < offset / clusterSize() && clusterIndex != FAT_EOC;
+         i++) {
+        if (fatGet(clusterIndex, &clusterIndex) == -1) {
+            return FAT_EOC;
         }
+    }
 
-        rootDirArray[fdTable[fd]->index].firstBlock = emptyFATIndex;
-        fatArr[emptyFATIndex].content = FAT_EOC;
+    return clusterIndex;
+}
 
-        if (block_write(superBlockPtr->rootIndex, rootDirArray) == -1) {
-            return 0;
+// Free cluster, -1 if the disk is full or the FAT cannot be read
+int find_empty_FAT_entry(void) {
+    // next-fit: resume the search after the last allocated entry, so that
+    // filling a large image does not rescan its beginning every time
+    for (uint32_t n = 0; n < superBlockPtr->dataClusters; n++) {
+        uint32_t i = (fatHint + n) % superBlockPtr->dataClusters;
+        uint32_t value;
+
+        if (fatGet(i, &value) == -1) {
+            return -1;
+        }
+        if (value == 0) {
+            fatHint = i + 1;
+            return i;
         }
     }
+    return -1;
+}
 
-    uint16_t currentBlockIndex = rootDirArray[fdTable[fd]->index].firstBlock;
-    uint16_t previousBlockIndex = currentBlockIndex;
+// Release every cluster of the chain starting at @first. If the FAT fails,
+// the rest of the chain is left allocated (leaked) and -1 is returned.
+static int freeChain(uint32_t first) {
+    while (first != FAT_EOC) {
+        uint32_t next;
 
-    // go to the block based on the offest
-    for (int i = 0; i < fdTable[fd]->offset / BLOCK_SIZE &&
-                    fatArr[currentBlockIndex].content != FAT_EOC;
-         i++) {
-        previousBlockIndex = currentBlockIndex;
-        currentBlockIndex = fatArr[currentBlockIndex].content;
+        if (fatGet(first, &next) == -1 || fatSet(first, 0) == -1) {
+            return -1;
+        }
+        first = next;
     }
 
-    uint8_t writeBuffer[BLOCK_SIZE];
-    int totalWritten = 0;
+    return 0;
+}
+
+// Transfer @count bytes between @buf and the consecutive blocks starting at
+// @block, from byte @skip of that block: partial blocks go through a bounce
+// buffer, and whole blocks are moved with a single range transfer
+static int rangeIO(int write, uint32_t block, size_t skip, uint8_t *buf,
+                   size_t count) {
+    uint8_t bounce[BLOCK_SIZE];
 
     while (count > 0) {
-        if (currentBlockIndex == FAT_EOC) {
-            int newFATIndex = -1;
+        if (skip != 0 || count < BLOCK_SIZE) {
+            size_t n = BLOCK_SIZE - skip < count ? BLOCK_SIZE - skip : count;
 
-            for (int i = 0; i < superBlockPtr->dataBlocks; i++) {
-                if (fatArr[i].content == 0)
-                    newFATIndex = i;
+            if (ioqReadBlock(block, bounce) == -1) {
+                return -1;
             }
-            if (newFATIndex == -1)
-                break;
+            if (write) {
+                memcpy(bounce + skip, buf, n);
+                if (ioqWriteBlock(block, bounce) == -1) {
+                    return -1;
+                }
+            } else {
+                memcpy(buf, bounce + skip, n);
+            }
+            block++;
+            buf += n;
+            count -= n;
+            skip = 0;
+            continue;
+        }
+
+        uint32_t whole = count / BLOCK_SIZE;
+        if ((write ? ioqWrite(block, whole, buf)
+                   : ioqRead(block, whole, buf)) == -1) {
+            return -1;
+        }
+        block += whole;
+        buf += (size_t)whole * BLOCK_SIZE;
+        count -= (size_t)whole * BLOCK_SIZE;
+    }
+
+    return 0;
+}
+
+// Make the chain of file @entry long enough to hold @size bytes, and return
+// how many bytes it can hold, less than @size if the disk is full or the FAT
+// fails (0 if the chain cannot even be walked). The chain is only walked if
+// its last cluster is not in @tail (which can be NULL).
+static size_t chainExtend(struct rootDir *entry, struct chainTail *tail,
+                          size_t size) {
+    uint32_t last = FAT_EOC;
+    size_t capacity = 0;
+
+    if (tail != NULL && tail->cluster != FAT_EOC) {
+        last = tail->cluster;
+        capacity = tail->start + clusterSize();
+    } else {
+        for (uint32_t cluster = entry->firstBlock; cluster != FAT_EOC;) {
+            last = cluster;
+            capacity += clusterSize();
+            if (fatGet(cluster, &cluster) == -1) {
+                return 0;
+            }
+        }
+    }
+
+    while (capacity < size) {
+        int emptyFATIndex = find_empty_FAT_entry();
+        if (emptyFATIndex == -1 || fatSet(emptyFATIndex, FAT_EOC) == -1) {
+            break;
+        }
+
+        if (last == FAT_EOC) {
+            entry->firstBlock = emptyFATIndex;
+        } else if (fatSet(last, emptyFATIndex) == -1) {
+            fatSet(emptyFATIndex, 0);
+            break;
+        }
+        last = emptyFATIndex;
+        capacity += clusterSize();
+    }
+
+    if (tail != NULL && last != FAT_EOC) {
+        tail->cluster = last;
+        tail->start = capacity - clusterSize();
+    }
 
-            fatArr[previousBlockIndex].content = newFATIndex;
-            currentBlockIndex = newFATIndex;
-            fatArr[currentBlockIndex].content = FAT_EOC;
+    return capacity;
+}
+
+// Transfer @count bytes at @offset of the chain starting at @first. The
+// transfer is planned as runs of clusters that follow each other on the
+// disk, each moved with a single range transfer (see rangeIO()). Transfers
+// within the last cluster, when known from @tail, start right there.
+static size_t chainIO(uint32_t first, const struct chainTail *tail, int write,
+                      size_t offset, uint8_t *buf, size_t count) {
+    uint32_t cluster = first;
+    // offset in the file of the first byte of @cluster
+    size_t start = 0;
+    size_t done = 0;
+
+    if (tail != NULL && tail->cluster != FAT_EOC && offset >= tail->start) {
+        cluster = tail->cluster;
+        start = tail->start;
+    }
+
+    while (cluster != FAT_EOC && start + clusterSize() <= offset) {
+        if (fatGet(cluster, &cluster) == -1) {
+            return 0;
         }
+        start += clusterSize();
+    }
+
+    while (done < count && cluster != FAT_EOC) {
+        size_t position = offset + done;
+        uint32_t last = cluster;
+        uint32_t next;
+        size_t end = start + clusterSize();
 
-        // Read current block into buffer to handle partial writes
-        if (block_read(currentBlockIndex + superBlockPtr->dataStart,
-                       writeBuffer) == -1) {
+        // a FAT failure ends the transfer after the clusters already known
+        if (fatGet(last, &next) == -1) {
             break;
         }
+        while (end < offset + count && next == last + 1) {
+            last++;
+            end += clusterSize();
+            if (fatGet(last, &next) == -1) {
+                next = FAT_EOC;
+                break;
+            }
+        }
 
-        // Determine bytes to write in this iteration
-        size_t bytesToWriteThisIteration =
-            count < (size_t)(BLOCK_SIZE - (fdTable[fd]->offset % BLOCK_SIZE))
-                ? count
-                : (size_t)(BLOCK_SIZE - (fdTable[fd]->offset % BLOCK_SIZE));
+        size_t n = count - done < end - position ? count - done : end - position;
+        uint32_t block = superBlockPtr->dataStart +
+                         cluster * superBlockPtr->clusterBlocks +
+                         (position - start) / BLOCK_SIZE;
 
-        // write the blocks
-        memcpy(writeBuffer + (fdTable[fd]->offset % BLOCK_SIZE),
-               buf + totalWritten, bytesToWriteThisIteration);
-        if (block_write(currentBlockIndex + superBlockPtr->dataStart,
-                        writeBuffer) == -1) {
+        if (rangeIO(write, block, position % BLOCK_SIZE, buf + done, n) == -1) {
             break;
         }
+        done += n;
+        cluster = next;
+        start = end;
+    }
 
-        // Update offsets and count
-        totalWritten += bytesToWriteThisIteration;
-        count -= bytesToWriteThisIteration;
-        fdTable[fd]->offset += bytesToWriteThisIteration;
-        previousBlockIndex = currentBlockIndex;
-        currentBlockIndex = fatArr[previousBlockIndex].content;
+    return done;
+}
+
+// Write @count bytes at @offset of the chain of file @entry, extending it as
+// needed, and return how many bytes made it to the disk
+static size_t writeChain(struct rootDir *entry, struct chainTail *tail,
+                         size_t offset, const void *buf, size_t count) {
+    size_t capacity = chainExtend(entry, tail, offset + count);
+
+    if (capacity <= offset) {
+        return 0;
+    }
+    if (count > capacity - offset) {
+        count = capacity - offset;
     }
 
+    size_t totalWritten =
+        chainIO(entry->firstBlock, tail, 1, offset, (uint8_t *)buf, count);
+
     // Update file size in root directory
-    rootDirArray[fdTable[fd]->index].fileSize =
-        fdTable[fd]->offset > rootDirArray[fdTable[fd]->index].fileSize
-            ? fdTable[fd]->offset
-            : rootDirArray[fdTable[fd]->index].fileSize;
+    if (offset + totalWritten > entry->fileSize) {
+        entry->fileSize = offset + totalWritten;
+    }
+
+    return totalWritten;
+}
+
+// Read @count bytes at @offset of the chain of file @entry
+static size_t readChain(struct rootDir *entry, const struct chainTail *tail,
+                        size_t offset, void *buf, size_t count) {
+    return chainIO(entry->firstBlock, tail, 0, offset, buf, count);
+}
+
+// Cut the chain of file @entry after the clusters holding its first @size
+// bytes, releasing the others in the same pass. The chain is cut before
+// anything is released, so that a FAT failure (-1) at worst leaks clusters.
+static int chainCut(struct rootDir *entry, struct chainTail *tail,
+                    size_t size) {
+    uint32_t keep = (size + clusterSize() - 1) / clusterSize();
+    uint32_t cluster = entry->firstBlock;
 
-    // Write root directory and FAT back to disk
-    if (block_write(superBlockPtr->rootIndex, rootDirArray) == -1) {
+    tail->cluster = FAT_EOC;
+    if (keep == 0) {
+        entry->firstBlock = FAT_EOC;
+    }
+    for (uint32_t n = 0; cluster != FAT_EOC; n++) {
+        uint32_t next;
+
+        if (fatGet(cluster, &next) == -1) {
+            return -1;
+        }
+        if (n + 1 == keep) {
+            if (next != FAT_EOC && fatSet(cluster, FAT_EOC) == -1) {
+                return -1;
+            }
+            tail->cluster = cluster;
+            tail->start = (size_t)n * clusterSize();
+        } else if (n >= keep && fatSet(cluster, 0) == -1) {
+            return -1;
+        }
+        cluster = next;
+    }
+
+    return 0;
+}
+
+/*
+ * Extent-mapped files (see fs_format.h)
+ */
+
+static int extentsEnabled(void) {
+    return superBlockPtr->version != FS_VERSION_1 &&
+           (superBlockPtr->features & FS_FEATURE_EXTENTS);
+}
+
+// Drop one reference to data cluster @cluster, freeing it with the last one
+static int releaseCluster(uint32_t cluster) {
+    uint32_t entry;
+
+    if (fatGet(cluster, &entry) == -1) {
         return -1;
     }
+    return fatSet(cluster, FS_FAT_REFS(entry) > 1
+                               ? FS_FAT_REF(FS_FAT_REFS(entry) - 1)
+                               : 0);
+}
 
-    return totalWritten;
+// Add one reference to data cluster @cluster
+static int shareCluster(uint32_t cluster) {
+    uint32_t entry;
+
+    if (fatGet(cluster, &entry) == -1) {
+        return -1;
+    }
+    return fatSet(cluster, FS_FAT_REF(FS_FAT_REFS(entry) + 1));
 }
-int fs_read(int fd, void *buf, size_t count) {
-    /* TODO: Phase 4 */
 
-    if (superBlockPtr == NULL || fatArr == NULL || rootDirArray == NULL) {
+// Disk block @n of the chain starting at @first, 0 past its end or if the
+// FAT cannot be read
+static uint32_t chainBlock(uint32_t first, uint32_t n) {
+    uint32_t cluster = first;
+
+    for (uint32_t i = 0; i < n / superBlockPtr->clusterBlocks; i++) {
+        if (cluster == FAT_EOC || fatGet(cluster, &cluster) == -1) {
+            return 0;
+        }
+    }
+    if (cluster == FAT_EOC) {
+        return 0;
+    }
+
+    return clusterBlock(cluster, (size_t)(n % superBlockPtr->clusterBlocks) *
+                                     BLOCK_SIZE);
+}
+
+static void mapFree(struct extentMap *map) {
+    if (map != NULL) {
+        free(map->extents);
+        free(map->ends);
+        free(map);
+    }
+}
+
+static int mapReserve(struct extentMap *map, uint32_t count) {
+    uint32_t capacity = map->capacity ? map->capacity : 16;
+    struct fsExtent *extents;
+    uint32_t *ends;
+
+    if (count <= map->capacity) {
+        return 0;
+    }
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    extents = realloc(map->extents, capacity * sizeof(struct fsExtent));
+    if (extents == NULL) {
+        return -1;
+    }
+    map->extents = extents;
+    ends = realloc(map->ends, capacity * sizeof(uint32_t));
+    if (ends == NULL) {
         return -1;
     }
+    map->ends = ends;
+    map->capacity = capacity;
 
-    // Check if the file descriptor is valid
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || fdTable[fd]->inUse == 0) {
+    return 0;
+}
+
+// Transfer block @n of the extent map of file @entry, which must have one
+static int mapBlockIO(int write, const struct rootDir *entry, uint32_t n,
+                      uint8_t *block) {
+    uint32_t at = chainBlock(entry->firstBlock, n);
+
+    if (at == 0) {
         return -1;
     }
+    return write ? ioqWriteBlock(at, block) : ioqReadBlock(at, block);
+}
 
-    if (buf == NULL) {
+// Read the extent map of file @entry
+static struct extentMap *mapLoad(const struct rootDir *entry) {
+    uint8_t block[BLOCK_SIZE];
+    struct extentHeader *header = (struct extentHeader *)block;
+    struct extentMap *map = calloc(1, sizeof(struct extentMap));
+    size_t position = sizeof(struct extentHeader);
+    uint32_t n = 0;
+
+    if (map == NULL) {
+        return NULL;
+    }
+    map->dirtyFrom = UINT32_MAX;
+
+    if (mapBlockIO(0, entry, 0, block) == -1 ||
+        memcmp(header->magic, FS_EXTENT_MAGIC, FS_EXTENT_MAGIC_LENGTH) != 0 ||
+        mapReserve(map, header->count) == -1) {
+        mapFree(map);
+        return NULL;
+    }
+    map->count = header->count;
+
+    for (uint32_t i = 0; i < map->count; i++) {
+        // extents never straddle two blocks
+        if (position / BLOCK_SIZE != n) {
+            n = position / BLOCK_SIZE;
+            if (mapBlockIO(0, entry, n, block) == -1) {
+                mapFree(map);
+                return NULL;
+            }
+        }
+        memcpy(&map->extents[i], block + position % BLOCK_SIZE,
+               sizeof(struct fsExtent));
+        map->ends[i] = (i ? map->ends[i - 1] : 0) + map->extents[i].length;
+        position += sizeof(struct fsExtent);
+    }
+
+    return map;
+}
+
+// Write the part of the extent map of file @entry that changed
+static int mapStore(const struct rootDir *entry, struct extentMap *map) {
+    size_t bytes = sizeof(struct extentHeader) +
+                   (size_t)map->count * sizeof(struct fsExtent);
+    uint32_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t clusters =
+        (blocks + superBlockPtr->clusterBlocks - 1) / superBlockPtr->clusterBlocks;
+    uint32_t last = entry->firstBlock, have = 1;
+    uint8_t block[BLOCK_SIZE];
+
+    if (map->dirtyFrom == UINT32_MAX) {
+        return 0;
+    }
+
+    // make room for the extents added since the map was last written
+    for (uint32_t next;; have++) {
+        if (fatGet(last, &next) == -1) {
+            return -1;
+        }
+        if (next == FAT_EOC) {
+            break;
+        }
+        last = next;
+    }
+    for (; have < clusters; have++) {
+        int cluster = find_empty_FAT_entry();
+        if (cluster == -1 || fatSet(cluster, FAT_EOC) == -1) {
+            return -1;
+        }
+        if (fatSet(last, cluster) == -1) {
+            fatSet(cluster, 0);
+            return -1;
+        }
+        last = cluster;
+    }
+
+    // the header (for the extent count), then the blocks of changed extents
+    for (uint32_t n = 0; n < blocks; n++) {
+        size_t start = (size_t)n * BLOCK_SIZE;
+        uint32_t first;
+
+        if (n != 0 && start + BLOCK_SIZE <=
+                          sizeof(struct extentHeader) +
+                              (size_t)map->dirtyFrom * sizeof(struct fsExtent)) {
+            continue;
+        }
+
+        memset(block, 0, BLOCK_SIZE);
+        if (n == 0) {
+            struct extentHeader *header = (struct extentHeader *)block;
+
+            memcpy(header->magic, FS_EXTENT_MAGIC, FS_EXTENT_MAGIC_LENGTH);
+            header->count = map->count;
+            first = 0;
+        } else {
+            first = (start - sizeof(struct extentHeader)) /
+                    sizeof(struct fsExtent);
+        }
+        for (uint32_t i = first; i < map->count; i++) {
+            size_t position = sizeof(struct extentHeader) +
+                              (size_t)i * sizeof(struct fsExtent) - start;
+
+            if (position >= BLOCK_SIZE) {
+                break;
+            }
+            memcpy(block + position, &map->extents[i], sizeof(struct fsExtent));
+        }
+
+        if (mapBlockIO(1, entry, n, block) == -1) {
+            return -1;
+        }
+    }
+
+    map->dirtyFrom = UINT32_MAX;
+    return 0;
+}
+
+// Extent map of open file @file, created along with the file's first data
+static struct extentMap *mapGet(struct openFile *file) {
+    struct rootDir *entry = &file->entry;
+
+    if (file->map != NULL) {
+        return file->map;
+    }
+
+    if (entry->firstBlock != FAT_EOC) {
+        file->map = mapLoad(entry);
+        return file->map;
+    }
+
+    int cluster = find_empty_FAT_entry();
+    if (cluster == -1) {
+        return NULL;
+    }
+    file->map = calloc(1, sizeof(struct extentMap));
+    if (file->map == NULL) {
+        return NULL;
+    }
+    if (fatSet(cluster, FAT_EOC) == -1) {
+        mapFree(file->map);
+        file->map = NULL;
+        return NULL;
+    }
+    entry->firstBlock = cluster;
+    entry->flags |= FS_DIR_EXTENTS;
+    // the header still has to be written
+    file->map->dirtyFrom = 0;
+
+    return file->map;
+}
+
+// Number of file clusters covered by the extents of @map
+static uint32_t mapClusters(const struct extentMap *map) {
+    return map->count ? map->ends[map->count - 1] : 0;
+}
+
+// Add one cluster at the end of the file, right after its last extent when
+// possible so that the file stays contiguous
+static int mapGrow(struct extentMap *map) {
+    uint32_t i = map->count;
+
+    if (i > 0) {
+        struct fsExtent *last = &map->extents[i - 1];
+        uint32_t next = last->start + last->length;
+        uint32_t value;
+
+        if (next < superBlockPtr->dataClusters &&
+            fatGet(next, &value) == 0 && value == 0) {
+            if (fatSet(next, FS_FAT_REF(1)) == -1) {
+                return -1;
+            }
+            last->length++;
+            map->ends[i - 1]++;
+            if (map->dirtyFrom > i - 1) {
+                map->dirtyFrom = i - 1;
+            }
+            return 0;
+        }
+    }
+
+    if (mapReserve(map, i + 1) == -1) {
+        return -1;
+    }
+    int cluster = find_empty_FAT_entry();
+    if (cluster == -1 || fatSet(cluster, FS_FAT_REF(1)) == -1) {
         return -1;
     }
+    map->extents[i].start = cluster;
+    map->extents[i].length = 1;
+    map->ends[i] = mapClusters(map) + 1;
+    map->count++;
+    if (map->dirtyFrom > i) {
+        map->dirtyFrom = i;
+    }
+
+    return 0;
+}
+
+// Drop the file clusters of @map past the first @keep ones. They leave the
+// map even if the FAT fails (-1), so that it never refers to freed clusters.
+static int mapCut(struct extentMap *map, uint32_t keep) {
+    int ret = 0;
+
+    while (map->count > 0 && mapClusters(map) > keep) {
+        uint32_t i = map->count - 1;
+        struct fsExtent *last = &map->extents[i];
+        uint32_t start = map->ends[i] - last->length;
+        uint32_t from = keep > start ? keep - start : 0;
+
+        for (uint32_t j = from; j < last->length; j++) {
+            if (releaseCluster(last->start + j) == -1) {
+                ret = -1;
+            }
+        }
+        if (from == 0) {
+            map->count--;
+        } else {
+            last->length = from;
+            map->ends[i] = keep;
+        }
+        // the header holds the extent count
+        if (map->dirtyFrom > i) {
+            map->dirtyFrom = i;
+        }
+    }
+
+    return ret;
+}
+
+// Store the map of file @entry, which had @before clusters: if it cannot be
+// stored with the clusters added since, they are given up and the map stored
+// without them (which mapClusters() then tells)
+static int mapCommit(const struct rootDir *entry, struct extentMap *map,
+                     uint32_t before) {
+    if (mapStore(entry, map) == 0) {
+        return 0;
+    }
+    mapCut(map, before);
+
+    return mapStore(entry, map);
+}
+
+// Index of the extent holding file cluster @cluster (binary search)
+static uint32_t mapFind(const struct extentMap *map, uint32_t cluster) {
+    uint32_t low = 0, high = map->count;
 
-    int bytesRead = 0;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
 
-    int dataBlockIndexArr[superBlockPtr->dataBlocks];
-    int startIndex = findDataBlockIndex(fd); 
+        if (map->ends[middle] <= cluster) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
 
-    int index = 0;
-    dataBlockIndexArr[index] = startIndex;
-    index += 1;
+// Data cluster holding file cluster @cluster, which is in extent @i of @map
+static uint32_t mapPhysical(const struct extentMap *map, uint32_t i,
+                            uint32_t cluster) {
+    return map->extents[i].start + cluster -
+           (map->ends[i] - map->extents[i].length);
+}
 
-    while (fatArr[startIndex].content != 0 && fatArr[startIndex].content != FAT_EOC) {
-        startIndex = fatArr[startIndex].content;
+// Transfer @count bytes at @offset of a file, within its extents
+static size_t mapIO(const struct extentMap *map, int write, size_t offset,
+                    uint8_t *buf, size_t count) {
+    size_t done = 0;
 
-        dataBlockIndexArr[index] = startIndex;
+    for (uint32_t i = mapFind(map, offset / clusterSize());
+         done < count && i < map->count; i++) {
+        size_t position = offset + done;
+        size_t start = (size_t)(map->ends[i] - map->extents[i].length) *
+                       clusterSize();
+        size_t end = (size_t)map->ends[i] * clusterSize();
+        size_t n = count - done < end - position ? count - done : end - position;
+        uint32_t block = superBlockPtr->dataStart +
+                         map->extents[i].start * superBlockPtr->clusterBlocks +
+                         (position - start) / BLOCK_SIZE;
 
-        index += 1;
+        if (rangeIO(write, block, position % BLOCK_SIZE, buf + done, n) == -1) {
+            break;
+        }
+        done += n;
     }
 
-    // find the real indexes of data block
-    for (int i = 0; i < index; i++) {
-        dataBlockIndexArr[i] += superBlockPtr->dataStart;
+    return done;
+}
+
+// Make file cluster @cluster, held by extent @i of @map, refer to data
+// cluster @physical, splitting the extent around it. The map must have room
+// for two more extents.
+static void mapReplace(struct extentMap *map, uint32_t i, uint32_t cluster,
+                       uint32_t physical) {
+    struct fsExtent old = map->extents[i];
+    uint32_t k = cluster - (map->ends[i] - old.length);
+    struct fsExtent pieces[3];
+    uint32_t count = 0;
+
+    if (k > 0) {
+        pieces[count++] = (struct fsExtent){old.start, k};
+    }
+    if (k == 0 && i > 0 &&
+        map->extents[i - 1].start + map->extents[i - 1].length == physical) {
+        map->extents[i - 1].length++;
+    } else {
+        pieces[count++] = (struct fsExtent){physical, 1};
+    }
+    if (k + 1 < old.length) {
+        pieces[count++] =
+            (struct fsExtent){old.start + k + 1, old.length - k - 1};
     }
 
-    char *bounceBuff = malloc(BLOCK_SIZE * (sizeof(dataBlockIndexArr) / sizeof(int)));
+    memmove(&map->extents[i + count], &map->extents[i + 1],
+            (map->count - i - 1) * sizeof(struct fsExtent));
+    memcpy(&map->extents[i], pieces, count * sizeof(struct fsExtent));
+    map->count = map->count + count - 1;
 
-    for (int i = 0; i < index; i++) {
-        block_read(dataBlockIndexArr[i], bounceBuff + i * BLOCK_SIZE);
+    uint32_t from = i > 0 ? i - 1 : 0;
+    for (uint32_t j = from; j < map->count; j++) {
+        map->ends[j] = (j ? map->ends[j - 1] : 0) + map->extents[j].length;
     }
+    if (map->dirtyFrom > from) {
+        map->dirtyFrom = from;
+    }
+}
 
-    if (count > (size_t)(BLOCK_SIZE * index - (fdTable[fd]->offset % BLOCK_SIZE))) {
-        memcpy(buf, bounceBuff + (fdTable[fd]->offset % BLOCK_SIZE), BLOCK_SIZE * index - (fdTable[fd]->offset % BLOCK_SIZE));
+// Give file cluster @cluster, held by extent @i of @map and shared with
+// other files, a cluster of its own. Its data is copied over unless @copy
+// is 0 (the caller is about to overwrite all of it).
+static int mapUnshare(struct extentMap *map, uint32_t i, uint32_t cluster,
+                      int copy) {
+    uint32_t k = cluster - (map->ends[i] - map->extents[i].length);
+    uint32_t shared = mapPhysical(map, i, cluster);
+    int own = -1;
 
-        bytesRead = BLOCK_SIZE * index - (fdTable[fd]->offset % BLOCK_SIZE);
-    } else if (count <= (size_t)(BLOCK_SIZE * index - (fdTable[fd]->offset % BLOCK_SIZE))) {
-        memcpy(buf, bounceBuff + (fdTable[fd]->offset % BLOCK_SIZE), count);
+    // right after the previous extent if possible, to keep the file contiguous
+    if (k == 0 && i > 0) {
+        uint32_t next = map->extents[i - 1].start + map->extents[i - 1].length;
+        uint32_t value;
 
-        bytesRead = count;
+        if (next < superBlockPtr->dataClusters &&
+            fatGet(next, &value) == 0 && value == 0) {
+            own = next;
+        }
+    }
+    if (own == -1) {
+        own = find_empty_FAT_entry();
+    }
+    if (own == -1 || mapReserve(map, map->count + 2) == -1) {
+        return -1;
     }
 
-    // increase the offset
-    fdTable[fd]->offset += bytesRead;
+    if (copy) {
+        uint8_t *data = malloc(clusterSize());
+        uint32_t blocks = superBlockPtr->clusterBlocks;
+
+        if (data == NULL ||
+            ioqRead(superBlockPtr->dataStart + shared * blocks, blocks, data) == -1 ||
+            ioqWrite(superBlockPtr->dataStart + own * blocks, blocks, data) == -1) {
+            free(data);
+            return -1;
+        }
+        free(data);
+    }
+    if (fatSet(own, FS_FAT_REF(1)) == -1) {
+        return -1;
+    }
+    mapReplace(map, i, cluster, own);
+
+    // the file no longer refers to @shared either way
+    return releaseCluster(shared);
+}
+
+// Make sure that the clusters holding the @count bytes at @offset of the
+// file belong to it alone, before they are written
+static int mapPrivate(struct extentMap *map, size_t offset, size_t count) {
+    uint32_t last = (offset + count - 1) / clusterSize();
 
-    free(bounceBuff);
+    for (uint32_t cluster = offset / clusterSize();
+         cluster <= last && cluster < mapClusters(map); cluster++) {
+        uint32_t physical = mapPhysical(map, mapFind(map, cluster), cluster);
+        size_t start = (size_t)cluster * clusterSize();
+        // whether the write covers the whole cluster
+        int whole = offset <= start && offset + count >= start + clusterSize();
+        uint32_t entry;
+
+        if (fatGet(physical, &entry) == -1 ||
+            (FS_FAT_REFS(entry) > 1 &&
+             mapUnshare(map, mapFind(map, cluster), cluster, !whole) == -1)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int dedupEnabled(void) {
+    return extentsEnabled() && (superBlockPtr->features & FS_FEATURE_DEDUP);
+}
+
+// Whether the deduplication index should keep data cluster @cluster (not
+// if the FAT cannot tell, a record being only a hint)
+static int dedupKeep(uint32_t cluster) {
+    uint32_t entry;
+
+    return cluster < superBlockPtr->dataClusters &&
+           fatGet(cluster, &entry) == 0 && FS_FAT_IS_REF(entry);
+}
+
+// Data cluster holding the same clusterSize() bytes as @data, whose hash is
+// @hash, according to the deduplication index and to its content; 0 if none
+static uint32_t dedupFind(const uint64_t hash[2], const uint8_t *data) {
+    uint32_t cluster = dedupLookup(hash);
+    uint32_t entry;
+    const void *content;
+
+    // one more reference must not turn the entry into FAT_EOC
+    if (cluster == 0 || !dedupKeep(cluster) ||
+        fatGet(cluster, &entry) == -1 ||
+        FS_FAT_REFS(entry) + 1 >= FS_FAT_REFS(FAT_EOC)) {
+        return 0;
+    }
+
+    content = ioqMap(superBlockPtr->dataStart +
+                          cluster * superBlockPtr->clusterBlocks,
+                      superBlockPtr->clusterBlocks);
+    if (content == NULL || memcmp(content, data, clusterSize()) != 0) {
+        return 0;
+    }
+
+    return cluster;
+}
+
+// Make file cluster @cluster of @map refer to data cluster @shared, which
+// holds the same data, rather than to a cluster of its own
+static int mapShare(struct extentMap *map, uint32_t cluster, uint32_t shared) {
+    uint32_t i = mapFind(map, cluster);
+    uint32_t physical = mapPhysical(map, i, cluster);
+
+    if (physical == shared) {
+        return 0;
+    }
+    if (mapReserve(map, map->count + 2) == -1) {
+        return -1;
+    }
+
+    if (shareCluster(shared) == -1) {
+        return -1;
+    }
+    mapReplace(map, i, cluster, shared);
+
+    // the file no longer refers to @physical either way
+    return releaseCluster(physical);
+}
+
+// Transfer @count bytes to @offset of a file, within its extents, one
+// cluster at a time: whole clusters whose data is already on disk are
+// shared rather than written, and the others are added to the index
+static size_t mapWriteDeduped(struct extentMap *map, size_t offset,
+                              const uint8_t *buf, size_t count) {
+    size_t done = 0;
+
+    while (done < count) {
+        size_t position = offset + done;
+        uint32_t cluster = position / clusterSize();
+        size_t n = clusterSize() - position % clusterSize();
+        uint64_t hash[2];
+        uint32_t shared = 0;
+
+        if (n > count - done) {
+            n = count - done;
+        }
+
+        if (n == clusterSize()) {
+            dedupHash(buf + done, n, hash);
+            shared = dedupFind(hash, buf + done);
+        }
+        if (shared != 0) {
+            if (mapShare(map, cluster, shared) == -1) {
+                break;
+            }
+        } else {
+            if (mapPrivate(map, position, n) == -1 ||
+                mapIO(map, 1, position, (uint8_t *)buf + done, n) != n) {
+                break;
+            }
+            if (n == clusterSize()) {
+                dedupInsert(hash, mapPhysical(map, mapFind(map, cluster), cluster));
+            }
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+static size_t writeExtents(struct openFile *file, size_t offset,
+                           const void *buf, size_t count) {
+    struct extentMap *map = mapGet(file);
+    size_t covered, written;
+
+    if (map == NULL) {
+        return 0;
+    }
+
+    // allocate the clusters that the write adds to the file
+    uint32_t before = mapClusters(map);
+    uint32_t needed = (offset + count + clusterSize() - 1) / clusterSize();
+    while (mapClusters(map) < needed) {
+        if (mapGrow(map) == -1) {
+            break;
+        }
+    }
+
+    covered = (size_t)mapClusters(map) * clusterSize();
+    if (offset >= covered) {
+        written = 0;
+    } else {
+        if (count > covered - offset) {
+            count = covered - offset;
+        }
+        if (dedupEnabled()) {
+            written = mapWriteDeduped(map, offset, buf, count);
+        } else if (mapPrivate(map, offset, count) == -1) {
+            written = 0;
+        } else {
+            written = mapIO(map, 1, offset, (uint8_t *)buf, count);
+        }
+    }
+
+    // what was written to clusters the map could not keep is lost
+    if (mapCommit(&file->entry, map, before) == -1) {
+        return 0;
+    }
+    covered = (size_t)mapClusters(map) * clusterSize();
+    if (offset + written > covered) {
+        written = offset < covered ? covered - offset : 0;
+    }
+
+    if (offset + written > file->entry.fileSize) {
+        file->entry.fileSize = offset + written;
+    }
+
+    return written;
+}
+
+static size_t readExtents(struct openFile *file, size_t offset, void *buf,
+                          size_t count) {
+    struct extentMap *map = mapGet(file);
+
+    if (map == NULL) {
+        return 0;
+    }
+
+    return mapIO(map, 0, offset, buf, count);
+}
+
+// Release the data clusters and the extent map of file @entry
+static int releaseExtents(const struct rootDir *entry) {
+    struct extentMap *map = mapLoad(entry);
+
+    if (map == NULL) {
+        return -1;
+    }
+
+    int ret = 0;
+
+    for (uint32_t i = 0; i < map->count; i++) {
+        for (uint32_t j = 0; j < map->extents[i].length; j++) {
+            if (releaseCluster(map->extents[i].start + j) == -1) {
+                ret = -1;
+            }
+        }
+    }
+    if (freeChain(entry->firstBlock) == -1) {
+        ret = -1;
+    }
+    mapFree(map);
+
+    return ret;
+}
+
+// Make file @dst share the data clusters of file @src
+static int cloneExtents(struct openFile *src, struct openFile *dst) {
+    struct extentMap *from = mapGet(src);
+    struct extentMap *to = mapGet(dst);
+
+    if (from == NULL || to == NULL || mapReserve(to, from->count) == -1) {
+        return -1;
+    }
+
+    // the extents are only taken once their clusters count the reference
+    for (uint32_t i = 0; i < from->count; i++) {
+        for (uint32_t j = 0; j < from->extents[i].length; j++) {
+            if (shareCluster(from->extents[i].start + j) == -1) {
+                // give back the references taken so far
+                to->extents[i].start = from->extents[i].start;
+                to->extents[i].length = j;
+                to->ends[i] = (i ? to->ends[i - 1] : 0) + j;
+                to->count = j ? i + 1 : i;
+                mapCut(to, 0);
+                return -1;
+            }
+        }
+        to->extents[i] = from->extents[i];
+        to->ends[i] = from->ends[i];
+    }
+    to->count = from->count;
+    to->dirtyFrom = 0;
+    dst->entry.fileSize = src->entry.fileSize;
+
+    return mapStore(&dst->entry, to);
+}
+
+// Write to the clusters of (unpacked) file @file, held by its extents or by
+// its chain depending on the image
+static size_t writeClusters(struct openFile *file, size_t offset,
+                            const void *buf, size_t count) {
+    if ((file->entry.flags & FS_DIR_EXTENTS) ||
+        (extentsEnabled() && file->entry.firstBlock == FAT_EOC)) {
+        return writeExtents(file, offset, buf, count);
+    }
+
+    return writeChain(&file->entry, &file->tail, offset, buf, count);
+}
+
+// Release the clusters of @file past the ones holding its first @size bytes
+static int releaseClusters(struct openFile *file, size_t size) {
+    struct rootDir *entry = &file->entry;
+
+    if (entry->flags & FS_DIR_EXTENTS) {
+        struct extentMap *map = mapGet(file);
+
+        if (map == NULL) {
+            return -1;
+        }
+        int ret = mapCut(map, (size + clusterSize() - 1) / clusterSize());
+
+        return mapStore(entry, map) == -1 ? -1 : ret;
+    }
+
+    return chainCut(entry, &file->tail, size);
+}
+
+/*
+ * Compressed files (see fs_format.h)
+ */
+
+static int compressEnabled(void) {
+    return superBlockPtr->version != FS_VERSION_1 &&
+           (superBlockPtr->features & FS_FEATURE_COMPRESS);
+}
+
+// Add the number of clusters of the chain starting at @first to @length
+static int chainLength(uint32_t first, size_t *length) {
+    while (first != FAT_EOC) {
+        (*length)++;
+        if (fatGet(first, &first) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void chunksFree(struct chunkTable *table) {
+    if (table != NULL) {
+        free(table->chunks);
+        free(table->data);
+        free(table->packed);
+        free(table);
+    }
+}
+
+static int chunksReserve(struct chunkTable *table, uint32_t count) {
+    uint32_t capacity = table->capacity ? table->capacity : 16;
+    struct fsChunk *chunks;
+
+    if (count <= table->capacity) {
+        return 0;
+    }
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    chunks = realloc(table->chunks, capacity * sizeof(struct fsChunk));
+    if (chunks == NULL) {
+        return -1;
+    }
+    table->chunks = chunks;
+    table->capacity = capacity;
+
+    return 0;
+}
+
+// Read the chunk table of compressed file @entry
+static struct chunkTable *chunksLoad(const struct rootDir *entry) {
+    struct chunkTable *table = calloc(1, sizeof(struct chunkTable));
+    struct rootDir chain = {.firstBlock = entry->firstBlock};
+    struct compressHeader header;
+
+    if (table == NULL) {
+        return NULL;
+    }
+    table->cached = UINT32_MAX;
+    if (entry->firstBlock == FAT_EOC) {
+        return table;
+    }
+
+    if (readChain(&chain, NULL, 0, &header, sizeof(header)) !=
+            sizeof(header) ||
+        memcmp(header.magic, FS_COMPRESS_MAGIC, FS_COMPRESS_MAGIC_LENGTH) != 0 ||
+        header.chunkSize != FS_COMPRESS_CHUNK ||
+        chunksReserve(table, header.count) == -1 ||
+        readChain(&chain, NULL, sizeof(header), table->chunks,
+                  header.count * sizeof(struct fsChunk)) !=
+            header.count * sizeof(struct fsChunk)) {
+        chunksFree(table);
+        return NULL;
+    }
+    table->count = header.count;
+
+    return table;
+}
+
+// Chunk table of open file @file, with room for one decompressed chunk
+static struct chunkTable *chunksGet(struct openFile *file) {
+    if (file->chunks == NULL) {
+        file->chunks = chunksLoad(&file->entry);
+        if (file->chunks == NULL) {
+            return NULL;
+        }
+    }
+    if (file->chunks->data == NULL) {
+        file->chunks->data = malloc(FS_COMPRESS_CHUNK);
+        file->chunks->packed = malloc(FS_COMPRESS_CHUNK);
+        if (file->chunks->data == NULL || file->chunks->packed == NULL) {
+            return NULL;
+        }
+    }
+
+    return file->chunks;
+}
+
+// Write back the table entry of chunk @i of @file, along with the header
+static int chunkStore(struct openFile *file, uint32_t i) {
+    struct chunkTable *table = file->chunks;
+    struct rootDir chain = {.firstBlock = file->entry.firstBlock};
+    struct compressHeader header;
+    size_t position = sizeof(header) + (size_t)i * sizeof(struct fsChunk);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FS_COMPRESS_MAGIC, FS_COMPRESS_MAGIC_LENGTH);
+    header.count = table->count;
+    header.chunkSize = FS_COMPRESS_CHUNK;
+
+    // the header creates the table with the first chunk
+    if (writeChain(&chain, NULL, 0, &header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+    file->entry.firstBlock = chain.firstBlock;
+
+    if (writeChain(&chain, NULL, position, &table->chunks[i],
+                   sizeof(struct fsChunk)) != sizeof(struct fsChunk)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Number of bytes of chunk @i of @file
+static size_t chunkLength(const struct openFile *file, uint32_t i) {
+    size_t start = (size_t)i * FS_COMPRESS_CHUNK;
+
+    if (file->entry.fileSize <= start) {
+        return 0;
+    }
+
+    return file->entry.fileSize - start < FS_COMPRESS_CHUNK
+               ? file->entry.fileSize - start
+               : FS_COMPRESS_CHUNK;
+}
+
+// Compress the cached chunk of @file back to the disk, if it was modified
+static int chunkFlush(struct openFile *file) {
+    struct chunkTable *table = file->chunks;
+
+    if (table == NULL || !table->dirty) {
+        return 0;
+    }
+
+    uint32_t i = table->cached;
+    size_t length = chunkLength(file, i);
+    size_t clusters = (length + clusterSize() - 1) / clusterSize();
+    size_t packed = lzCompress(table->data, length, table->packed, length);
+    struct fsChunk chunk = {FAT_EOC, packed, 0, 0};
+    const uint8_t *stored = table->packed;
+
+    // store the chunk as is unless compressing it saves a cluster
+    if (packed == 0 || (packed + clusterSize() - 1) / clusterSize() >= clusters) {
+        chunk.length = length;
+        chunk.flags = FS_CHUNK_RAW;
+        stored = table->data;
+    }
+
+    struct rootDir chain = {.firstBlock = FAT_EOC};
+    if (writeChain(&chain, NULL, 0, stored, chunk.length) != chunk.length) {
+        freeChain(chain.firstBlock);
+        return -1;
+    }
+    chunk.first = chain.firstBlock;
+
+    // the previous content of the chunk is released once no longer stored
+    uint32_t previous = table->chunks[i].first;
+    table->chunks[i] = chunk;
+    table->dirty = 0;
+    if (chunkStore(file, i) == -1) {
+        return -1;
+    }
+
+    return freeChain(previous);
+}
+
+// Make chunk @i of @file the cached one
+static int chunkLoad(struct openFile *file, uint32_t i) {
+    struct chunkTable *table = file->chunks;
+
+    if (table->cached == i) {
+        return 0;
+    }
+    if (chunkFlush(file) == -1) {
+        return -1;
+    }
+    table->cached = UINT32_MAX;
+
+    memset(table->data, 0, FS_COMPRESS_CHUNK);
+    if (i >= table->count) {
+        // a new chunk at the end of the file
+        if (chunksReserve(table, i + 1) == -1) {
+            return -1;
+        }
+        for (uint32_t j = table->count; j <= i; j++) {
+            table->chunks[j] = (struct fsChunk){FAT_EOC, 0, FS_CHUNK_RAW, 0};
+        }
+        table->count = i + 1;
+    } else if (table->chunks[i].first != FAT_EOC) {
+        struct fsChunk *chunk = &table->chunks[i];
+        struct rootDir chain = {.firstBlock = chunk->first};
+
+        if (chunk->flags & FS_CHUNK_RAW) {
+            if (readChain(&chain, NULL, 0, table->data, chunk->length) !=
+                chunk->length) {
+                return -1;
+            }
+        } else if (readChain(&chain, NULL, 0, table->packed, chunk->length) !=
+                       chunk->length ||
+                   lzDecompress(table->packed, chunk->length, table->data,
+                                FS_COMPRESS_CHUNK) == -1) {
+            return -1;
+        }
+    }
+    table->cached = i;
+
+    return 0;
+}
+
+static size_t writeCompressed(struct openFile *file, size_t offset,
+                              const void *buf, size_t count) {
+    struct chunkTable *table = chunksGet(file);
+    size_t done = 0;
+
+    if (table == NULL) {
+        return 0;
+    }
+
+    while (done < count) {
+        size_t position = offset + done;
+        size_t skip = position % FS_COMPRESS_CHUNK;
+        size_t n = FS_COMPRESS_CHUNK - skip < count - done
+                       ? FS_COMPRESS_CHUNK - skip
+                       : count - done;
+
+        if (chunkLoad(file, position / FS_COMPRESS_CHUNK) == -1) {
+            break;
+        }
+        memcpy(table->data + skip, (const uint8_t *)buf + done, n);
+        table->dirty = 1;
+        done += n;
+        if (position + n > file->entry.fileSize) {
+            file->entry.fileSize = position + n;
+        }
+
+        // chunks are compressed as soon as they are full
+        if (skip + n == FS_COMPRESS_CHUNK && chunkFlush(file) == -1) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+static size_t readCompressed(struct openFile *file, size_t offset, void *buf,
+                             size_t count) {
+    struct chunkTable *table = chunksGet(file);
+    size_t done = 0;
+
+    if (table == NULL) {
+        return 0;
+    }
+
+    while (done < count) {
+        size_t position = offset + done;
+        size_t skip = position % FS_COMPRESS_CHUNK;
+        size_t n = FS_COMPRESS_CHUNK - skip < count - done
+                       ? FS_COMPRESS_CHUNK - skip
+                       : count - done;
+
+        if (chunkLoad(file, position / FS_COMPRESS_CHUNK) == -1) {
+            break;
+        }
+        memcpy((uint8_t *)buf + done, table->data + skip, n);
+        done += n;
+    }
+
+    return done;
+}
+
+// Cut compressed file @file to its first @size bytes, which are stored
+// again if its last chunk is cut
+static int chunksCut(struct openFile *file, size_t size) {
+    struct chunkTable *table = chunksGet(file);
+    uint32_t keep = (size + FS_COMPRESS_CHUNK - 1) / FS_COMPRESS_CHUNK;
+    int ret = 0;
+
+    if (table == NULL || chunkFlush(file) == -1) {
+        return -1;
+    }
+
+    if (keep == 0) {
+        for (uint32_t i = 0; i < table->count; i++) {
+            if (freeChain(table->chunks[i].first) == -1) {
+                ret = -1;
+            }
+        }
+        if (freeChain(file->entry.firstBlock) == -1) {
+            ret = -1;
+        }
+        file->entry.firstBlock = FAT_EOC;
+        file->entry.fileSize = 0;
+        chunksFree(table);
+        file->chunks = NULL;
+        return ret;
+    }
+
+    for (uint32_t i = keep; i < table->count; i++) {
+        if (freeChain(table->chunks[i].first) == -1) {
+            ret = -1;
+        }
+    }
+    if (table->cached >= keep) {
+        table->cached = UINT32_MAX;
+    }
+
+    // the header holds the chunk count
+    if (size % FS_COMPRESS_CHUNK == 0) {
+        table->count = keep;
+        file->entry.fileSize = size;
+        return chunkStore(file, keep - 1) == -1 ? -1 : ret;
+    }
+
+    if (chunkLoad(file, keep - 1) == -1) {
+        return -1;
+    }
+    table->count = keep;
+    file->entry.fileSize = size;
+    memset(table->data + (size - (size_t)(keep - 1) * FS_COMPRESS_CHUNK), 0,
+           (size_t)keep * FS_COMPRESS_CHUNK - size);
+    // compressed again with its new length, along with the header
+    table->dirty = 1;
+    return chunkFlush(file) == -1 ? -1 : ret;
+}
+
+// Release the chunks and the chunk table of compressed file @entry
+static int releaseCompressed(const struct rootDir *entry) {
+    struct chunkTable *table = chunksLoad(entry);
+    int ret = 0;
+
+    if (table == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (freeChain(table->chunks[i].first) == -1) {
+            ret = -1;
+        }
+    }
+    if (freeChain(entry->firstBlock) == -1) {
+        ret = -1;
+    }
+    chunksFree(table);
+
+    return ret;
+}
+
+/*
+ * Packed files (see fs_format.h)
+ */
+
+static int packEnabled(void) {
+    return superBlockPtr->version != FS_VERSION_1 &&
+           (superBlockPtr->features & FS_FEATURE_PACK);
+}
+
+// Number of slots of a pack cluster
+static uint32_t packSlotCount(void) {
+    return clusterSize() / FS_PACK_SLOT_SIZE;
+}
+
+// Number of slots taken by the header of a pack cluster
+static uint32_t packHeaderSlots(void) {
+    size_t bytes = sizeof(struct packHeader) + (packSlotCount() + 7) / 8;
+
+    return (bytes + FS_PACK_SLOT_SIZE - 1) / FS_PACK_SLOT_SIZE;
+}
+
+// Number of slots taken by a packed file of @size bytes
+static uint32_t packFileSlots(size_t size) {
+    return size == 0 ? 1 : (size + FS_PACK_SLOT_SIZE - 1) / FS_PACK_SLOT_SIZE;
+}
+
+static int packUsed(struct packHeader *header, uint32_t slot) {
+    return header->bitmap[slot / 8] & (1 << (slot % 8));
+}
+
+static void packMark(struct packHeader *header, uint32_t first, uint32_t count,
+                     int used) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (used) {
+            header->bitmap[i / 8] |= 1 << (i % 8);
+        } else {
+            header->bitmap[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+// First slot of a run of @count free slots within a single block, or -1
+static int packFindRun(struct packHeader *header, uint32_t count) {
+    uint32_t slotsPerBlock = BLOCK_SIZE / FS_PACK_SLOT_SIZE;
+    uint32_t run = 0;
+
+    for (uint32_t i = 0; i < packSlotCount(); i++) {
+        if (i % slotsPerBlock == 0) {
+            run = 0;
+        }
+        run = packUsed(header, i) ? 0 : run + 1;
+        if (run == count) {
+            return i + 1 - count;
+        }
+    }
+
+    return -1;
+}
+
+// Reserve @count slots, in the current pack cluster if it has room or else
+// in a new one
+static int packAlloc(uint32_t count, uint32_t *cluster, uint32_t *slot) {
+    uint8_t block[BLOCK_SIZE];
+    struct packHeader *header = (struct packHeader *)block;
+    int first = -1;
+
+    if (packCluster != FAT_EOC) {
+        if (ioqReadBlock(clusterBlock(packCluster, 0), block) == -1) {
+            return -1;
+        }
+        first = packFindRun(header, count);
+    }
+
+    if (first == -1) {
+        int newFATIndex = find_empty_FAT_entry();
+        if (newFATIndex == -1 || fatSet(newFATIndex, FAT_EOC) == -1) {
+            return -1;
+        }
+
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(header->magic, FS_PACK_MAGIC, FS_PACK_MAGIC_LENGTH);
+        header->headerSlots = packHeaderSlots();
+        packMark(header, 0, header->headerSlots, 1);
+        packCluster = newFATIndex;
+        first = packFindRun(header, count);
+    }
+
+    packMark(header, first, count, 1);
+    if (ioqWriteBlock(clusterBlock(packCluster, 0), block) == -1) {
+        return -1;
+    }
+
+    *cluster = packCluster;
+    *slot = first;
+    return 0;
+}
+
+// Release @count slots, and the whole pack cluster once it is empty
+static int packFree(uint32_t cluster, uint32_t slot, uint32_t count) {
+    uint8_t block[BLOCK_SIZE];
+    struct packHeader *header = (struct packHeader *)block;
+    uint32_t i;
+
+    if (ioqReadBlock(clusterBlock(cluster, 0), block) == -1) {
+        return -1;
+    }
+
+    packMark(header, slot, count, 0);
+    for (i = header->headerSlots; i < packSlotCount(); i++) {
+        if (packUsed(header, i)) {
+            break;
+        }
+    }
+    if (i == packSlotCount()) {
+        if (packCluster == cluster) {
+            packCluster = FAT_EOC;
+        }
+        return fatSet(cluster, 0);
+    }
+
+    // the freed slots are reused by the next small files
+    packCluster = cluster;
+    return ioqWriteBlock(clusterBlock(cluster, 0), block);
+}
+
+// Transfer @count bytes at @offset of the slots starting at @slot of @cluster
+static int packRead(uint32_t cluster, uint32_t slot, size_t offset, void *buf,
+                    size_t count) {
+    uint8_t block[BLOCK_SIZE];
+    size_t position = (size_t)slot * FS_PACK_SLOT_SIZE + offset;
+
+    if (ioqReadBlock(clusterBlock(cluster, position), block) == -1) {
+        return -1;
+    }
+    memcpy(buf, block + position % BLOCK_SIZE, count);
+
+    return 0;
+}
+
+static int packWrite(uint32_t cluster, uint32_t slot, size_t offset,
+                     const void *buf, size_t count) {
+    uint8_t block[BLOCK_SIZE];
+    size_t position = (size_t)slot * FS_PACK_SLOT_SIZE + offset;
+    uint32_t blockIndex = clusterBlock(cluster, position);
+
+    if (ioqReadBlock(blockIndex, block) == -1) {
+        return -1;
+    }
+    memcpy(block + position % BLOCK_SIZE, buf, count);
+
+    return ioqWriteBlock(blockIndex, block);
+}
+
+// Write to packed (or still empty) file @entry, which stays small enough
+static size_t writePacked(struct rootDir *entry, size_t offset,
+                          const void *buf, size_t count) {
+    int packed = entry->flags & FS_DIR_PACKED;
+    size_t size = entry->fileSize;
+    size_t newSize = offset + count > size ? offset + count : size;
+
+    if (packed && packFileSlots(newSize) <= packFileSlots(size)) {
+        // the current run is large enough
+        if (packWrite(entry->firstBlock, entry->slot, offset, buf,
+                      count) == -1) {
+            return 0;
+        }
+    } else {
+        // move the whole content to a larger run
+        uint8_t data[FS_PACK_MAX_SIZE];
+        uint32_t cluster, slot;
+
+        if (packed &&
+            packRead(entry->firstBlock, entry->slot, 0, data, size) == -1) {
+            return 0;
+        }
+        memcpy(data + offset, buf, count);
+
+        if (packAlloc(packFileSlots(newSize), &cluster, &slot) == -1 ||
+            packWrite(cluster, slot, 0, data, newSize) == -1) {
+            return 0;
+        }
+        // the data is in its new run: a failure only leaks the old one
+        if (packed) {
+            packFree(entry->firstBlock, entry->slot, packFileSlots(size));
+        }
+
+        entry->firstBlock = cluster;
+        entry->slot = slot;
+        entry->flags |= FS_DIR_PACKED;
+    }
+
+    entry->fileSize = newSize;
+    return count;
+}
+
+// Move packed file @file to clusters of its own
+static int unpackFile(struct openFile *file) {
+    struct rootDir *entry = &file->entry;
+    struct rootDir packed = *entry;
+    uint8_t data[FS_PACK_MAX_SIZE];
+
+    if (packRead(packed.firstBlock, packed.slot, 0, data,
+                 packed.fileSize) == -1) {
+        return -1;
+    }
+
+    entry->flags &= ~FS_DIR_PACKED;
+    entry->firstBlock = FAT_EOC;
+    entry->slot = 0;
+    entry->fileSize = 0;
+    if (writeClusters(file, 0, data, packed.fileSize) != packed.fileSize) {
+        // give back the clusters taken so far, along with a new extent map
+        releaseClusters(file, 0);
+        if (entry->flags & FS_DIR_EXTENTS) {
+            freeChain(entry->firstBlock);
+        }
+        mapFree(file->map);
+        file->map = NULL;
+        *entry = packed;
+        return -1;
+    }
+
+    return packFree(packed.firstBlock, packed.slot,
+                    packFileSlots(packed.fileSize));
+}
+
+/*
+ * Appends: the last block of a chained file stays in memory while it fills
+ */
+
+// Write the last block of @file, if kept in memory and modified
+static int tailFlush(struct openFile *file) {
+    if (file->tailBlock == NULL || !file->tailDirty) {
+        return 0;
+    }
+    if (chainIO(file->entry.firstBlock, &file->tail, 1, file->tailBlockStart,
+                file->tailBlock, BLOCK_SIZE) != BLOCK_SIZE) {
+        return -1;
+    }
+    file->tailDirty = 0;
+
+    return 0;
+}
+
+// Stop keeping the last block of @file in memory
+static int tailDrop(struct openFile *file) {
+    int ret = tailFlush(file);
+
+    free(file->tailBlock);
+    file->tailBlock = NULL;
+
+    return ret;
+}
+
+// Start keeping the last block of chained file @file in memory, making sure
+// that the chain holds it
+static int tailLoad(struct openFile *file) {
+    struct rootDir *entry = &file->entry;
+    size_t start = entry->fileSize / BLOCK_SIZE * BLOCK_SIZE;
+    size_t used = entry->fileSize - start;
+    uint8_t *block = calloc(1, BLOCK_SIZE);
+
+    if (block == NULL) {
+        return -1;
+    }
+    if (chainExtend(entry, &file->tail, start + BLOCK_SIZE) <
+            start + BLOCK_SIZE ||
+        (used != 0 &&
+         chainIO(entry->firstBlock, &file->tail, 0, start, block, used) !=
+             used)) {
+        free(block);
+        return -1;
+    }
+
+    file->tailBlock = block;
+    file->tailBlockStart = start;
+    file->tailDirty = 0;
+
+    return 0;
+}
+
+// Whether appends to @file go through appendChain()
+static int appendable(const struct openFile *file) {
+    return file->entry.firstBlock != FAT_EOC &&
+           !(file->entry.flags &
+             (FS_DIR_PACKED | FS_DIR_EXTENTS | FS_DIR_COMPRESSED));
+}
+
+// Append @count bytes to chained file @file, without walking its chain:
+// whole blocks are written right away, the others into the last block kept
+// in memory, which is written once full
+static size_t appendChain(struct openFile *file, const void *buf,
+                          size_t count) {
+    struct rootDir *entry = &file->entry;
+    const uint8_t *data = buf;
+    size_t done = 0;
+
+    while (done < count) {
+        size_t offset = entry->fileSize;
+
+        if (file->tailBlock == NULL && offset % BLOCK_SIZE == 0 &&
+            count - done >= BLOCK_SIZE) {
+            size_t n = (count - done) / BLOCK_SIZE * BLOCK_SIZE;
+            size_t written =
+                writeChain(entry, &file->tail, offset, data + done, n);
+
+            done += written;
+            if (written < n) {
+                break;
+            }
+            continue;
+        }
+
+        if (file->tailBlock == NULL && tailLoad(file) == -1) {
+            break;
+        }
+        size_t skip = offset - file->tailBlockStart;
+        size_t n = BLOCK_SIZE - skip < count - done ? BLOCK_SIZE - skip
+                                                    : count - done;
+
+        memcpy(file->tailBlock + skip, data + done, n);
+        file->tailDirty = 1;
+        if (skip + n == BLOCK_SIZE && tailDrop(file) == -1) {
+            break;
+        }
+        entry->fileSize += n;
+        done += n;
+    }
+
+    return done;
+}
+
+// Write @count bytes at @offset of file @file, and return how many bytes
+// were written. Small files are packed as long as they stay small.
+static size_t writeFile(struct openFile *file, size_t offset, const void *buf,
+                        size_t count) {
+    struct rootDir *entry = &file->entry;
+    int small = offset + count <= FS_PACK_MAX_SIZE;
+
+    // the block kept in memory could be overwritten on the disk
+    if (tailDrop(file) == -1) {
+        return 0;
+    }
+
+    if (entry->flags & FS_DIR_COMPRESSED) {
+        return writeCompressed(file, offset, buf, count);
+    }
+
+    if (entry->flags & FS_DIR_PACKED) {
+        if (small) {
+            return writePacked(entry, offset, buf, count);
+        }
+        if (unpackFile(file) == -1) {
+            return 0;
+        }
+    } else if (small && packEnabled() && entry->firstBlock == FAT_EOC) {
+        return writePacked(entry, offset, buf, count);
+    }
+
+    return writeClusters(file, offset, buf, count);
+}
+
+// Read @count bytes at @offset of file @file, which must not go past its end
+static size_t readFile(struct openFile *file, size_t offset, void *buf,
+                       size_t count) {
+    struct rootDir *entry = &file->entry;
+
+    if (tailFlush(file) == -1) {
+        return 0;
+    }
+
+    if (entry->flags & FS_DIR_COMPRESSED) {
+        return readCompressed(file, offset, buf, count);
+    }
+    if (entry->flags & FS_DIR_PACKED) {
+        if (packRead(entry->firstBlock, entry->slot, offset, buf,
+                     count) == -1) {
+            return 0;
+        }
+        return count;
+    }
+
+    if (entry->flags & FS_DIR_EXTENTS) {
+        return readExtents(file, offset, buf, count);
+    }
+
+    return readChain(entry, &file->tail, offset, buf, count);
+}
+
+/*
+ * Pieces of files: the byte ranges of the image holding a range of a file
+ */
+
+// Called on each piece, given as a byte range of the image
+typedef int (*pieceFn)(uint64_t position, size_t count, void *arg);
+
+struct pieceWalk {
+    uint64_t position;
+    size_t count;
+    pieceFn fn;
+    void *arg;
+};
+
+// Add the @count bytes at byte @skip of block @block to @walk, merging them
+// with the pending piece when they follow it in the image
+static int pieceAdd(struct pieceWalk *walk, uint32_t block, size_t skip,
+                    size_t count) {
+    uint64_t position = (uint64_t)block * BLOCK_SIZE + skip;
+
+    if (walk->count != 0 && walk->position + walk->count == position) {
+        walk->count += count;
+        return 0;
+    }
+
+    if (walk->count != 0 &&
+        walk->fn(walk->position, walk->count, walk->arg) == -1) {
+        return -1;
+    }
+    walk->position = position;
+    walk->count = count;
+
+    return 0;
+}
+
+// Call @fn on the pieces of the @count bytes at @offset of file @file, in
+// file order, which must not go past its end
+static int forEachPiece(struct openFile *file, size_t offset, size_t count,
+                        pieceFn fn, void *arg) {
+    struct rootDir *entry = &file->entry;
+    struct pieceWalk walk = {0, 0, fn, arg};
+    size_t done = 0;
+    int ret = 0;
+
+    if (tailFlush(file) == -1) {
+        return -1;
+    }
+
+    if (entry->flags & FS_DIR_PACKED) {
+        size_t position = (size_t)entry->slot * FS_PACK_SLOT_SIZE + offset;
+
+        if (pieceAdd(&walk, clusterBlock(entry->firstBlock, position),
+                     position % BLOCK_SIZE, count) == -1) {
+            return -1;
+        }
+    } else if (entry->flags & FS_DIR_EXTENTS) {
+        struct extentMap *map = mapGet(file);
+
+        if (map == NULL) {
+            return -1;
+        }
+        for (uint32_t i = mapFind(map, offset / clusterSize());
+             done < count && i < map->count; i++) {
+            size_t position = offset + done;
+            size_t start = (size_t)(map->ends[i] - map->extents[i].length) *
+                           clusterSize();
+            size_t end = (size_t)map->ends[i] * clusterSize();
+            size_t n = count - done < end - position ? count - done
+                                                     : end - position;
+            uint32_t block = superBlockPtr->dataStart +
+                             map->extents[i].start * superBlockPtr->clusterBlocks +
+                             (position - start) / BLOCK_SIZE;
+
+            if (pieceAdd(&walk, block, position % BLOCK_SIZE, n) == -1) {
+                return -1;
+            }
+            done += n;
+        }
+    } else {
+        uint32_t cluster = findDataBlockIndex(entry, offset);
+
+        while (done < count && cluster != FAT_EOC) {
+            size_t position = offset + done;
+            size_t n = clusterSize() - position % clusterSize();
+
+            if (n > count - done) {
+                n = count - done;
+            }
+            if (pieceAdd(&walk, clusterBlock(cluster, position),
+                         position % BLOCK_SIZE, n) == -1) {
+                return -1;
+            }
+            done += n;
+            if (done < count && fatGet(cluster, &cluster) == -1) {
+                break;
+            }
+        }
+        // the pieces found before a FAT failure are still handed over
+        if (done < count) {
+            ret = -1;
+        }
+    }
+
+    if (walk.count != 0 && fn(walk.position, walk.count, arg) == -1) {
+        return -1;
+    }
+
+    return ret;
+}
+
+// Give (unpacked) file @file clusters for its first @size bytes, without
+// writing them, and return how many bytes its clusters now cover
+static size_t reserveClusters(struct openFile *file, size_t size) {
+    struct rootDir *entry = &file->entry;
+    uint32_t needed = (size + clusterSize() - 1) / clusterSize();
+
+    if ((entry->flags & FS_DIR_EXTENTS) ||
+        (extentsEnabled() && entry->firstBlock == FAT_EOC)) {
+        struct extentMap *map = mapGet(file);
+
+        if (map == NULL) {
+            return 0;
+        }
+        uint32_t before = mapClusters(map);
+        while (mapClusters(map) < needed && mapGrow(map) == 0) {
+        }
+        if (mapCommit(entry, map, before) == -1) {
+            return 0;
+        }
+        return (size_t)mapClusters(map) * clusterSize();
+    }
+
+    return chainExtend(entry, &file->tail, (size_t)needed * clusterSize());
+}
+
+/*
+ * Read views
+ */
+
+struct viewFill {
+    struct fs_view *view;
+    int capacity;
+};
+
+// Add the piece at byte @position of the image to a view
+static int viewAdd(uint64_t position, size_t count, void *arg) {
+    struct viewFill *fill = arg;
+    struct fs_view *view = fill->view;
+    uint32_t block = position / BLOCK_SIZE;
+    const uint8_t *data = ioqMap(
+        block, (position % BLOCK_SIZE + count + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (view->iovcnt == fill->capacity) {
+        int capacity = fill->capacity ? fill->capacity * 2 : 8;
+        struct iovec *iov = realloc(view->iov, capacity * sizeof(struct iovec));
+
+        if (iov == NULL) {
+            return -1;
+        }
+        view->iov = iov;
+        fill->capacity = capacity;
+    }
+    view->iov[view->iovcnt].iov_base = (void *)(data + position % BLOCK_SIZE);
+    view->iov[view->iovcnt].iov_len = count;
+    view->iovcnt++;
+    view->length += count;
+
+    return 0;
+}
+
+/*
+ * Transfers between files and host file descriptors
+ */
+
+struct hostCopy {
+    int hostFd;
+    size_t done;
+};
+
+static int exportPiece(uint64_t position, size_t count, void *arg) {
+    struct hostCopy *copy = arg;
+    ssize_t n = ioqCopyOut(position, count, copy->hostFd);
+
+    if (n > 0) {
+        copy->done += n;
+    }
+    return n == (ssize_t)count ? 0 : -1;
+}
+
+static int importPiece(uint64_t position, size_t count, void *arg) {
+    struct hostCopy *copy = arg;
+    ssize_t n = ioqCopyIn(copy->hostFd, position, count);
+
+    if (n > 0) {
+        copy->done += n;
+    }
+    return n == (ssize_t)count ? 0 : -1;
+}
+
+/*
+ * Subdirectories (see fs_format.h)
+ */
+
+// Copy of directory block @block modified by the current batch, if any
+static struct batchBlock *batchFind(uint32_t block) {
+    for (size_t i = 0; i < batchCount; i++) {
+        if (batchBlocks[i].block == block) {
+            return &batchBlocks[i];
+        }
+    }
+    return NULL;
+}
+
+// Read or write directory block @block, through the current batch if any
+static int dirBlockRead(uint32_t block, void *buf) {
+    struct batchBlock *b = batching ? batchFind(block) : NULL;
+
+    if (b != NULL) {
+        memcpy(buf, b->data, BLOCK_SIZE);
+        return 0;
+    }
+    return ioqReadBlock(block, buf);
+}
+
+static int dirBlockWrite(uint32_t block, const void *buf) {
+    struct batchBlock *b = batching ? batchFind(block) : NULL;
+
+    if (batching && b == NULL) {
+        if (batchCount == batchCapacity) {
+            size_t capacity = batchCapacity ? batchCapacity * 2 : 16;
+            struct batchBlock *blocks =
+                realloc(batchBlocks, capacity * sizeof(struct batchBlock));
+
+            // out of memory: the block is simply not batched
+            if (blocks == NULL) {
+                return ioqWriteBlock(block, buf);
+            }
+            batchBlocks = blocks;
+            batchCapacity = capacity;
+        }
+        b = &batchBlocks[batchCount++];
+        b->block = block;
+    }
+    if (b != NULL) {
+        memcpy(b->data, buf, BLOCK_SIZE);
+        return 0;
+    }
+    return ioqWriteBlock(block, buf);
+}
+
+static int dirsEnabled(void) {
+    return superBlockPtr->version != FS_VERSION_1 &&
+           (superBlockPtr->features & FS_FEATURE_DIRS);
+}
+
+static struct dentry *dcacheSlot(uint32_t dir, const char *name) {
+    return &dcache[(fsNameHash(name) ^ dir * 2654435761u) % DCACHE_SIZE];
+}
+
+static int dcacheLookup(uint32_t dir, const char *name, struct entryLoc *loc,
+                        struct rootDir *entry) {
+    struct dentry *d = dcacheSlot(dir, name);
+
+    if (!d->valid || d->dir != dir ||
+        strncmp(d->entry.fileName, name, FS_FILENAME_LEN) != 0) {
+        return -1;
+    }
+
+    *loc = d->loc;
+    *entry = d->entry;
+    return 0;
+}
+
+static void dcacheStore(uint32_t dir, const struct entryLoc *loc,
+                        const struct rootDir *entry) {
+    struct dentry *d = dcacheSlot(dir, entry->fileName);
+
+    d->valid = 1;
+    d->dir = dir;
+    d->loc = *loc;
+    d->entry = *entry;
+}
+
+static void dcacheDrop(uint32_t dir, const char *name) {
+    struct dentry *d = dcacheSlot(dir, name);
+
+    if (d->valid && d->dir == dir &&
+        strncmp(d->entry.fileName, name, FS_FILENAME_LEN) == 0) {
+        d->valid = 0;
+    }
+}
+
+// Forget every entry of directory @dir, whose entries moved
+static void dcacheDropDir(uint32_t dir) {
+    for (size_t i = 0; i < DCACHE_SIZE; i++) {
+        if (dcache[i].dir == dir) {
+            dcache[i].valid = 0;
+        }
+    }
+}
+
+static struct dirInfo *findDir(uint32_t first) {
+    for (size_t i = 0; i < dirCount; i++) {
+        if (dirTable[i].first == first) {
+            return &dirTable[i];
+        }
+    }
+    return NULL;
+}
+
+// Load directory @entry of directory @parent, unless it already is
+static struct dirInfo *loadDir(uint32_t parent, const struct rootDir *entry) {
+    struct dirInfo *d = findDir(entry->firstBlock);
+    uint32_t count = entry->fileSize / BLOCK_SIZE;
+    uint32_t n = 0;
+
+    if (d != NULL) {
+        return d;
+    }
+
+    if (dirCount == dirCapacity) {
+        size_t capacity = dirCapacity ? dirCapacity * 2 : 16;
+        struct dirInfo *table =
+            realloc(dirTable, capacity * sizeof(struct dirInfo));
+        if (table == NULL) {
+            return NULL;
+        }
+        dirTable = table;
+        dirCapacity = capacity;
+    }
+
+    d = &dirTable[dirCount];
+    d->blocks = malloc(count * sizeof(uint32_t));
+    if (count == 0 || d->blocks == NULL) {
+        free(d->blocks);
+        return NULL;
+    }
+
+    // list the blocks of the table once, so that a bucket is found without
+    // walking the chain
+    for (uint32_t c = entry->firstBlock; c != FAT_EOC && n < count;) {
+        for (uint32_t k = 0; k < superBlockPtr->clusterBlocks && n < count;
+             k++) {
+            d->blocks[n++] = clusterBlock(c, (size_t)k * BLOCK_SIZE);
+        }
+        if (n < count && fatGet(c, &c) == -1) {
+            free(d->blocks);
+            return NULL;
+        }
+    }
+
+    d->first = entry->firstBlock;
+    d->parent = parent;
+    memcpy(d->name, entry->fileName, FS_FILENAME_LEN);
+    d->blockCount = n;
+    d->entries = entry->aux;
+    d->dirty = 0;
+    dirCount++;
+
+    return d;
+}
+
+static void unloadDir(struct dirInfo *d) {
+    free(d->blocks);
+    *d = dirTable[--dirCount];
+}
+
+// Look @name up in the hash table of @d
+static int dirFind(struct dirInfo *d, const char *name, struct entryLoc *loc,
+                   struct rootDir *entry) {
+    uint8_t block[BLOCK_SIZE];
+    uint32_t home = fsNameHash(name) % d->blockCount;
+
+    for (uint32_t n = 0; n < d->blockCount; n++) {
+        uint32_t blockIndex = d->blocks[(home + n) % d->blockCount];
+        int neverUsed = 0;
+
+        if (dirBlockRead(blockIndex, block) == -1) {
+            return -1;
+        }
+        for (unsigned int i = 0; i < FS_DIR_ENTRIES_PER_BLOCK; i++) {
+            struct dirEntryV2 *e = (struct dirEntryV2 *)block + i;
+
+            if (e->fileName[0] == '\0') {
+                neverUsed |= !(e->flags & FS_DIR_DELETED);
+                continue;
+            }
+            if (strncmp(e->fileName, name, FS_FILENAME_LEN) == 0) {
+                loc->block = blockIndex;
+                loc->index = i;
+                decodeEntry(e, entry);
+                return 0;
+            }
+        }
+
+        // the entry would have been stored in this block
+        if (neverUsed) {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+// Find directory entry @name of directory @dir
+static int lookupEntry(uint32_t dir, const char *name, struct entryLoc *loc,
+                       struct rootDir *entry) {
+    struct dirInfo *d;
+
+    if (dir == ROOT_DIR) {
+        for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+            if (rootDirArray[i].fileName[0] != '\0' &&
+                strcmp(rootDirArray[i].fileName, name) == 0) {
+                loc->block = superBlockPtr->rootIndex;
+                loc->index = i;
+                *entry = rootDirArray[i];
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    if (dcacheLookup(dir, name, loc, entry) == 0) {
+        return 0;
+    }
+
+    d = findDir(dir);
+    if (d == NULL || dirFind(d, name, loc, entry) == -1) {
+        return -1;
+    }
+    dcacheStore(dir, loc, entry);
+
+    return 0;
+}
+
+// Write entry @entry of subdirectory @dir at @loc
+static int writeEntryAt(uint32_t dir, const struct entryLoc *loc,
+                        const struct rootDir *entry) {
+    uint8_t block[BLOCK_SIZE];
+
+    if (dirBlockRead(loc->block, block) == -1) {
+        return -1;
+    }
+    encodeEntry(entry, (struct dirEntryV2 *)block + loc->index);
+    if (dirBlockWrite(loc->block, block) == -1) {
+        return -1;
+    }
+    dcacheStore(dir, loc, entry);
+
+    return 0;
+}
+
+// Write back the updated entry @entry of directory @dir
+static int storeEntry(uint32_t dir, const struct rootDir *entry) {
+    struct entryLoc loc;
+    struct rootDir old;
+
+    if (lookupEntry(dir, entry->fileName, &loc, &old) == -1) {
+        return -1;
+    }
+
+    if (dir == ROOT_DIR) {
+        rootDirArray[loc.index] = *entry;
+        return writeRootDir();
+    }
+
+    return writeEntryAt(dir, &loc, entry);
+}
+
+// Store @entry in the block of @table (@count blocks) where lookups find it
+static void tablePlace(uint8_t *table, uint32_t count,
+                       const struct rootDir *entry) {
+    uint32_t home = fsNameHash(entry->fileName) % count;
+
+    for (uint32_t n = 0; n < count; n++) {
+        struct dirEntryV2 *e =
+            (struct dirEntryV2 *)(table + (size_t)((home + n) % count) *
+                                              BLOCK_SIZE);
+
+        for (unsigned int i = 0; i < FS_DIR_ENTRIES_PER_BLOCK; i++) {
+            if (e[i].fileName[0] == '\0') {
+                encodeEntry(entry, &e[i]);
+                return;
+            }
+        }
+    }
+}
+
+// Double the hash table of @d, rehashing its entries (which also gets rid
+// of the deleted ones)
+static int dirGrow(struct dirInfo *d) {
+    uint32_t count = d->blockCount * 2;
+    uint32_t clusters = d->blockCount / superBlockPtr->clusterBlocks;
+    uint32_t last = (d->blocks[d->blockCount - 1] - superBlockPtr->dataStart) /
+                    superBlockPtr->clusterBlocks;
+    uint32_t added = FAT_EOC, tail = FAT_EOC;
+    uint32_t *blocks;
+    uint8_t *table, *block;
+    struct entryLoc loc;
+    struct rootDir self;
+    int ret = -1;
+
+    if ((uint64_t)count * BLOCK_SIZE > UINT32_MAX) {
+        return -1;
+    }
+
+    blocks = malloc(count * sizeof(uint32_t));
+    table = calloc(count, BLOCK_SIZE);
+    block = malloc(BLOCK_SIZE);
+    if (blocks == NULL || table == NULL || block == NULL) {
+        goto out;
+    }
+
+    // allocate as many clusters as the table already has, listing their
+    // blocks after the current ones
+    memcpy(blocks, d->blocks, d->blockCount * sizeof(uint32_t));
+    for (uint32_t i = 0, n = d->blockCount; i < clusters; i++) {
+        int c = find_empty_FAT_entry();
+
+        if (c == -1 || fatSet(c, FAT_EOC) == -1) {
+            freeChain(added);
+            goto out;
+        }
+        if (added == FAT_EOC) {
+            added = c;
+        } else if (fatSet(tail, c) == -1) {
+            freeChain(c);
+            freeChain(added);
+            goto out;
+        }
+        tail = c;
+        for (uint32_t k = 0; k < superBlockPtr->clusterBlocks; k++) {
+            blocks[n++] = clusterBlock(c, (size_t)k * BLOCK_SIZE);
+        }
+    }
+
+    // rehash the live entries
+    for (uint32_t b = 0; b < d->blockCount; b++) {
+        if (dirBlockRead(d->blocks[b], block) == -1) {
+            freeChain(added);
+            goto out;
+        }
+        for (unsigned int i = 0; i < FS_DIR_ENTRIES_PER_BLOCK; i++) {
+            struct dirEntryV2 *e = (struct dirEntryV2 *)block + i;
+            struct rootDir entry;
+
+            if (e->fileName[0] != '\0') {
+                decodeEntry(e, &entry);
+                tablePlace(table, count, &entry);
+            }
+        }
+    }
+
+    if (fatSet(last, added) == -1) {
+        freeChain(added);
+        goto out;
+    }
+
+    for (uint32_t b = 0; b < count; b++) {
+        if (dirBlockWrite(blocks[b], table + (size_t)b * BLOCK_SIZE) == -1) {
+            goto out;
+        }
+    }
+
+    free(d->blocks);
+    d->blocks = blocks;
+    d->blockCount = count;
+    blocks = NULL;
+    dcacheDropDir(d->first);
+
+    // record the new size (and entry count) in the directory entry
+    if (lookupEntry(d->parent, d->name, &loc, &self) == 0) {
+        self.fileSize = count * BLOCK_SIZE;
+        self.aux = d->entries;
+        if (storeEntry(d->parent, &self) == 0) {
+            d->dirty = 0;
+        }
+    }
+    ret = flushFat();
+
+out:
+    free(blocks);
+    free(table);
+    free(block);
+    return ret;
+}
+
+// Add @entry to directory @dir, whose entries must not include its name
+static int insertEntry(uint32_t dir, const struct rootDir *entry) {
+    uint8_t block[BLOCK_SIZE];
+    struct dirInfo *d;
+    uint32_t home;
+
+    if (dir == ROOT_DIR) {
+        for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+            if (rootDirArray[i].fileName[0] == '\0') {
+                rootDirArray[i] = *entry;
+                return writeRootDir();
+            }
+        }
+        return -1;
+    }
+
+    d = findDir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+
+    // keep the table at most three quarters full, so that probing stays
+    // short (a failure only matters if the table is really full)
+    if ((uint64_t)(d->entries + 1) * 4 >
+        (uint64_t)d->blockCount * FS_DIR_ENTRIES_PER_BLOCK * 3) {
+        dirGrow(d);
+    }
+
+    home = fsNameHash(entry->fileName) % d->blockCount;
+    for (uint32_t n = 0; n < d->blockCount; n++) {
+        struct entryLoc loc = {d->blocks[(home + n) % d->blockCount], 0};
+
+        if (dirBlockRead(loc.block, block) == -1) {
+            return -1;
+        }
+        for (loc.index = 0; loc.index < FS_DIR_ENTRIES_PER_BLOCK; loc.index++) {
+            if (((struct dirEntryV2 *)block)[loc.index].fileName[0] == '\0') {
+                break;
+            }
+        }
+        if (loc.index < FS_DIR_ENTRIES_PER_BLOCK) {
+            d->entries++;
+            d->dirty = 1;
+            return writeEntryAt(dir, &loc, entry);
+        }
+    }
+
+    return -1;
+}
+
+// Remove entry @name, found at @loc, from directory @dir
+static int removeEntryAt(uint32_t dir, const struct entryLoc *loc,
+                         const char *name) {
+    uint8_t block[BLOCK_SIZE];
+    struct dirEntryV2 *e;
+    struct dirInfo *d;
+
+    if (dir == ROOT_DIR) {
+        memset(&rootDirArray[loc->index], 0, sizeof(struct rootDir));
+        return writeRootDir();
+    }
+
+    // leave a tombstone, so that lookups keep probing past this block
+    if (dirBlockRead(loc->block, block) == -1) {
+        return -1;
+    }
+    e = (struct dirEntryV2 *)block + loc->index;
+    memset(e, 0, sizeof(struct dirEntryV2));
+    e->flags = FS_DIR_DELETED;
+    if (dirBlockWrite(loc->block, block) == -1) {
+        return -1;
+    }
+
+    dcacheDrop(dir, name);
+    d = findDir(dir);
+    d->entries--;
+    d->dirty = 1;
+
+    return 0;
+}
+
+// Call @fn on every entry of directory @d, until it returns non-zero
+static int dirForEach(struct dirInfo *d,
+                      int (*fn)(const struct rootDir *entry)) {
+    uint8_t block[BLOCK_SIZE];
+
+    for (uint32_t b = 0; b < d->blockCount; b++) {
+        if (dirBlockRead(d->blocks[b], block) == -1) {
+            return -1;
+        }
+        for (unsigned int i = 0; i < FS_DIR_ENTRIES_PER_BLOCK; i++) {
+            struct dirEntryV2 *e = (struct dirEntryV2 *)block + i;
+            struct rootDir entry;
+
+            if (e->fileName[0] == '\0') {
+                continue;
+            }
+            decodeEntry(e, &entry);
+            if (fn(&entry)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Write the entry counts of the directories back to their entries
+static int flushDirs(void) {
+    int ret = 0;
+
+    for (size_t i = 0; i < dirCount; i++) {
+        struct dirInfo *d = &dirTable[i];
+        struct entryLoc loc;
+        struct rootDir self;
+
+        if (!d->dirty) {
+            continue;
+        }
+        if (lookupEntry(d->parent, d->name, &loc, &self) == -1) {
+            ret = -1;
+            continue;
+        }
+        self.aux = d->entries;
+        if (storeEntry(d->parent, &self) == -1) {
+            ret = -1;
+            continue;
+        }
+        d->dirty = 0;
+    }
+
+    return ret;
+}
+
+// Split @path into the directory holding its last component, and the name of
+// that component. Without subdirectories, @path is a plain file name.
+static int resolvePath(const char *path, uint32_t *dir, char *name) {
+    *dir = ROOT_DIR;
+
+    if (!dirsEnabled()) {
+        if (checkFileName(path) == -1) {
+            return -1;
+        }
+        strcpy(name, path);
+        return 0;
+    }
+
+    if (*path == '/') {
+        path++;
+    }
+
+    for (;;) {
+        const char *slash = strchr(path, '/');
+        size_t len = slash != NULL ? (size_t)(slash - path) : strlen(path);
+        struct entryLoc loc;
+        struct rootDir entry;
+
+        if (len == 0 || len >= FS_FILENAME_LEN) {
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        if (slash == NULL) {
+            return 0;
+        }
+
+        // every other component is a directory to go through
+        if (lookupEntry(*dir, name, &loc, &entry) == -1 ||
+            !(entry.flags & FS_DIR_DIRECTORY) ||
+            loadDir(*dir, &entry) == NULL) {
+            return -1;
+        }
+        *dir = entry.firstBlock;
+        path = slash + 1;
+    }
+}
+
+// Resolve @path to the directory it names, the root directory being "/"
+static int resolveDir(const char *path, uint32_t *dir) {
+    char name[FS_FILENAME_LEN];
+    struct entryLoc loc;
+    struct rootDir entry;
+    uint32_t parent;
+
+    if (path[0] == '\0' || strcmp(path, "/") == 0) {
+        *dir = ROOT_DIR;
+        return 0;
+    }
+
+    if (!dirsEnabled() || resolvePath(path, &parent, name) == -1 ||
+        lookupEntry(parent, name, &loc, &entry) == -1 ||
+        !(entry.flags & FS_DIR_DIRECTORY) ||
+        loadDir(parent, &entry) == NULL) {
+        return -1;
+    }
+
+    *dir = entry.firstBlock;
+    return 0;
+}
+
+static int doMount(const char *diskname) {
+    /* TODO: Phase 1 */
+    // OPEN diskfile
+    if (block_disk_open(diskname) == -1) {
+        return -1;
+    }
+    // second handle on the image, for transfers of block ranges
+    if (bdevOpen(diskname) == -1) {
+        block_disk_close();
+        return -1;
+    }
+
+    superBlockPtr = (struct superblock *)malloc(sizeof(struct superblock));
+    if (superBlockPtr == NULL) {
+        return abortMount();
+    }
+    // read superblock
+    if (readSuperblock() == -1) {
+        return abortMount();
+    }
+
+    // FAT blocks are only read when first used
+    fatPageCount = superBlockPtr->fatBlocks < FAT_CACHE_PAGES
+                       ? superBlockPtr->fatBlocks
+                       : FAT_CACHE_PAGES;
+    fatPages = (struct fatPage *)calloc(fatPageCount, sizeof(struct fatPage));
+    fatSlots = (int32_t *)malloc(superBlockPtr->fatBlocks * sizeof(int32_t));
+    rootDirArray = (struct rootDir *)malloc(FS_FILE_MAX_COUNT * sizeof(struct rootDir));
+    if (fatPages == NULL || fatSlots == NULL || rootDirArray == NULL) {
+        return abortMount();
+    }
+    for (uint32_t i = 0; i < fatPageCount; i++) {
+        fatPages[i].block = UINT32_MAX;
+    }
+    for (uint32_t i = 0; i < superBlockPtr->fatBlocks; i++) {
+        fatSlots[i] = -1;
+    }
+    fatClock = 0;
+    fatBytes = 0;
+
+    // read the root directory
+    if (readRootDir() == -1) {
+        return abortMount();
+    }
+    fatHint = 1;
+
+    if (dirsEnabled()) {
+        dcache = (struct dentry *)calloc(DCACHE_SIZE, sizeof(struct dentry));
+        if (dcache == NULL) {
+            return abortMount();
+        }
+    }
+
+    // keep filling the pack cluster of the last packed file
+    packCluster = FAT_EOC;
+    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (rootDirArray[i].fileName[0] != '\0' &&
+            (rootDirArray[i].flags & FS_DIR_PACKED)) {
+            packCluster = rootDirArray[i].firstBlock;
+        }
+    }
+
+    if (dedupEnabled() &&
+        dedupOpen(diskname, superBlockPtr->dataClusters) == -1) {
+        return abortMount();
+    }
+
+    return 0;
+}
+
+static int doUmount(void) {
+    /* TODO: Phase 1 */
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // check if there are still open file descriptors, or read views
+    for (unsigned int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fdTable[i] != NULL) {
+            return -1;
+        }
+    }
+    if (viewCount > 0) {
+        return -1;
+    }
+
+    if (flushDirs() == -1 || flushFat() == -1 || ioqSync() == -1) {
+        return -1;
+    }
+
+    // without its index, the image only stops sharing the clusters
+    // written so far
+    if (dedupEnabled()) {
+        dedupClose(dedupKeep);
+    }
+    ioqClose();
+    bdevClose();
+    if (block_disk_close() == -1) {
+        return -1;
+    }
+
+    freeMountState();
+
+    return 0;
+}
+
+static int doInfo(void) {
+    /* TODO: Phase 1 */
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+    
+    // count free clusters
+    uint32_t fatFreeEntriesCount = 0;
+    for (uint32_t i = 0; i < superBlockPtr->dataClusters; i++) {
+        uint32_t value;
+
+        if (fatGet(i, &value) == -1) {
+            return -1;
+        }
+        if (value == 0) {
+            fatFreeEntriesCount += 1;
+        }
+    }
+    
+    // count free blocks in root dir
+    int rootDirFreeEntriesCount = 0;
+    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (strcmp(rootDirArray[i].fileName, "\0") == 0) {
+            rootDirFreeEntriesCount += 1;
+        }
+    }
+
+    printf("FS Info:\n");
+    printf("total_blk_count=%u\n", superBlockPtr->totalBlocks);
+    printf("fat_blk_count=%u\n", superBlockPtr->fatBlocks);
+    printf("rdir_blk=%u\n", superBlockPtr->rootIndex);
+    printf("data_blk=%u\n", superBlockPtr->dataStart);
+    printf("data_blk_count=%u\n", superBlockPtr->dataBlocks);
+    printf("fat_free_ratio=%u/%u\n", fatFreeEntriesCount,
+           superBlockPtr->dataClusters);
+    printf("rdir_free_ratio=%d/%d\n", rootDirFreeEntriesCount,
+           FS_FILE_MAX_COUNT);
+    if (superBlockPtr->version != FS_VERSION_1) {
+        printf("cluster_blk_count=%u\n", superBlockPtr->clusterBlocks);
+    }
+
+    return 0;
+}
+
+static int doCreate(const char *filename) {
+    /* TODO: Phase 2 */
+    // check if FS is mounted
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // check if filename is valid, and find the directory it goes in
+    uint32_t dir;
+    char name[FS_FILENAME_LEN];
+    if (resolvePath(filename, &dir, name) == -1) {
+        return -1;
+    }
+
+    // check if the file already exists
+    struct entryLoc loc;
+    struct rootDir entry;
+    if (lookupEntry(dir, name, &loc, &entry) == 0) {
+        return -1;
+    }
+
+    // create new file (which fails if the root dir already contains
+    // FS_FILE_MAX_COUNT files)
+    memset(&entry, 0, sizeof(entry));
+    strcpy(entry.fileName, name);
+    entry.fileSize = 0;
+    entry.firstBlock = FAT_EOC;
+
+    return insertEntry(dir, &entry);
+}
+
+// Open file @name of directory @dir, if any
+static struct openFile *findOpenFile(uint32_t dir, const char *name) {
+    for (struct openFile *file = openFiles; file != NULL; file = file->next) {
+        if (file->dir == dir && strcmp(file->entry.fileName, name) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+// Delete file @entry, found at @loc in directory @dir, without writing the
+// FAT back
+static int deleteFile(uint32_t dir, const struct entryLoc *loc,
+                      const struct rootDir *entry) {
+    // directories go through fs_rmdir() instead, and open files stay
+    if ((entry->flags & FS_DIR_DIRECTORY) ||
+        findOpenFile(dir, entry->fileName) != NULL) {
+        return -1;
+    }
+
+    // the entry goes first, so that a failure past it at worst leaks the
+    // space of the file
+    if (removeEntryAt(dir, loc, entry->fileName) == -1) {
+        return -1;
+    }
+
+    // the slots of a packed file go back to its pack cluster
+    if (entry->flags & FS_DIR_PACKED) {
+        return packFree(entry->firstBlock, entry->slot,
+                        packFileSlots(entry->fileSize));
+    }
+    // so do the clusters of an extent-mapped file
+    if (entry->flags & FS_DIR_EXTENTS) {
+        return releaseExtents(entry);
+    }
+    // and the chunks of a compressed file
+    if (entry->flags & FS_DIR_COMPRESSED) {
+        return releaseCompressed(entry);
+    }
+    // and the chain of any other file
+    return freeChain(entry->firstBlock);
+}
+
+static int doDelete(const char *filename) {
+    /* TODO: Phase 2 */
+    // check if FS is mounted
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // check if filename is valid
+    uint32_t dir;
+    char name[FS_FILENAME_LEN];
+    if (resolvePath(filename, &dir, name) == -1) {
+        return -1;
+    }
+
+    // check if the file is in its directory
+    struct entryLoc loc;
+    struct rootDir entry;
+    if (lookupEntry(dir, name, &loc, &entry) == -1) {
+        return -1;
+    }
+    // what was released before a failure is written back all the same
+    int ret = deleteFile(dir, &loc, &entry);
+
+    return flushFat() == -1 ? -1 : ret;
+}
+
+static int printEntry(const struct rootDir *entry) {
+    // show the block index as stored on disk
+    uint32_t firstBlock = entry->firstBlock;
+    if (superBlockPtr->version == FS_VERSION_1) {
+        firstBlock = narrowV1(firstBlock);
+    }
+    printf("%s: %s, size: %u, data_blk: %u\n",
+           (entry->flags & FS_DIR_DIRECTORY) ? "dir" : "file",
+           entry->fileName, entry->fileSize, firstBlock);
+
+    return 0;
+}
+
+static int doLs(void) {
+    /* TODO: Phase 2 */
+    // check if FS is mounted
+    // we can move this to a function later on
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    printf("FS LS:\n");
+
+    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (rootDirArray[i].fileName[0] != '\0') {
+            printEntry(&rootDirArray[i]);
+        }
+    }
+
+    return 0;
+}
+
+static int doOpen(const char *filename) {
+    /* TODO: Phase 3 */
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // check if file is valid
+    uint32_t dir;
+    char name[FS_FILENAME_LEN];
+    if (resolvePath(filename, &dir, name) == -1) {
+        return -1;
+    }
+
+    // check if the file is in its directory
+    struct entryLoc loc;
+    struct rootDir entry;
+    if (lookupEntry(dir, name, &loc, &entry) == -1 ||
+        (entry.flags & FS_DIR_DIRECTORY)) {
+        return -1;
+    }
+
+    // check if there already %FS_OPEN_MAX_COUNT files currently open
+    int availableFDCount = 0;
+    for (unsigned int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fdTable[i] == NULL) {
+            availableFDCount += 1;
+        }
+    }
+    if (availableFDCount == 0) {
+        return -1;
+    }
+
+    // descriptors of the same file share its entry
+    struct openFile *file = findOpenFile(dir, name);
+    if (file == NULL) {
+        file = malloc(sizeof(struct openFile));
+        if (file == NULL) {
+            return -1;
+        }
+        file->dir = dir;
+        file->entry = entry;
+        file->map = NULL;
+        file->chunks = NULL;
+        file->tail.cluster = FAT_EOC;
+        file->tailBlock = NULL;
+        file->refs = 0;
+        file->views = 0;
+    }
+
+    // Find a free file descriptor
+    int fdIndex = -1;
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fdTable[i] == NULL) {
+            fdTable[i] = malloc(sizeof(struct fileDescriptor));
+            if (fdTable[i] == NULL) {
+                break;
+            }
+            fdIndex = i;
+            break;
+        }
+    }
+    // free one couldn't be found
+    if (fdIndex == -1) {
+        if (file->refs == 0) {
+            free(file);
+        }
+        return -1;
+    }
+
+    // Initialize the file descriptor
+    if (file->refs++ == 0) {
+        file->next = openFiles;
+        openFiles = file;
+    }
+    fdTable[fdIndex]->offset = 0;
+    fdTable[fdIndex]->file = file;
+    fdTable[fdIndex]->inUse = 1;
+    fdTable[fdIndex]->append = 0;
+
+    return fdIndex;
+}
+
+// Drop a reference to open file @file, freeing it with the last one
+static void putFile(struct openFile *file) {
+    if (--file->refs == 0) {
+        struct openFile **link = &openFiles;
+
+        // the last chunk written to a compressed file is still in memory
+        if (file->chunks != NULL && file->chunks->dirty &&
+            chunkFlush(file) == 0) {
+            storeEntry(file->dir, &file->entry);
+            flushFat();
+        }
+        tailDrop(file);
+
+        while (*link != file) {
+            link = &(*link)->next;
+        }
+        *link = file->next;
+        mapFree(file->map);
+        chunksFree(file->chunks);
+        free(file);
+    }
+}
+
+// Write the data of @file still in memory, along with its entry
+static int fileFlush(struct openFile *file) {
+    if (tailFlush(file) == -1) {
+        return -1;
+    }
+    if (file->chunks != NULL && file->chunks->dirty &&
+        chunkFlush(file) == -1) {
+        return -1;
+    }
+    if (storeEntry(file->dir, &file->entry) == -1 || flushFat() == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int doClose(int fd) {
+    /* TODO: Phase 3 */
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // Check if the file descriptor is valid
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || !fdTable[fd]->inUse) {
+        return -1;
+    }
+
+    // the size of the file already counts the data still in memory: the
+    // file descriptor stays open if it cannot be written
+    struct openFile *file = fdTable[fd]->file;
+    if ((file->tailDirty || (file->chunks != NULL && file->chunks->dirty)) &&
+        fileFlush(file) == -1) {
+        return -1;
+    }
+
+    putFile(file);
+    fdTable[fd]->inUse = 0;
+    free(fdTable[fd]);
+    fdTable[fd] = NULL;
+
+    return 0;
+}
+
+static int validFd(int fd) {
+    return superBlockPtr != NULL && fatPages != NULL && rootDirArray != NULL &&
+           fd >= 0 && fd < FS_OPEN_MAX_COUNT && fdTable[fd] != NULL &&
+           fdTable[fd]->inUse;
+}
+
+static int doOpenAppend(const char *filename) {
+    int fd = doOpen(filename);
+
+    if (fd != -1) {
+        fdTable[fd]->append = 1;
+    }
+
+    return fd;
+}
+
+static int doFsync(int fd) {
+    if (!validFd(fd)) {
+        return -1;
+    }
+
+    if (fileFlush(fdTable[fd]->file) == -1 || ioqSync() == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int doTruncate(int fd, size_t length) {
+    if (!validFd(fd)) {
+        return -1;
+    }
+
+    struct openFile *file = fdTable[fd]->file;
+    struct rootDir *entry = &file->entry;
+    int ret = 0;
+
+    // read views pin the current data of the file
+    if (length > entry->fileSize || file->views > 0) {
+        return -1;
+    }
+    if (tailDrop(file) == -1) {
+        return -1;
+    }
+
+    if (entry->flags & FS_DIR_PACKED) {
+        uint32_t slots = packFileSlots(entry->fileSize);
+        uint32_t keep = packFileSlots(length);
+
+        if (keep < slots) {
+            ret = packFree(entry->firstBlock, entry->slot + keep, slots - keep);
+        }
+    } else if (entry->flags & FS_DIR_COMPRESSED) {
+        ret = chunksCut(file, length);
+    } else {
+        ret = releaseClusters(file, length);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+    entry->fileSize = length;
+
+    // no descriptor of the file is left past its end
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fdTable[i] != NULL && fdTable[i]->file == file &&
+            fdTable[i]->offset > length) {
+            fdTable[i]->offset = length;
+        }
+    }
+
+    // the released clusters are written back with the fewest FAT writes
+    if (storeEntry(file->dir, entry) == -1 || flushFat() == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int doStat(int fd) {
+    /* TODO: Phase 3 */
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // Check if the file descriptor is valid
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || !fdTable[fd]->inUse) {
+        return -1;
+    }
+
+    int fileSize = fdTable[fd]->file->entry.fileSize;
+
+    return fileSize;
+}
+
+static int doLseek(int fd, size_t offset) {
+    /* TODO: Phase 3 */
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // Check if the file descriptor is valid
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL || !fdTable[fd]->inUse) {
+        return -1;
+    }
+
+    // Check if offset is larger than the current file size
+    int fileSize = doStat(fd);
+    if (offset > (size_t)fileSize) {
+        return -1;
+    }
+
+    fdTable[fd]->offset = offset;
+    return 0;
+}
+
+
+// Write @count bytes at @offset of the file open as @fd, which must be valid,
+// without moving its offset
+static int writeAt(int fd, size_t offset, const void *buf, size_t count) {
+    if (buf == NULL || count == 0) {
+        return -1;
+    }
+
+    // read views pin the current data of the file
+    if (fdTable[fd]->file->views > 0) {
+        return -1;
+    }
+
+    // file sizes are stored on 32 bits
+    if (offset >= UINT32_MAX) {
+        return 0;
+    }
+    if (count > UINT32_MAX - offset) {
+        count = UINT32_MAX - offset;
+    }
+
+    struct openFile *file = fdTable[fd]->file;
+    size_t totalWritten;
+
+    if (fdTable[fd]->append && offset == file->entry.fileSize &&
+        appendable(file)) {
+        totalWritten = appendChain(file, buf, count);
+    } else {
+        totalWritten = writeFile(file, offset, buf, count);
+    }
+
+    // Write directory entry and FAT back to disk
+    if (storeEntry(file->dir, &file->entry) == -1 || flushFat() == -1) {
+        return -1;
+    }
+
+    return totalWritten;
+}
+
+// Read @count bytes at @offset of the file open as @fd, which must be valid,
+// without moving its offset
+static int readAt(int fd, size_t offset, void *buf, size_t count) {
+    if (buf == NULL) {
+        return -1;
+    }
+
+    // never read past the end of the file
+    size_t fileSize = fdTable[fd]->file->entry.fileSize;
+    if (offset >= fileSize) {
+        return 0;
+    }
+    if (count > fileSize - offset) {
+        count = fileSize - offset;
+    }
+
+    return readFile(fdTable[fd]->file, offset, buf, count);
+}
+
+static int doWrite(int fd, void *buf, size_t count) {
+    if (!validFd(fd)) {
+        return -1;
+    }
+
+    if (fdTable[fd]->append) {
+        fdTable[fd]->offset = fdTable[fd]->file->entry.fileSize;
+    }
+
+    int totalWritten = writeAt(fd, fdTable[fd]->offset, buf, count);
+    if (totalWritten > 0) {
+        fdTable[fd]->offset += totalWritten;
+    }
+
+    return totalWritten;
+}
+
+static int doRead(int fd, void *buf, size_t count) {
+    if (!validFd(fd)) {
+        return -1;
+    }
+
+    int bytesRead = readAt(fd, fdTable[fd]->offset, buf, count);
+
+    // increase the offset
+    if (bytesRead > 0) {
+        fdTable[fd]->offset += bytesRead;
+    }
+
+    return bytesRead;
+}
+
+static int doPwrite(int fd, const void *buf, size_t count, size_t offset) {
+    // no holes: writing starts at most at the end of the file
+    if (!validFd(fd) || offset > fdTable[fd]->file->entry.fileSize) {
+        return -1;
+    }
+
+    return writeAt(fd, offset, buf, count);
+}
+
+static int doPread(int fd, void *buf, size_t count, size_t offset) {
+    if (!validFd(fd) || offset > fdTable[fd]->file->entry.fileSize) {
+        return -1;
+    }
+
+    return readAt(fd, offset, buf, count);
+}
+
+// Number of bytes covered by the @iovcnt buffers of @iov, -1 if they are
+// invalid or cover more than what a call can return
+static ssize_t iovLength(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+
+    if (iov == NULL || iovcnt < 1 || iovcnt > FS_IOV_MAX) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_base == NULL && iov[i].iov_len != 0) {
+            return -1;
+        }
+        if (iov[i].iov_len > INT_MAX - length) {
+            return -1;
+        }
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+// The buffers of a vectored call are gathered into (or scattered from) a
+// single staging buffer, so that the file is accessed by one planned I/O
+// rather than one per buffer
+static int doWritev(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t length = iovLength(iov, iovcnt);
+    uint8_t *staging;
+    size_t copied = 0;
+    int ret;
+
+    if (!validFd(fd) || length == -1) {
+        return -1;
+    }
+    if (iovcnt == 1) {
+        return doWrite(fd, iov[0].iov_base, iov[0].iov_len);
+    }
+
+    staging = malloc(length ? length : 1);
+    if (staging == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len != 0) {
+            memcpy(staging + copied, iov[i].iov_base, iov[i].iov_len);
+            copied += iov[i].iov_len;
+        }
+    }
+
+    ret = doWrite(fd, staging, length);
+    free(staging);
+
+    return ret;
+}
+
+static int doReadv(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t length = iovLength(iov, iovcnt);
+    uint8_t *staging;
+    size_t copied = 0;
+    int ret;
+
+    if (!validFd(fd) || length == -1) {
+        return -1;
+    }
+    if (iovcnt == 1) {
+        return doRead(fd, iov[0].iov_base, iov[0].iov_len);
+    }
+
+    staging = malloc(length ? length : 1);
+    if (staging == NULL) {
+        return -1;
+    }
+
+    ret = doRead(fd, staging, length);
+    for (int i = 0; i < iovcnt && ret > 0 && copied < (size_t)ret; i++) {
+        size_t n = (size_t)ret - copied < iov[i].iov_len ? (size_t)ret - copied
+                                                         : iov[i].iov_len;
+
+        if (n != 0) {
+            memcpy(iov[i].iov_base, staging + copied, n);
+            copied += n;
+        }
+    }
+    free(staging);
+
+    return ret;
+}
+
+static int doReadView(int fd, size_t count, struct fs_view *view) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL ||
+        fdTable[fd]->inUse == 0 || view == NULL) {
+        return -1;
+    }
+
+    struct openFile *file = fdTable[fd]->file;
+    size_t fileSize = file->entry.fileSize;
+    size_t offset = fdTable[fd]->offset;
+
+    // the data of compressed files is not stored as is
+    if (file->entry.flags & FS_DIR_COMPRESSED) {
+        return -1;
+    }
+
+    memset(view, 0, sizeof(struct fs_view));
+    if (offset >= fileSize) {
+        count = 0;
+    } else if (count > fileSize - offset) {
+        count = fileSize - offset;
+    }
+    // the result must fit in an int
+    if (count > INT_MAX) {
+        count = INT_MAX;
+    }
+
+    struct viewFill fill = {view, 0};
+    if (count > 0 && forEachPiece(file, offset, count, viewAdd, &fill) == -1) {
+        free(view->iov);
+        memset(view, 0, sizeof(struct fs_view));
+        return -1;
+    }
+
+    // the view keeps the file open until it is released
+    file->refs++;
+    file->views++;
+    viewCount++;
+    view->priv = file;
+    fdTable[fd]->offset += view->length;
+
+    return view->length;
+}
+
+static int doReleaseView(struct fs_view *view) {
+    if (view == NULL || view->priv == NULL) {
+        return -1;
+    }
+
+    struct openFile *file = view->priv;
+    file->views--;
+    viewCount--;
+    putFile(file);
+
+    free(view->iov);
+    memset(view, 0, sizeof(struct fs_view));
+
+    return 0;
+}
+
+static int doExportToFd(int fd, int hostFd) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL ||
+        fdTable[fd]->inUse == 0 || hostFd < 0) {
+        return -1;
+    }
+
+    struct openFile *file = fdTable[fd]->file;
+    size_t offset = fdTable[fd]->offset;
+    struct hostCopy copy = {hostFd, 0};
+
+    if (offset >= file->entry.fileSize) {
+        return 0;
+    }
+    size_t count = file->entry.fileSize - offset;
+    if (count > INT_MAX) {
+        count = INT_MAX;
+    }
+
+    if (file->entry.flags & FS_DIR_COMPRESSED) {
+        // compressed data has to be expanded on the way out
+        uint8_t buf[BLOCK_SIZE * 16];
+
+        while (copy.done < count) {
+            size_t n = count - copy.done < sizeof(buf) ? count - copy.done
+                                                       : sizeof(buf);
+
+            if (readFile(file, offset + copy.done, buf, n) != n ||
+                write(hostFd, buf, n) != (ssize_t)n) {
+                break;
+            }
+            copy.done += n;
+        }
+    } else if (forEachPiece(file, offset, count, exportPiece, &copy) == -1 &&
+               copy.done == 0) {
+        return -1;
+    }
+    if (copy.done == 0) {
+        return -1;
+    }
+    fdTable[fd]->offset += copy.done;
+
+    return copy.done;
+}
+
+// Copy what is left of @hostFd to file @file through a buffer, for host
+// files of unknown size and for files small enough to be packed
+static size_t importBuffered(struct openFile *file, int hostFd, size_t max) {
+    uint8_t buf[BLOCK_SIZE * 16];
+    size_t done = 0;
+
+    while (done < max) {
+        size_t count = max - done < sizeof(buf) ? max - done : sizeof(buf);
+        ssize_t n = read(hostFd, buf, count);
+
+        if (n <= 0) {
+            break;
+        }
+        size_t written = writeFile(file, done, buf, n);
+        done += written;
+        if (written != (size_t)n) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+static int doImportFromFd(int hostFd, const char *filename) {
+    struct stat st;
+    off_t position;
+
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL ||
+        hostFd < 0 || fstat(hostFd, &st) == -1) {
+        return -1;
+    }
+
+    if (doCreate(filename) == -1) {
+        return -1;
+    }
+    int fd = doOpen(filename);
+    if (fd == -1) {
+        doDelete(filename);
+        return -1;
+    }
+    struct openFile *file = fdTable[fd]->file;
+
+    // file sizes are stored on 32 bits, and the result is an int
+    size_t max = INT_MAX;
+    size_t done;
+
+    // data to deduplicate has to be seen on its way to the image
+    position = lseek(hostFd, 0, SEEK_CUR);
+    if (!S_ISREG(st.st_mode) || position < 0 ||
+        st.st_size - position <= FS_PACK_MAX_SIZE || dedupEnabled()) {
+        done = importBuffered(file, hostFd, max);
+    } else {
+        // allocate the file, then have the kernel fill its pieces
+        size_t size = st.st_size - position < (off_t)max
+                          ? (size_t)(st.st_size - position)
+                          : max;
+        size_t reserved = reserveClusters(file, size);
+        struct hostCopy copy = {hostFd, 0};
+
+        forEachPiece(file, 0, reserved < size ? reserved : size, importPiece,
+                     &copy);
+        done = copy.done;
+        file->entry.fileSize = done;
+
+        // the host file may have been shorter than it was said to be
+        if (releaseClusters(file, done) == -1) {
+            doClose(fd);
+            return -1;
+        }
+    }
+
+    if (storeEntry(file->dir, &file->entry) == -1 || flushFat() == -1) {
+        doClose(fd);
+        return -1;
+    }
+    doClose(fd);
+
+    return done;
+}
+
+static int doClone(const char *srcname, const char *dstname) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    int srcFd = doOpen(srcname);
+    if (srcFd == -1) {
+        return -1;
+    }
+    if (doCreate(dstname) == -1) {
+        doClose(srcFd);
+        return -1;
+    }
+    int dstFd = doOpen(dstname);
+    if (dstFd == -1) {
+        doClose(srcFd);
+        doDelete(dstname);
+        return -1;
+    }
+
+    struct openFile *src = fdTable[srcFd]->file;
+    struct openFile *dst = fdTable[dstFd]->file;
+    int ret = 0;
+
+    if (src->entry.flags & FS_DIR_EXTENTS) {
+        ret = cloneExtents(src, dst);
+    } else {
+        // without extents, clusters cannot be shared: copy the data over
+        uint8_t buf[BLOCK_SIZE * 16];
+
+        dst->entry.flags |= src->entry.flags & FS_DIR_COMPRESSED;
+
+        for (size_t offset = 0; ret == 0 && offset < src->entry.fileSize;) {
+            size_t count = src->entry.fileSize - offset < sizeof(buf)
+                               ? src->entry.fileSize - offset
+                               : sizeof(buf);
+
+            if (readFile(src, offset, buf, count) != count ||
+                writeFile(dst, offset, buf, count) != count) {
+                ret = -1;
+            }
+            offset += count;
+        }
+    }
+
+    if (ret == 0 && storeEntry(dst->dir, &dst->entry) == -1) {
+        ret = -1;
+    }
+    doClose(srcFd);
+    doClose(dstFd);
+    if (ret == -1) {
+        doDelete(dstname);
+    }
+    flushFat();
+
+    return ret;
+}
+
+static int doCompress(int fd) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL ||
+        fdTable[fd]->inUse == 0 || !compressEnabled()) {
+        return -1;
+    }
+
+    // only files without data yet can change how it is stored
+    struct openFile *file = fdTable[fd]->file;
+    if (file->entry.flags & FS_DIR_COMPRESSED) {
+        return 0;
+    }
+    if (file->entry.fileSize != 0 || file->entry.firstBlock != FAT_EOC) {
+        return -1;
+    }
+
+    file->entry.flags = (file->entry.flags & ~FS_DIR_PACKED) | FS_DIR_COMPRESSED;
+
+    return storeEntry(file->dir, &file->entry);
+}
+
+// Disk space held by open file @file, in bytes
+static int physicalSize(struct openFile *file, size_t *size) {
+    struct rootDir *entry = &file->entry;
+    size_t clusters = 0;
+
+    if (entry->flags & FS_DIR_PACKED) {
+        *size = (size_t)packFileSlots(entry->fileSize) * FS_PACK_SLOT_SIZE;
+        return 0;
+    }
+
+    if (chainLength(entry->firstBlock, &clusters) == -1) {
+        return -1;
+    }
+    if (entry->flags & FS_DIR_COMPRESSED) {
+        struct chunkTable *table = chunksGet(file);
+
+        if (table == NULL) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < table->count; i++) {
+            if (chainLength(table->chunks[i].first, &clusters) == -1) {
+                return -1;
+            }
+        }
+    } else if (entry->flags & FS_DIR_EXTENTS) {
+        struct extentMap *map = mapGet(file);
+
+        if (map == NULL) {
+            return -1;
+        }
+        clusters += mapClusters(map);
+    }
+
+    *size = clusters * clusterSize();
+    return 0;
+}
+
+static int doFstat(int fd, struct fs_file_stat *st) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fdTable[fd] == NULL ||
+        fdTable[fd]->inUse == 0 || st == NULL) {
+        return -1;
+    }
+
+    struct openFile *file = fdTable[fd]->file;
+    size_t physical;
+
+    // account for the chunk still being compressed in memory
+    if (file->chunks != NULL && file->chunks->dirty) {
+        if (chunkFlush(file) == -1 ||
+            storeEntry(file->dir, &file->entry) == -1 || flushFat() == -1) {
+            return -1;
+        }
+    }
+
+    memset(st, 0, sizeof(struct fs_file_stat));
+    if (physicalSize(file, &physical) == -1) {
+        return -1;
+    }
+    st->size = file->entry.fileSize;
+    st->physical_size = physical;
+    st->compressed = (file->entry.flags & FS_DIR_COMPRESSED) != 0;
+
+    return 0;
+}
+
+/*
+ * Batched metadata updates
+ */
+
+// A name of a batch, with what it was resolved to
+struct batchItem {
+    // position in the batch
+    size_t index;
+    uint32_t dir;
+    char name[FS_FILENAME_LEN];
+    // whether the entry exists, and where
+    int found;
+    struct entryLoc loc;
+    struct rootDir entry;
+};
+
+static int batchKeyCompare(const void *a, const void *b) {
+    const struct batchItem *x = a, *y = b;
+
+    if (x->dir != y->dir) {
+        return x->dir < y->dir ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Items with the same name keep their order in the batch
+static int batchItemCompare(const void *a, const void *b) {
+    const struct batchItem *x = a, *y = b;
+    int ret = batchKeyCompare(a, b);
+
+    if (ret != 0) {
+        return ret;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Whether item @k of @items names the same entry as an earlier one
+static int batchDuplicate(const struct batchItem *items, size_t k) {
+    return k > 0 && batchKeyCompare(&items[k - 1], &items[k]) == 0;
+}
+
+// Resolve the @count names of a batch and look them up, the root directory
+// being read once for all of them. The items are returned sorted by
+// directory and name, without the invalid names; their number is stored in
+// @kept. Every result is set to -1 for now.
+static struct batchItem *batchLookup(const char **filenames, size_t count,
+                                     int *results, size_t *kept) {
+    struct batchItem *items = malloc((count ? count : 1) * sizeof(*items));
+    size_t n = 0;
+
+    if (items == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        results[i] = -1;
+        if (filenames[i] == NULL ||
+            resolvePath(filenames[i], &items[n].dir, items[n].name) == -1) {
+            continue;
+        }
+        items[n].index = i;
+        items[n].found = 0;
+        n++;
+    }
+    qsort(items, n, sizeof(*items), batchItemCompare);
+
+    // every entry of the root directory is looked for among the items
+    for (unsigned int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        struct batchItem key = {.dir = ROOT_DIR};
+        struct batchItem *match;
+
+        if (rootDirArray[i].fileName[0] == '\0') {
+            continue;
+        }
+        strcpy(key.name, rootDirArray[i].fileName);
+        match = bsearch(&key, items, n, sizeof(*items), batchKeyCompare);
+        if (match == NULL) {
+            continue;
+        }
+        while (match > items && batchKeyCompare(match - 1, &key) == 0) {
+            match--;
+        }
+        for (; match < items + n && batchKeyCompare(match, &key) == 0; match++) {
+            match->found = 1;
+            match->loc.block = superBlockPtr->rootIndex;
+            match->loc.index = i;
+            match->entry = rootDirArray[i];
+        }
+    }
+
+    // while subdirectories are hash tables, where each name takes a probe
+    for (size_t k = 0; k < n; k++) {
+        if (items[k].dir != ROOT_DIR) {
+            items[k].found = lookupEntry(items[k].dir, items[k].name,
+                                         &items[k].loc, &items[k].entry) == 0;
+        }
+    }
+
+    *kept = n;
+    return items;
+}
+
+// Write back what the batch modified, and count its successful items
+static int batchEnd(struct batchItem *items, const int *results, size_t count) {
+    int ret = 0;
+
+    batching = 0;
+    if (rootDirty && writeRootDir() == -1) {
+        ret = -1;
+    }
+    rootDirty = 0;
+    for (size_t i = 0; i < batchCount; i++) {
+        if (ioqWriteBlock(batchBlocks[i].block, batchBlocks[i].data) == -1) {
+            ret = -1;
+        }
+    }
+    free(batchBlocks);
+    batchBlocks = NULL;
+    batchCount = 0;
+    batchCapacity = 0;
+    if (flushFat() == -1) {
+        ret = -1;
+    }
+    free(items);
+
+    for (size_t i = 0; ret != -1 && i < count; i++) {
+        ret += results[i] != -1;
+    }
+
+    return ret;
+}
+
+static int doCreateMany(const char **filenames, size_t count, int *results) {
+    struct batchItem *items;
+    unsigned int slot = 0;
+    size_t n;
+
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL ||
+        filenames == NULL || results == NULL) {
+        return -1;
+    }
+    items = batchLookup(filenames, count, results, &n);
+    if (items == NULL) {
+        return -1;
+    }
+
+    batching = 1;
+    for (size_t k = 0; k < n; k++) {
+        struct batchItem *item = &items[k];
+        struct rootDir entry;
+
+        if (item->found || batchDuplicate(items, k)) {
+            continue;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        strcpy(entry.fileName, item->name);
+        entry.firstBlock = FAT_EOC;
+
+        if (item->dir != ROOT_DIR) {
+            results[item->index] = insertEntry(item->dir, &entry);
+            continue;
+        }
+        // the free entries of the root directory are taken in order
+        while (slot < FS_FILE_MAX_COUNT &&
+               rootDirArray[slot].fileName[0] != '\0') {
+            slot++;
+        }
+        if (slot < FS_FILE_MAX_COUNT) {
+            rootDirArray[slot] = entry;
+            rootDirty = 1;
+            results[item->index] = 0;
+        }
+    }
+
+    return batchEnd(items, results, count);
+}
+
+static int doDeleteMany(const char **filenames, size_t count, int *results) {
+    struct batchItem *items;
+    size_t n;
+
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL ||
+        filenames == NULL || results == NULL) {
+        return -1;
+    }
+    items = batchLookup(filenames, count, results, &n);
+    if (items == NULL) {
+        return -1;
+    }
+
+    batching = 1;
+    for (size_t k = 0; k < n; k++) {
+        struct batchItem *item = &items[k];
+
+        if (item->found && !batchDuplicate(items, k)) {
+            results[item->index] =
+                deleteFile(item->dir, &item->loc, &item->entry);
+        }
+    }
+
+    return batchEnd(items, results, count);
+}
+
+static int doStatMany(const char **filenames, size_t count, int *sizes) {
+    struct batchItem *items;
+    size_t n;
+
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL ||
+        filenames == NULL || sizes == NULL) {
+        return -1;
+    }
+    items = batchLookup(filenames, count, sizes, &n);
+    if (items == NULL) {
+        return -1;
+    }
+
+    // nothing is written: the lookups are all there is to the batch
+    for (size_t k = 0; k < n; k++) {
+        struct batchItem *item = &items[k];
+        struct openFile *file;
+
+        if (!item->found || (item->entry.flags & FS_DIR_DIRECTORY)) {
+            continue;
+        }
+        // the entry of an open file may not be written back yet
+        file = findOpenFile(item->dir, item->name);
+        sizes[item->index] =
+            file != NULL ? file->entry.fileSize : item->entry.fileSize;
+    }
+    free(items);
+
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        ret += sizes[i] != -1;
+    }
+
+    return ret;
+}
+
+static int doCheckpoint(const char *name) {
+    uint8_t block[BLOCK_SIZE];
+    uint64_t id;
+
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    // changes made so far belong to the previous checkpoint, including the
+    // cached chunks of compressed files, which the stored sizes cover
+    for (struct openFile *file = openFiles; file != NULL; file = file->next) {
+        if (tailFlush(file) == -1) {
+            return -1;
+        }
+        if (file->chunks != NULL && file->chunks->dirty &&
+            (chunkFlush(file) == -1 ||
+             storeEntry(file->dir, &file->entry) == -1)) {
+            return -1;
+        }
+    }
+    if (flushDirs() == -1 || flushFat() == -1) {
+        return -1;
+    }
+
+    // the identity is stamped before tracking starts, so that the superblock
+    // does not count as changed, while copies of the image made from now on
+    // carry it
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id) ||
+        ioqReadBlock(FS_SUPERBLOCK_INDEX, block) == -1) {
+        return -1;
+    }
+    if (superBlockPtr->version == FS_VERSION_1) {
+        ((struct superblockV1 *)block)->checkpointId = id;
+    } else {
+        ((struct superblockV2 *)block)->checkpointId = id;
+    }
+    if (ioqWriteBlock(FS_SUPERBLOCK_INDEX, block) == -1 || ioqSync() == -1) {
+        return -1;
+    }
+
+    return bdevCheckpoint(name, id);
+}
+
+static int isEntry(const struct rootDir *entry) {
+    (void)entry;
+    return 1;
+}
+
+static int doMkdir(const char *path) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL ||
+        !dirsEnabled()) {
+        return -1;
+    }
+
+    uint32_t dir;
+    char name[FS_FILENAME_LEN];
+    struct entryLoc loc;
+    struct rootDir entry;
+    if (resolvePath(path, &dir, name) == -1 ||
+        lookupEntry(dir, name, &loc, &entry) == 0) {
+        return -1;
+    }
+
+    // the hash table starts with a single (empty) cluster
+    int cluster = find_empty_FAT_entry();
+    if (cluster == -1) {
+        return -1;
+    }
+    uint8_t zeroes[BLOCK_SIZE];
+    memset(zeroes, 0, BLOCK_SIZE);
+    for (uint32_t k = 0; k < superBlockPtr->clusterBlocks; k++) {
+        if (ioqWriteBlock(clusterBlock(cluster, (size_t)k * BLOCK_SIZE),
+                           zeroes) == -1) {
+            return -1;
+        }
+    }
+    if (fatSet(cluster, FAT_EOC) == -1) {
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    strcpy(entry.fileName, name);
+    entry.fileSize = clusterSize();
+    entry.firstBlock = cluster;
+    entry.flags = FS_DIR_DIRECTORY;
+    entry.aux = 0;
+    if (insertEntry(dir, &entry) == -1) {
+        fatSet(cluster, 0);
+        flushFat();
+        return -1;
+    }
+
+    return flushFat();
+}
+
+static int doRmdir(const char *path) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL ||
+        !dirsEnabled()) {
+        return -1;
+    }
+
+    uint32_t dir;
+    char name[FS_FILENAME_LEN];
+    struct entryLoc loc;
+    struct rootDir entry;
+    if (resolvePath(path, &dir, name) == -1 ||
+        lookupEntry(dir, name, &loc, &entry) == -1 ||
+        !(entry.flags & FS_DIR_DIRECTORY)) {
+        return -1;
+    }
+
+    // only empty directories can be removed
+    struct dirInfo *d = loadDir(dir, &entry);
+    if (d == NULL || dirForEach(d, isEntry) != 0) {
+        return -1;
+    }
+
+    unloadDir(d);
+    dcacheDropDir(entry.firstBlock);
+    // the table is released once nothing refers to it
+    if (removeEntryAt(dir, &loc, name) == -1) {
+        return -1;
+    }
+    int ret = freeChain(entry.firstBlock);
+
+    return flushFat() == -1 ? -1 : ret;
+}
+
+static int doLsdir(const char *path) {
+    if (superBlockPtr == NULL || fatPages == NULL || rootDirArray == NULL) {
+        return -1;
+    }
+
+    uint32_t dir;
+    if (resolveDir(path, &dir) == -1) {
+        return -1;
+    }
+    if (dir == ROOT_DIR) {
+        return doLs();
+    }
+
+    printf("FS LS:\n");
+    if (dirForEach(findDir(dir), printEntry) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Public entry points: each call goes through the tracer (see trace.h)
+ */
+
+int fs_mount(const char *diskname) {
+    uint64_t start = traceBegin();
+    int ret = doMount(diskname);
+    traceEnd(FS_TRACE_MOUNT, -1, diskname, 0, ret, start);
+    return ret;
+}
+
+int fs_umount(void) {
+    uint64_t start = traceBegin();
+    int ret = doUmount();
+    traceEnd(FS_TRACE_UMOUNT, -1, NULL, 0, ret, start);
+    traceFlush();
+    return ret;
+}
+
+int fs_info(void) {
+    uint64_t start = traceBegin();
+    int ret = doInfo();
+    traceEnd(FS_TRACE_INFO, -1, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_create(const char *filename) {
+    uint64_t start = traceBegin();
+    int ret = doCreate(filename);
+    traceEnd(FS_TRACE_CREATE, -1, filename, 0, ret, start);
+    return ret;
+}
+
+int fs_delete(const char *filename) {
+    uint64_t start = traceBegin();
+    int ret = doDelete(filename);
+    traceEnd(FS_TRACE_DELETE, -1, filename, 0, ret, start);
+    return ret;
+}
+
+int fs_ls(void) {
+    uint64_t start = traceBegin();
+    int ret = doLs();
+    traceEnd(FS_TRACE_LS, -1, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_open(const char *filename) {
+    uint64_t start = traceBegin();
+    int ret = doOpen(filename);
+    traceEnd(FS_TRACE_OPEN, -1, filename, 0, ret, start);
+    return ret;
+}
+
+int fs_close(int fd) {
+    uint64_t start = traceBegin();
+    int ret = doClose(fd);
+    traceEnd(FS_TRACE_CLOSE, fd, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_stat(int fd) {
+    uint64_t start = traceBegin();
+    int ret = doStat(fd);
+    traceEnd(FS_TRACE_STAT, fd, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_lseek(int fd, size_t offset) {
+    uint64_t start = traceBegin();
+    int ret = doLseek(fd, offset);
+    traceEnd(FS_TRACE_LSEEK, fd, NULL, offset, ret, start);
+    return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+    uint64_t start = traceBegin();
+    int ret = doWrite(fd, buf, count);
+    traceEnd(FS_TRACE_WRITE, fd, NULL, count, ret, start);
+    return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count) {
+    uint64_t start = traceBegin();
+    int ret = doRead(fd, buf, count);
+    traceEnd(FS_TRACE_READ, fd, NULL, count, ret, start);
+    return ret;
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset) {
+    uint64_t start = traceBegin();
+    int ret = doPwrite(fd, buf, count, offset);
+    traceEndAt(FS_TRACE_PWRITE, fd, offset, count, ret, start);
+    return ret;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset) {
+    uint64_t start = traceBegin();
+    int ret = doPread(fd, buf, count, offset);
+    traceEndAt(FS_TRACE_PREAD, fd, offset, count, ret, start);
+    return ret;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt) {
+    uint64_t start = traceBegin();
+    int ret = doWritev(fd, iov, iovcnt);
+    ssize_t length = iovLength(iov, iovcnt);
+    traceEnd(FS_TRACE_WRITEV, fd, NULL, length == -1 ? 0 : length, ret, start);
+    return ret;
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt) {
+    uint64_t start = traceBegin();
+    int ret = doReadv(fd, iov, iovcnt);
+    ssize_t length = iovLength(iov, iovcnt);
+    traceEnd(FS_TRACE_READV, fd, NULL, length == -1 ? 0 : length, ret, start);
+    return ret;
+}
+
+int fs_open_append(const char *filename) {
+    uint64_t start = traceBegin();
+    int ret = doOpenAppend(filename);
+    traceEnd(FS_TRACE_OPEN_APPEND, -1, filename, 0, ret, start);
+    return ret;
+}
+
+int fs_fsync(int fd) {
+    uint64_t start = traceBegin();
+    int ret = doFsync(fd);
+    traceEnd(FS_TRACE_FSYNC, fd, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_truncate(int fd, size_t length) {
+    uint64_t start = traceBegin();
+    int ret = doTruncate(fd, length);
+    traceEnd(FS_TRACE_TRUNCATE, fd, NULL, length, ret, start);
+    return ret;
+}
+
+int fs_mkdir(const char *path) {
+    uint64_t start = traceBegin();
+    int ret = doMkdir(path);
+    traceEnd(FS_TRACE_MKDIR, -1, path, 0, ret, start);
+    return ret;
+}
+
+int fs_rmdir(const char *path) {
+    uint64_t start = traceBegin();
+    int ret = doRmdir(path);
+    traceEnd(FS_TRACE_RMDIR, -1, path, 0, ret, start);
+    return ret;
+}
+
+int fs_lsdir(const char *path) {
+    uint64_t start = traceBegin();
+    int ret = doLsdir(path);
+    traceEnd(FS_TRACE_LSDIR, -1, path, 0, ret, start);
+    return ret;
+}
+
+int fs_read_view(int fd, size_t count, struct fs_view *view) {
+    uint64_t start = traceBegin();
+    int ret = doReadView(fd, count, view);
+    traceEnd(FS_TRACE_READ_VIEW, fd, NULL, count, ret, start);
+    return ret;
+}
+
+int fs_release_view(struct fs_view *view) {
+    uint64_t start = traceBegin();
+    int ret = doReleaseView(view);
+    traceEnd(FS_TRACE_RELEASE_VIEW, -1, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_export_to_fd(int fd, int hostfd) {
+    uint64_t start = traceBegin();
+    int ret = doExportToFd(fd, hostfd);
+    traceEnd(FS_TRACE_EXPORT, fd, NULL, 0, ret, start);
+    return ret;
+}
+
+int fs_import_from_fd(int hostfd, const char *filename) {
+    uint64_t start = traceBegin();
+    int ret = doImportFromFd(hostfd, filename);
+    traceEnd(FS_TRACE_IMPORT, -1, filename, 0, ret, start);
+    return ret;
+}
+
+int fs_clone(const char *src, const char *dst) {
+    char names[FS_TRACE_NAME_LEN];
+    uint64_t start = traceBegin();
+    int ret = doClone(src, dst);
+    // both names fit in the record, separated by a tab
+    snprintf(names, sizeof(names), "%s\t%s", src ? src : "", dst ? dst : "");
+    traceEnd(FS_TRACE_CLONE, -1, names, 0, ret, start);
+    return ret;
+}
+
+// A batch is recorded as one record per name, with the position of the
+// name in the batch as argument, so that it can be replayed name by name
+static void traceBatch(enum fs_trace_op op, const char **filenames,
+                       size_t count, const int *results, int ret,
+                       uint64_t start) {
+    if (filenames == NULL || results == NULL || count == 0) {
+        traceEnd(op, -1, NULL, 0, ret, start);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        traceEnd(op, -1, filenames[i], i, ret == -1 ? -1 : results[i],
+                 i == 0 ? start : traceBegin());
+    }
+}
+
+int fs_create_many(const char **filenames, size_t count, int *results) {
+    uint64_t start = traceBegin();
+    int ret = doCreateMany(filenames, count, results);
+    traceBatch(FS_TRACE_CREATE_MANY, filenames, count, results, ret, start);
+    return ret;
+}
+
+int fs_delete_many(const char **filenames, size_t count, int *results) {
+    uint64_t start = traceBegin();
+    int ret = doDeleteMany(filenames, count, results);
+    traceBatch(FS_TRACE_DELETE_MANY, filenames, count, results, ret, start);
+    return ret;
+}
+
+int fs_stat_many(const char **filenames, size_t count, int *sizes) {
+    uint64_t start = traceBegin();
+    int ret = doStatMany(filenames, count, sizes);
+    traceBatch(FS_TRACE_STAT_MANY, filenames, count, sizes, ret, start);
+    return ret;
+}
+
+int fs_checkpoint(const char *name) {
+    uint64_t start = traceBegin();
+    int ret = doCheckpoint(name);
+    traceEnd(FS_TRACE_CHECKPOINT, -1, name, 0, ret, start);
+    return ret;
+}
+
+int fs_compress(int fd) {
+    uint64_t start = traceBegin();
+    int ret = doCompress(fd);
+    traceEnd(FS_TRACE_COMPRESS, fd, NULL, 0, ret, start);
+    return ret;
+}
 
-    return bytesRead; 
+int fs_fstat(int fd, struct fs_file_stat *st) {
+    uint64_t start = traceBegin();
+    int ret = doFstat(fd, st);
+    traceEnd(FS_TRACE_FSTAT, fd, NULL, 0, ret, start);
+    return ret;
 }
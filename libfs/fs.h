@@ -36,7 +36,8 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * closed, or if there are still open file descriptors, or if the data kept
+ * in memory cannot be written (the FS then stays mounted). 0 otherwise.
  */
 int fs_umount(void);
 
@@ -109,10 +110,12 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after writing the data of the file still kept
+ * in memory (see fs_fsync()).
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if the data could not be
+ * written, in which case @fd stays open. 0 otherwise.
  */
 int fs_close(int fd);
 
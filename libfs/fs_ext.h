@@ -0,0 +1,380 @@
+#ifndef _FS_EXT_H
+#define _FS_EXT_H
+
+/**
+ * Extensions to the API of fs.h, for the features of version 2 images.
+ * These calls are traced like the others (see fs_trace.h).
+ */
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * fs_open_append - Open a file for appending
+ * @filename: File name
+ *
+ * Like fs_open(), except that every write through the returned file
+ * descriptor goes to the end of the file, wherever its offset was, and moves
+ * the offset there. Appends to files stored as cluster chains do not walk the
+ * chain, however long it is, and the last block of the file, while partially
+ * filled, is only written to the disk once full: until then, the size of the
+ * file on the disk covers data that is not there yet. The block is written
+ * by fs_fsync(), when the file is read or written at another offset, and
+ * when the last file descriptor of the file is closed.
+ *
+ * Return: -1 on failure, as for fs_open(). Otherwise return the file
+ * descriptor.
+ */
+int fs_open_append(const char *filename);
+
+/**
+ * fs_fsync - Write the data kept in memory to the disk
+ * @fd: File descriptor
+ *
+ * Write the partial last block of a file being appended to, or the last
+ * chunk of a compressed file, along with the entry of the file, then write
+ * back every block still queued in memory, whichever file it belongs to.
+ * The blocks written by fs_write() and the other calls are queued, and only
+ * reach the image when the queue fills up, by fs_fsync() or at unmount.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the data could not be
+ * written. 0 otherwise. The blocks that could not be written stay queued,
+ * and keep fs_fsync() and fs_umount() failing until they are.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_truncate - Shorten a file
+ * @fd: File descriptor
+ * @length: New size of the file
+ *
+ * Cut the file of file descriptor @fd to its first @length bytes, releasing
+ * the space that held the others. Offsets of file descriptors of the file
+ * past @length are moved back to @length.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @length is larger
+ * than the size of the file, or if a read view of the file is held, or if
+ * the file could not be written. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/** Maximum number of buffers of a vectored call */
+#define FS_IOV_MAX 1024
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: Offset in the file at which to write
+ *
+ * Like fs_write(), except that the data is written at @offset, which must be
+ * at most the size of the file, and that the offset of @fd is left
+ * unchanged. Several users of the same file descriptor can thus write
+ * without coordinating around fs_lseek().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is past the end of the file. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file at which to read
+ *
+ * Like fs_read(), except that the data is read from @offset, and that the
+ * offset of @fd is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is past the end of the file. Otherwise return the number of bytes
+ * actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write, in order
+ * @iovcnt: Number of buffers in @iov, at most %FS_IOV_MAX
+ *
+ * Like fs_write(), with the data taken from the buffers of @iov one after
+ * the other. The file is written by a single I/O, however many buffers
+ * there are.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is invalid, or
+ * if the buffers hold no data. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of buffers in @iov, at most %FS_IOV_MAX
+ *
+ * Like fs_read(), with the data spread over the buffers of @iov, each of
+ * them filled before the next one. The file is read by a single I/O.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is invalid.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_mkdir - Create a directory
+ * @path: Path of the directory
+ *
+ * Create a new and empty directory at @path. On images with subdirectories,
+ * every function of fs.h taking a file name also accepts a path, made of
+ * names separated by '/' (a leading '/' is optional), each of them no longer
+ * than %FS_FILENAME_LEN characters (including the NULL character). The
+ * directory holding the last component must exist.
+ *
+ * Unlike the root directory, subdirectories are not limited to
+ * %FS_FILE_MAX_COUNT entries: they grow as needed, and looking an entry up
+ * takes a constant number of block reads whatever their size.
+ *
+ * Return: -1 if no FS is currently mounted, or if the mounted FS does not
+ * support subdirectories, or if @path is invalid, or if an entry named @path
+ * already exists, or if there is no space left to create the directory. 0
+ * otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @path: Path of the directory
+ *
+ * Remove the empty directory at @path.
+ *
+ * Return: -1 if no FS is currently mounted, or if the mounted FS does not
+ * support subdirectories, or if @path is invalid, or if there is no directory
+ * at @path, or if the directory is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * fs_lsdir - List files of a directory
+ * @path: Path of the directory, "/" for the root directory
+ *
+ * List information about the files and directories located in the directory
+ * at @path, in the same format as fs_ls(), but in no particular order.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory at
+ * @path. 0 otherwise.
+ */
+int fs_lsdir(const char *path);
+
+/**
+ * struct fs_view - Read-only view of file data
+ * @iov: Pieces of the file covered by the view, in file order
+ * @iovcnt: Number of pieces
+ * @length: Number of bytes covered by all pieces
+ * @priv: Reserved for libfs
+ */
+struct fs_view {
+	struct iovec *iov;
+	int iovcnt;
+	size_t length;
+	void *priv;
+};
+
+/**
+ * fs_read_view - Read from a file without copying
+ * @fd: File descriptor
+ * @count: Number of bytes to read
+ * @view: View to fill
+ *
+ * Like fs_read(), except that the data is not copied into a buffer: @view is
+ * filled with pointers to the data, as stored in the image, which can be
+ * parsed in place. The offset of @fd is moved forward by the length of the
+ * view.
+ *
+ * The data under a view stays valid until the view is released with
+ * fs_release_view(). Until then, the file cannot be written or deleted, and
+ * the FS cannot be unmounted; closing @fd is allowed.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @view is NULL.
+ * Otherwise return the number of bytes covered by the view, which can be
+ * smaller than @count if the end of the file is reached.
+ */
+int fs_read_view(int fd, size_t count, struct fs_view *view);
+
+/**
+ * fs_release_view - Release a view
+ * @view: View filled by fs_read_view()
+ *
+ * Return: -1 if @view is NULL or does not hold a view. 0 otherwise.
+ */
+int fs_release_view(struct fs_view *view);
+
+/**
+ * fs_export_to_fd - Copy a file to a host file descriptor
+ * @fd: File descriptor
+ * @hostfd: Host file descriptor, open for writing
+ *
+ * Copy the content of the file of file descriptor @fd, from its offset to
+ * its end, to the current position of host file descriptor @hostfd. The
+ * offset of @fd is moved forward by the number of bytes copied. The data is
+ * moved by the kernel (with copy_file_range() or sendfile()) rather than
+ * through a buffer whenever @hostfd allows it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if nothing could be
+ * copied to @hostfd. Otherwise return the number of bytes copied.
+ */
+int fs_export_to_fd(int fd, int hostfd);
+
+/**
+ * fs_import_from_fd - Create a file from a host file descriptor
+ * @hostfd: Host file descriptor, open for reading
+ * @filename: File name
+ *
+ * Create a new file named @filename, holding what is left to read from host
+ * file descriptor @hostfd. When @hostfd is a regular file, the file is
+ * allocated first and then filled by the kernel (with copy_file_range() or
+ * splice()); other descriptors are read until their end through a buffer.
+ * Fewer bytes are copied if the disk runs out of space.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or
+ * if a file named @filename already exists, or if the file cannot be
+ * created. Otherwise return the number of bytes copied.
+ */
+int fs_import_from_fd(int hostfd, const char *filename);
+
+/**
+ * fs_clone - Clone a file
+ * @src: File name of the source
+ * @dst: File name of the clone
+ *
+ * Create a new file named @dst with the same content as file @src. On
+ * images with extents, the clone shares the data of @src rather than
+ * copying it, which takes time and space proportional to the metadata of
+ * @src only: each cluster is copied on the first write to it, by either
+ * file. On other images, the data is copied.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @src, or if @dst is invalid, or if a file named @dst already exists, or if
+ * there is no space left for the clone. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_checkpoint - Start tracking changed blocks
+ * @name: Name of the checkpoint
+ *
+ * Record the blocks of the image written from now on, until the next
+ * checkpoint. The record is kept next to the image (see fs_format.h), and
+ * survives unmounting: tools such as fs_delta.x can then copy only the
+ * blocks changed since checkpoint @name to another image.
+ *
+ * Return: -1 if no FS is currently mounted, or if @name is longer than
+ * %FS_CBT_NAME_LEN characters (including the NULL character), or if the
+ * record cannot be created. 0 otherwise.
+ */
+int fs_checkpoint(const char *name);
+
+/**
+ * struct fs_file_stat - File status
+ * @size: Size of the file, in bytes
+ * @physical_size: Disk space held by the file and its metadata, in bytes
+ *                 (clusters shared with clones are counted by each file)
+ * @compressed: Whether the file is compressed
+ */
+struct fs_file_stat {
+	size_t size;
+	size_t physical_size;
+	int compressed;
+};
+
+/**
+ * fs_fstat - Get detailed file status
+ * @fd: File descriptor
+ * @st: Status to fill
+ *
+ * Like fs_stat(), but also report how much disk space the file takes.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @st is NULL. 0
+ * otherwise.
+ */
+int fs_fstat(int fd, struct fs_file_stat *st);
+
+/**
+ * fs_compress - Compress a file
+ * @fd: File descriptor
+ *
+ * Have the data written from now on to the file of file descriptor @fd
+ * compressed, transparently for the other calls. The file is compressed by
+ * chunks of %FS_COMPRESS_CHUNK bytes, so reading from any offset only takes
+ * decompressing one chunk; writes are compressed a chunk at a time, as
+ * chunks get full or the file is closed. Compressed files cannot be read
+ * through views.
+ *
+ * Return: -1 if no FS is currently mounted, or if the mounted FS does not
+ * support compression, or if file descriptor @fd is invalid (out of bounds
+ * or not currently open), or if the file is not empty. 0 otherwise.
+ */
+int fs_compress(int fd);
+
+/**
+ * fs_create_many - Create several files
+ * @filenames: Names of the files to create
+ * @count: Number of names in @filenames
+ * @results: Result of the creation of each file (0 or -1, as for fs_create())
+ *
+ * Create the @count files named in @filenames, like as many calls to
+ * fs_create(), except that the directories are searched once for all the
+ * names, and that each modified metadata block is written once. The files
+ * are created independently: one that cannot be created does not prevent
+ * the others from being created. When a name appears several times, only
+ * its first occurrence can succeed.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @results is
+ * NULL, or if the metadata could not be written back. Otherwise, the number
+ * of files created.
+ */
+int fs_create_many(const char **filenames, size_t count, int *results);
+
+/**
+ * fs_delete_many - Delete several files
+ * @filenames: Names of the files to delete
+ * @count: Number of names in @filenames
+ * @results: Result of the deletion of each file (0 or -1, as for fs_delete())
+ *
+ * Delete the @count files named in @filenames, like as many calls to
+ * fs_delete() but with the savings of fs_create_many().
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @results is
+ * NULL, or if the metadata could not be written back. Otherwise, the number
+ * of files deleted.
+ */
+int fs_delete_many(const char **filenames, size_t count, int *results);
+
+/**
+ * fs_stat_many - Get the sizes of several files
+ * @filenames: Names of the files
+ * @count: Number of names in @filenames
+ * @sizes: Size of each file, or -1 if there is no such file
+ *
+ * Like fs_stat(), but for files given by name rather than open, and
+ * looked up with a single search of the directories.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @sizes is
+ * NULL. Otherwise, the number of files found.
+ */
+int fs_stat_many(const char **filenames, size_t count, int *sizes);
+
+#endif /* _FS_EXT_H */
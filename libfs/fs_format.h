@@ -0,0 +1,332 @@
+#ifndef _FS_FORMAT_H
+#define _FS_FORMAT_H
+
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * On-disk layout of ECS150FS images, shared by libfs and the tools that
+ * create or inspect images.
+ *
+ * An image is made of, in this order: the superblock (block 0), the FAT
+ * blocks, the root directory block, and the data blocks. Two versions of
+ * the format exist, told apart by the signature of the superblock:
+ *
+ * - version 1 ("ECS150FS"): 16-bit block counts and FAT entries, which
+ *   limits images to 65535 blocks (256 MiB);
+ * - version 2 ("ECS150F2"): 32-bit block counts and FAT entries, for images
+ *   of up to 2^31 blocks (8 TiB). The data blocks are allocated by clusters
+ *   of 1 to 64 consecutive blocks, with one FAT entry per cluster.
+ *   Optional features are enabled per image by the superblock.
+ *
+ * All integers are little-endian.
+ */
+
+#define FS_SUPERBLOCK_INDEX 0
+
+#define FS_SIGNATURE_V1 "ECS150FS"
+#define FS_SIGNATURE_V2 "ECS150F2"
+#define FS_SIG_LENGTH 8
+
+#define FS_VERSION_1 1
+#define FS_VERSION_2 2
+
+// End-of-chain marker of FAT entries
+#define FS_FAT_EOC_V1 0xFFFF
+#define FS_FAT_EOC_V2 0xFFFFFFFF
+
+// Number of FAT entries held by one FAT block
+#define FS_FAT_ENTRIES_V1 (BLOCK_SIZE / sizeof(uint16_t))
+#define FS_FAT_ENTRIES_V2 (BLOCK_SIZE / sizeof(uint32_t))
+
+// Range of cluster sizes, in blocks (version 1 always uses 1)
+#define FS_MIN_CLUSTER_BLOCKS 1
+#define FS_MAX_CLUSTER_BLOCKS 64
+
+// Optional features of version 2 images
+// - small files share "pack" clusters, split into slots (see below)
+#define FS_FEATURE_PACK 0x1
+// - subdirectories, stored as hash tables of directory entries (see below)
+#define FS_FEATURE_DIRS 0x2
+// - file data is located by extent maps rather than FAT chains (see below)
+#define FS_FEATURE_EXTENTS 0x4
+// - files can be compressed, one by one (see below)
+#define FS_FEATURE_COMPRESS 0x8
+// - files share their identical data clusters (see below)
+#define FS_FEATURE_DEDUP 0x10
+#define FS_FEATURES_SUPPORTED                                              \
+    (FS_FEATURE_PACK | FS_FEATURE_DIRS | FS_FEATURE_EXTENTS |             \
+     FS_FEATURE_COMPRESS | FS_FEATURE_DEDUP)
+
+// Largest data block count supported by each version
+#define FS_MAX_DATA_BLOCKS_V1 8192
+#define FS_MAX_DATA_BLOCKS_V2 0x7FF00000
+
+// Version 1 superblock
+struct superblockV1 {
+    char signature[FS_SIG_LENGTH];
+    uint16_t totalBlocks;
+    uint16_t rootIndex;
+    uint16_t dataStart;
+    uint16_t dataBlocks;
+    uint8_t fatBlocks;
+    uint8_t unused[4071];
+    // identity of the last checkpoint (see changed-block tracking below)
+    uint64_t checkpointId;
+} __attribute__((packed));
+
+// Version 2 superblock
+struct superblockV2 {
+    char signature[FS_SIG_LENGTH];
+    // revision of the version 2 layout, FS_VERSION_2 for now
+    uint32_t version;
+    uint32_t totalBlocks;
+    uint32_t rootIndex;
+    uint32_t dataStart;
+    uint32_t dataBlocks;
+    uint32_t fatBlocks;
+    // blocks per cluster, dataBlocks is a multiple of it (0 stands for 1)
+    uint32_t clusterBlocks;
+    // FS_FEATURE_* flags, images using unknown ones must not be mounted
+    uint32_t features;
+    uint8_t unused[4044];
+    // identity of the last checkpoint (see changed-block tracking below)
+    uint64_t checkpointId;
+} __attribute__((packed));
+
+// Version 1 root directory entry
+struct dirEntryV1 {
+    char fileName[FS_FILENAME_LEN];
+    uint32_t fileSize;
+    uint16_t firstBlock;
+    uint8_t unused[10];
+} __attribute__((packed));
+
+// Version 2 root directory entry
+struct dirEntryV2 {
+    char fileName[FS_FILENAME_LEN];
+    uint32_t fileSize;
+    uint32_t firstBlock;
+    // FS_DIR_* flags
+    uint8_t flags;
+    uint8_t reserved;
+    // first slot of a packed file within its pack cluster
+    uint16_t slot;
+    // number of entries of a directory
+    uint32_t aux;
+} __attribute__((packed));
+
+#define FS_DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct dirEntryV2))
+
+/*
+ * Subdirectories (FS_FEATURE_DIRS)
+ *
+ * The root directory keeps its single block, but may now hold entries with
+ * FS_DIR_DIRECTORY set. The content of such a directory is a hash table of
+ * version 2 directory entries, FS_DIR_ENTRIES_PER_BLOCK per block, stored
+ * in the chain given by firstBlock; fileSize is the size of the table and
+ * aux the number of entries in it.
+ *
+ * An entry is looked up in block fsNameHash(name) % (number of blocks) of
+ * the table, then in the following ones (wrapping around) until it is
+ * found or a block with a never used entry is reached. Removed entries are
+ * therefore left with FS_DIR_DELETED set rather than zeroed. The table is
+ * doubled, and its entries rehashed, when it becomes three quarters full.
+ */
+#define FS_DIR_DIRECTORY 0x2
+#define FS_DIR_DELETED 0x4
+
+/*
+ * Packed files (FS_FEATURE_PACK)
+ *
+ * Files of at most FS_PACK_MAX_SIZE bytes are not given a cluster of their
+ * own, but a run of consecutive FS_PACK_SLOT_SIZE-byte slots in a pack
+ * cluster shared with other small files. A run never crosses a block
+ * boundary, so that a packed file is read with a single block read.
+ *
+ * A pack cluster is a regular single-cluster chain (its FAT entry is EOC),
+ * whose first slots hold a struct packHeader followed by a bitmap of the
+ * slots in use, header slots included. The directory entry of a packed file
+ * has FS_DIR_PACKED set, firstBlock set to the pack cluster and slot set to
+ * the first slot of the run. A file is moved to a chain of its own as soon
+ * as it grows beyond FS_PACK_MAX_SIZE.
+ */
+#define FS_DIR_PACKED 0x1
+
+#define FS_PACK_SLOT_SIZE 64
+#define FS_PACK_MAX_SIZE 1024
+#define FS_PACK_MAGIC "FSPACK"
+#define FS_PACK_MAGIC_LENGTH 6
+
+struct packHeader {
+    char magic[FS_PACK_MAGIC_LENGTH];
+    // number of slots taken by the header and the bitmap
+    uint16_t headerSlots;
+    uint8_t bitmap[];
+} __attribute__((packed));
+
+// Number of FAT blocks needed to describe @clusters clusters
+static inline uint32_t fsFatBlocks(int version, uint32_t clusters) {
+    uint32_t perBlock = version == FS_VERSION_1 ? FS_FAT_ENTRIES_V1
+                                                : FS_FAT_ENTRIES_V2;
+
+    return (clusters + perBlock - 1) / perBlock;
+}
+
+// Hash of directory entry names (32-bit FNV-1a)
+static inline uint32_t fsNameHash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Extent-mapped files (FS_FEATURE_EXTENTS)
+ *
+ * The data of a file is described by a list of extents, runs of consecutive
+ * clusters given in file order. The list is stored in an extent map: a
+ * struct extentHeader followed by the struct fsExtent entries, spread over
+ * the chain of clusters given by firstBlock. Such files have FS_DIR_EXTENTS
+ * set in their directory entry.
+ *
+ * FAT chains are still used by directories, pack clusters and the extent
+ * maps themselves. The FAT entry of a cluster holding file data is instead
+ * FS_FAT_REF(n), n being the number of extents referring to it.
+ */
+#define FS_DIR_EXTENTS 0x8
+
+#define FS_FAT_REF_BASE 0xF0000000
+#define FS_FAT_REF(n) (FS_FAT_REF_BASE | (n))
+#define FS_FAT_IS_REF(entry) \
+    ((entry) >= FS_FAT_REF_BASE && (entry) != FS_FAT_EOC_V2)
+#define FS_FAT_REFS(entry) ((entry) & ~FS_FAT_REF_BASE)
+
+#define FS_EXTENT_MAGIC "FSEXTM"
+#define FS_EXTENT_MAGIC_LENGTH 6
+
+struct extentHeader {
+    char magic[FS_EXTENT_MAGIC_LENGTH];
+    uint16_t reserved;
+    // number of extents
+    uint32_t count;
+    uint32_t unused;
+} __attribute__((packed));
+
+struct fsExtent {
+    // first cluster, and number of clusters
+    uint32_t start;
+    uint32_t length;
+} __attribute__((packed));
+
+/*
+ * Compressed files (FS_FEATURE_COMPRESS)
+ *
+ * The content of a file with FS_DIR_COMPRESSED set is cut into chunks of
+ * FS_COMPRESS_CHUNK bytes (the last one may be shorter), compressed
+ * separately so that any part of the file can be read by decompressing a
+ * single chunk. Each chunk is stored in a chain of its own, either as an
+ * LZ4 block or as is (FS_CHUNK_RAW) when compressing it would not save a
+ * cluster.
+ *
+ * The chunks are listed in a chunk table, held by the chain given by
+ * firstBlock: a struct compressHeader followed by one struct fsChunk per
+ * chunk, in file order.
+ */
+#define FS_DIR_COMPRESSED 0x10
+
+#define FS_COMPRESS_CHUNK 65536
+#define FS_COMPRESS_MAGIC "FSCMPR"
+#define FS_COMPRESS_MAGIC_LENGTH 6
+
+struct compressHeader {
+    char magic[FS_COMPRESS_MAGIC_LENGTH];
+    uint16_t reserved;
+    // number of chunks
+    uint32_t count;
+    // FS_COMPRESS_CHUNK when the file was written
+    uint32_t chunkSize;
+} __attribute__((packed));
+
+#define FS_CHUNK_RAW 0x1
+
+struct fsChunk {
+    // first cluster of the chain holding the chunk, EOC if none
+    uint32_t first;
+    // number of bytes stored
+    uint32_t length;
+    // FS_CHUNK_* flags
+    uint32_t flags;
+    uint32_t reserved;
+} __attribute__((packed));
+
+/*
+ * Deduplication (FS_FEATURE_DEDUP, along with FS_FEATURE_EXTENTS)
+ *
+ * When a whole cluster of an extent-mapped file is written, a data cluster
+ * already holding the same bytes is looked up by their 128-bit hash. If one
+ * is found, the file refers to it (and its reference count is incremented)
+ * rather than to a cluster of its own, and nothing is written.
+ *
+ * The hashes are kept in memory while the image is mounted, and saved when
+ * it is unmounted in the file "disk.fs.ddt" next to image "disk.fs": a
+ * struct dedupHeader followed by count struct dedupRecord. The clusters may
+ * have been modified since they were recorded, so that a record is only a
+ * hint, to be checked against the content of its cluster; without the file,
+ * clusters simply stop being shared with the ones written before.
+ */
+#define FS_DDT_SUFFIX ".ddt"
+#define FS_DDT_MAGIC "ECS150DD"
+
+struct dedupHeader {
+    char magic[FS_SIG_LENGTH];
+    // number of data clusters of the image
+    uint32_t clusters;
+    // number of records
+    uint32_t count;
+} __attribute__((packed));
+
+struct dedupRecord {
+    uint64_t hash[2];
+    uint32_t cluster;
+    uint32_t reserved;
+} __attribute__((packed));
+
+/*
+ * Changed-block tracking
+ *
+ * While an image "disk.fs" is tracked, the file "disk.fs.cbt" next to it
+ * records which of its blocks were written since the last checkpoint: a
+ * struct cbtHeader followed by a bitmap of totalBlocks bits, bit n of byte
+ * n / 8 standing for block n. The bitmap is only written back when the image
+ * is unmounted; FS_CBT_OPEN stays set in the meantime, and a bitmap found
+ * with it set (the image was not unmounted cleanly) must be considered to
+ * have every bit set.
+ *
+ * A checkpoint is given a random identity, stored both in the header and in
+ * the superblock (checkpointId) when it is taken, so that a copy of the image
+ * made at that point can be told apart from one made at any other.
+ */
+#define FS_CBT_SUFFIX ".cbt"
+#define FS_CBT_MAGIC "ECS150CB"
+#define FS_CBT_NAME_LEN 32
+
+#define FS_CBT_OPEN 0x1
+
+struct cbtHeader {
+    char magic[FS_SIG_LENGTH];
+    uint32_t totalBlocks;
+    // FS_CBT_* flags
+    uint32_t flags;
+    // name of the checkpoint, NULL-terminated
+    char checkpoint[FS_CBT_NAME_LEN];
+    // identity of the checkpoint, as stored in the superblock
+    uint64_t id;
+} __attribute__((packed));
+
+#endif /* _FS_FORMAT_H */
@@ -0,0 +1,74 @@
+#ifndef _FS_SERVER_H
+#define _FS_SERVER_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/**
+ * fs_server.x keeps an image mounted and serves the calls of fs.h to local
+ * client processes, over the Unix domain socket "disk.fs.sock" next to image
+ * "disk.fs". Programs linked with libfsclient.a instead of libfs.a send
+ * their calls to it: fs_mount() connects to the server of the image, and
+ * fs_umount() disconnects.
+ *
+ * Every call is a &struct fs_server_request, answered by a &struct
+ * fs_server_reply. Data of at most FS_SERVER_INLINE_MAX bytes follows the
+ * request (write) or the reply (read); more goes through a shared memory
+ * region of FS_SERVER_SHM_SIZE bytes, in as many calls as needed. The region
+ * is a memfd sealed against shrinking, passed by the client along with its
+ * first request, FS_SERVER_HELLO. The text printed by fs_info() and fs_ls()
+ * follows the reply.
+ *
+ * File descriptors belong to the client that opened them, and are closed
+ * when it disconnects. All fields are stored in the byte order of the host.
+ */
+
+/** Suffix of the socket of an image */
+#define FS_SERVER_SUFFIX ".sock"
+
+/** Size of the shared memory region of a client */
+#define FS_SERVER_SHM_SIZE (1024 * 1024)
+
+/** Largest payload sent along with a request or a reply */
+#define FS_SERVER_INLINE_MAX 4096
+
+/** Calls served */
+enum fs_server_op {
+	FS_SERVER_HELLO = 1,
+	FS_SERVER_INFO,
+	FS_SERVER_CREATE,
+	FS_SERVER_DELETE,
+	FS_SERVER_LS,
+	FS_SERVER_OPEN,
+	FS_SERVER_CLOSE,
+	FS_SERVER_STAT,
+	FS_SERVER_LSEEK,
+	FS_SERVER_WRITE,
+	FS_SERVER_READ,
+};
+
+/** The payload of a read or a write is in the shared memory region */
+#define FS_SERVER_SHM 0x1
+
+struct fs_server_request {
+	uint16_t op;
+	/* FS_SERVER_* flags */
+	uint16_t flags;
+	/* File descriptor argument, -1 if the call takes none */
+	int32_t fd;
+	/* Offset (lseek) or byte count (read, write), 0 otherwise */
+	uint64_t arg;
+	/* File name (create, delete, open) */
+	char name[FS_FILENAME_LEN];
+} __attribute__((packed));
+
+struct fs_server_reply {
+	/* Value returned by the call */
+	int64_t result;
+	/* Number of bytes following the reply */
+	uint32_t length;
+	uint32_t unused;
+} __attribute__((packed));
+
+#endif /* _FS_SERVER_H */
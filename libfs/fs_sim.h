@@ -0,0 +1,79 @@
+#ifndef _FS_SIM_H
+#define _FS_SIM_H
+
+#include <stdint.h>
+
+/**
+ * A simulated device can be put under the image, so as to see how libfs
+ * behaves on a real disk rather than on a file in the page cache. Every
+ * request libfs makes to the image is then charged the time the device
+ * would take to serve it, and may be made to fail.
+ *
+ * The device is described by a comma-separated list of settings, starting
+ * with its model:
+ *
+ * - "hdd": a request costs a seek, growing with the square root of the
+ *   distance the head moves, half a rotation, and the transfer itself. A
+ *   request starting where the previous one ended costs its transfer only.
+ * - "ssd": a request costs a constant latency and the transfer.
+ *
+ * followed by any of (times in us unless suffixed with ns, us, ms or s;
+ * bandwidth in bytes/s, possibly suffixed with K, M or G):
+ *
+ *   latency=<time>	fixed cost of any request (hdd: 0, ssd: 50us)
+ *   seek=<time>	seek across the whole image (hdd: 15ms)
+ *   track=<time>	shortest seek, to a nearby block (hdd: 1ms)
+ *   rpm=<n>		rotation speed (hdd: 7200)
+ *   bw=<bandwidth>	transfer rate (hdd: 150M, ssd: 500M)
+ *   errors=<p>		probability that a request fails (0)
+ *   seed=<n>		seed of the failures, for repeatable runs (1)
+ *   sleep=<0|1>	wait for requests to complete (1), or only account
+ *			for their time, to get deterministic figures quickly
+ *
+ * for instance "hdd,rpm=5400,errors=0.001". Requests are served one at a
+ * time, in the order they are made.
+ */
+
+/** Activity of the simulated device */
+struct fs_sim_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_blocks;
+	uint64_t write_blocks;
+	/* Requests that did not start where the previous one ended */
+	uint64_t seeks;
+	/* Requests made to fail */
+	uint64_t errors;
+	/* Time spent serving requests, in ns */
+	uint64_t busy_ns;
+};
+
+/**
+ * fs_sim_start - Simulate a device under the image
+ * @spec: Description of the device
+ *
+ * Serve the requests made to the image from now on as device @spec would,
+ * starting with zeroed statistics. A device can also be set up without
+ * modifying a program, by setting the environment variable FS_SIM to its
+ * description before the first libfs call.
+ *
+ * Return: -1 if @spec is invalid. 0 otherwise.
+ */
+int fs_sim_start(const char *spec);
+
+/**
+ * fs_sim_stop - Stop simulating a device
+ *
+ * Return: -1 if no device is simulated. 0 otherwise.
+ */
+int fs_sim_stop(void);
+
+/**
+ * fs_sim_stats - Get the activity of the simulated device
+ * @stats: Statistics to fill in
+ *
+ * Return: -1 if no device is simulated. 0 otherwise.
+ */
+int fs_sim_stats(struct fs_sim_stats *stats);
+
+#endif /* _FS_SIM_H */
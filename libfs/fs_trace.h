@@ -0,0 +1,122 @@
+#ifndef _FS_TRACE_H
+#define _FS_TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Trace files record every call made into libfs. A trace file starts with
+ * a &struct fs_trace_header, followed by one &struct fs_trace_record per
+ * call, in the order in which the calls returned. All fields are stored in
+ * the byte order of the host that recorded the trace.
+ */
+
+/** Magic string at the start of every trace file */
+#define FS_TRACE_MAGIC "FSTRACE1"
+
+/**
+ * Version of the trace format described below. Version 2 added the offset
+ * field of records.
+ */
+#define FS_TRACE_VERSION 2
+
+/** Size of the name field of a record (including the NULL character) */
+#define FS_TRACE_NAME_LEN 64
+
+/** Recorded operations */
+enum fs_trace_op {
+	FS_TRACE_MOUNT = 1,
+	FS_TRACE_UMOUNT,
+	FS_TRACE_INFO,
+	FS_TRACE_CREATE,
+	FS_TRACE_DELETE,
+	FS_TRACE_LS,
+	FS_TRACE_OPEN,
+	FS_TRACE_CLOSE,
+	FS_TRACE_STAT,
+	FS_TRACE_LSEEK,
+	FS_TRACE_WRITE,
+	FS_TRACE_READ,
+	FS_TRACE_MKDIR,
+	FS_TRACE_RMDIR,
+	FS_TRACE_LSDIR,
+	FS_TRACE_READ_VIEW,
+	FS_TRACE_RELEASE_VIEW,
+	FS_TRACE_EXPORT,
+	FS_TRACE_IMPORT,
+	FS_TRACE_CLONE,
+	FS_TRACE_CHECKPOINT,
+	FS_TRACE_COMPRESS,
+	FS_TRACE_FSTAT,
+	FS_TRACE_CREATE_MANY,
+	FS_TRACE_DELETE_MANY,
+	FS_TRACE_STAT_MANY,
+	FS_TRACE_PWRITE,
+	FS_TRACE_PREAD,
+	FS_TRACE_WRITEV,
+	FS_TRACE_READV,
+	FS_TRACE_OPEN_APPEND,
+	FS_TRACE_FSYNC,
+	FS_TRACE_TRUNCATE,
+};
+
+struct fs_trace_header {
+	char magic[8];
+	uint32_t version;
+	/* Size of each record, for readers of older versions */
+	uint32_t record_size;
+	/* Wall-clock time at which the recording started, in ns */
+	uint64_t start_time;
+} __attribute__((packed));
+
+struct fs_trace_record {
+	/* Time at which the call was made, in ns since the recording started */
+	uint64_t timestamp;
+	/* Time spent in the call, in ns */
+	uint64_t duration;
+	/*
+	 * Offset (lseek), length (truncate), byte count (read, write, and their
+	 * positioned and vectored variants), or position of the name in the
+	 * batch (batched calls, recorded as one record per name), 0 otherwise
+	 */
+	uint64_t arg;
+	/* Value returned by the call */
+	int64_t result;
+	/* File descriptor argument, -1 if the call takes none */
+	int32_t fd;
+	uint16_t op;
+	uint16_t unused;
+	/*
+	 * File name (or disk name for mount, or source and destination names
+	 * separated by a tab for clone), truncated if too long
+	 */
+	char name[FS_TRACE_NAME_LEN];
+	/* File offset of positioned calls (pread, pwrite), 0 otherwise */
+	uint64_t offset;
+} __attribute__((packed));
+
+/**
+ * fs_trace_start - Start recording a trace
+ * @filename: Name of the trace file to create
+ *
+ * Create trace file @filename and record every subsequent libfs call into
+ * it, until fs_trace_stop() is called or the program exits. Recording can
+ * also be enabled without modifying a program, by setting the environment
+ * variable FS_TRACE to the name of the trace file before the first libfs
+ * call.
+ *
+ * Return: -1 if a trace is already being recorded, or if @filename cannot
+ * be created. 0 otherwise.
+ */
+int fs_trace_start(const char *filename);
+
+/**
+ * fs_trace_stop - Stop recording a trace
+ *
+ * Flush and close the trace file being recorded.
+ *
+ * Return: -1 if no trace is being recorded, or if the trace file could not
+ * be written completely. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+#endif /* _FS_TRACE_H */
@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bdev.h"
+#include "disk.h"
+#include "ioq.h"
+
+// Number of blocks the queue holds (1 MiB)
+#define IOQ_BLOCKS 256
+// Number of blocks written back at once when the queue is full
+#define IOQ_BATCH 64
+// Number of later block writes after which a queued block is overdue
+#define IOQ_EXPIRE 1024
+// Writes of at least that many blocks are issued at once, there is nothing
+// to gain from queueing them
+#define IOQ_BYPASS 32
+// Largest range write
+#define IOQ_RUN 32
+
+struct ioqEntry {
+    uint32_t block;
+    // slot of ioqData holding the content of the block
+    uint32_t slot;
+    // value of ioqClock when the block was queued
+    uint64_t stamp;
+};
+
+// queued blocks, sorted by block number
+static struct ioqEntry *ioqEntries;
+static uint32_t ioqCount;
+static uint8_t *ioqData;
+// stack of the unused slots of ioqData
+static uint32_t *ioqSlots;
+static uint32_t ioqSlotCount;
+// number of block writes made so far
+static uint64_t ioqClock;
+// block following the last request, where the disk head was left
+static uint32_t ioqHead;
+// buffer of range writes
+static uint8_t *ioqRun;
+
+// Allocate the queue on first use
+static int ioqInit(void) {
+    if (ioqEntries != NULL) {
+        return 0;
+    }
+
+    ioqEntries = malloc(IOQ_BLOCKS * sizeof(struct ioqEntry));
+    ioqData = malloc((size_t)IOQ_BLOCKS * BLOCK_SIZE);
+    ioqSlots = malloc(IOQ_BLOCKS * sizeof(uint32_t));
+    ioqRun = malloc((size_t)IOQ_RUN * BLOCK_SIZE);
+    if (ioqEntries == NULL || ioqData == NULL || ioqSlots == NULL ||
+        ioqRun == NULL) {
+        ioqClose();
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < IOQ_BLOCKS; i++) {
+        ioqSlots[i] = IOQ_BLOCKS - 1 - i;
+    }
+    ioqSlotCount = IOQ_BLOCKS;
+
+    return 0;
+}
+
+void ioqClose(void) {
+    free(ioqEntries);
+    free(ioqData);
+    free(ioqSlots);
+    free(ioqRun);
+    ioqEntries = NULL;
+    ioqData = NULL;
+    ioqSlots = NULL;
+    ioqRun = NULL;
+    ioqCount = 0;
+    ioqSlotCount = 0;
+    ioqClock = 0;
+    ioqHead = 0;
+}
+
+// Index of the first queued block from block @block on
+static uint32_t ioqFind(uint32_t block) {
+    uint32_t low = 0, high = ioqCount;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (ioqEntries[middle].block < block) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// Number of queued blocks from index @i on, and below block @end
+static uint32_t ioqSpan(uint32_t i, uint64_t end) {
+    uint32_t n = 0;
+
+    while (i + n < ioqCount && ioqEntries[i + n].block < end) {
+        n++;
+    }
+    return n;
+}
+
+static uint8_t *ioqContent(const struct ioqEntry *entry) {
+    return ioqData + (size_t)entry->slot * BLOCK_SIZE;
+}
+
+// Remove the @count entries from index @first on
+static void ioqDrop(uint32_t first, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    for (uint32_t i = first; i < first + count; i++) {
+        ioqSlots[ioqSlotCount++] = ioqEntries[i].slot;
+    }
+    memmove(&ioqEntries[first], &ioqEntries[first + count],
+            (ioqCount - first - count) * sizeof(struct ioqEntry));
+    ioqCount -= count;
+}
+
+// Write back the @count entries from index @first on, merging adjacent
+// blocks, and remove those written: the others stay queued, so that a later
+// write back retries them
+static int ioqIssue(uint32_t first, uint32_t count) {
+    int ret = 0;
+    uint32_t i = first, end = first + count;
+
+    while (i < end) {
+        uint32_t start = ioqEntries[i].block;
+        uint32_t length = 0;
+
+        while (i + length < end && length < IOQ_RUN &&
+               ioqEntries[i + length].block == start + length) {
+            memcpy(ioqRun + (size_t)length * BLOCK_SIZE,
+                   ioqContent(&ioqEntries[i + length]), BLOCK_SIZE);
+            length++;
+        }
+        ioqHead = start + length;
+        if (bdevWrite(start, length, ioqRun) == -1) {
+            ret = -1;
+            i += length;
+            continue;
+        }
+        ioqDrop(i, length);
+        end -= length;
+    }
+
+    return ret;
+}
+
+// Write back and remove up to @limit queued blocks, in one upward sweep
+// starting at the disk head (or at the oldest block if it is overdue)
+static int ioqDispatch(uint32_t limit) {
+    uint32_t first, oldest = 0;
+    uint32_t upper, lower;
+    int ret = 0;
+
+    if (ioqCount == 0) {
+        return 0;
+    }
+    if (limit > ioqCount) {
+        limit = ioqCount;
+    }
+
+    for (uint32_t i = 1; i < ioqCount; i++) {
+        if (ioqEntries[i].stamp < ioqEntries[oldest].stamp) {
+            oldest = i;
+        }
+    }
+    if (ioqClock - ioqEntries[oldest].stamp > IOQ_EXPIRE) {
+        first = oldest;
+    } else {
+        first = ioqFind(ioqHead);
+        if (first == ioqCount) {
+            first = 0;
+        }
+    }
+
+    // the sweep wraps around to the lowest blocks, which come before @first
+    // and so keep their indexes while the upper ones are removed
+    upper = ioqCount - first < limit ? ioqCount - first : limit;
+    lower = limit - upper;
+    if (ioqIssue(first, upper) == -1) {
+        ret = -1;
+    }
+    if (ioqIssue(0, lower) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+// Write back the queued blocks among the @count ones from block @block on
+static int ioqFlush(uint64_t block, uint64_t count) {
+    uint32_t first = ioqFind(block < UINT32_MAX ? block : UINT32_MAX);
+
+    return ioqIssue(first, ioqSpan(first, block + count));
+}
+
+int ioqRead(uint32_t block, uint32_t count, void *buf) {
+    uint32_t first = ioqFind(block);
+    uint32_t n = ioqSpan(first, (uint64_t)block + count);
+
+    if (n < count) {
+        if (bdevRead(block, count, buf) == -1) {
+            return -1;
+        }
+        ioqHead = block + count;
+    }
+    for (uint32_t i = first; i < first + n; i++) {
+        memcpy((uint8_t *)buf + (size_t)(ioqEntries[i].block - block) *
+                                    BLOCK_SIZE,
+               ioqContent(&ioqEntries[i]), BLOCK_SIZE);
+    }
+
+    return 0;
+}
+
+int ioqReadBlock(uint32_t block, void *buf) {
+    uint32_t i = ioqFind(block);
+
+    if (i < ioqCount && ioqEntries[i].block == block) {
+        memcpy(buf, ioqContent(&ioqEntries[i]), BLOCK_SIZE);
+        return 0;
+    }
+    if (bdevReadBlock(block, buf) == -1) {
+        return -1;
+    }
+    ioqHead = block + 1;
+
+    return 0;
+}
+
+int ioqWrite(uint32_t block, uint32_t count, const void *buf) {
+    int ret = 0;
+
+    if (block_disk_count() < 0 ||
+        (uint64_t)block + count > (uint64_t)block_disk_count()) {
+        return -1;
+    }
+
+    // the queued blocks it covers are superseded once it is written
+    if (count >= IOQ_BYPASS || ioqInit() == -1) {
+        uint32_t first = ioqFind(block);
+
+        ioqHead = block + count;
+        if (bdevWrite(block, count, buf) == -1) {
+            return -1;
+        }
+        ioqDrop(first, ioqSpan(first, (uint64_t)block + count));
+        return 0;
+    }
+
+    for (uint32_t n = 0; n < count; n++) {
+        const uint8_t *data = (const uint8_t *)buf + (size_t)n * BLOCK_SIZE;
+        uint32_t i = ioqFind(block + n);
+
+        ioqClock++;
+        if (i < ioqCount && ioqEntries[i].block == block + n) {
+            memcpy(ioqContent(&ioqEntries[i]), data, BLOCK_SIZE);
+            continue;
+        }
+
+        // the blocks that fail to be written back stay queued, and are
+        // reported by ioqSync(): this write only fails if it finds no room
+        if (ioqCount == IOQ_BLOCKS) {
+            ioqDispatch(IOQ_BATCH);
+            i = ioqFind(block + n);
+        }
+        if (ioqCount == IOQ_BLOCKS) {
+            if (bdevWrite(block + n, 1, data) == -1) {
+                ret = -1;
+            }
+            ioqHead = block + n + 1;
+            continue;
+        }
+        memmove(&ioqEntries[i + 1], &ioqEntries[i],
+                (ioqCount - i) * sizeof(struct ioqEntry));
+        ioqEntries[i].block = block + n;
+        ioqEntries[i].slot = ioqSlots[--ioqSlotCount];
+        ioqEntries[i].stamp = ioqClock;
+        ioqCount++;
+        memcpy(ioqContent(&ioqEntries[i]), data, BLOCK_SIZE);
+    }
+
+    return ret;
+}
+
+int ioqWriteBlock(uint32_t block, const void *buf) {
+    return ioqWrite(block, 1, buf);
+}
+
+const void *ioqMap(uint32_t block, uint32_t count) {
+    if (ioqFlush(block, count) == -1) {
+        return NULL;
+    }
+    return bdevMap(block, count);
+}
+
+// Write back the queued blocks holding the @count bytes at byte @offset
+static int ioqFlushBytes(uint64_t offset, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    return ioqFlush(offset / BLOCK_SIZE, (offset + count - 1) / BLOCK_SIZE -
+                                             offset / BLOCK_SIZE + 1);
+}
+
+ssize_t ioqCopyOut(uint64_t offset, size_t count, int fd) {
+    if (ioqFlushBytes(offset, count) == -1) {
+        return -1;
+    }
+    return bdevCopyOut(offset, count, fd);
+}
+
+ssize_t ioqCopyIn(int fd, uint64_t offset, size_t count) {
+    if (ioqFlushBytes(offset, count) == -1) {
+        return -1;
+    }
+    return bdevCopyIn(fd, offset, count);
+}
+
+int ioqSync(void) {
+    return ioqDispatch(ioqCount);
+}
@@ -0,0 +1,41 @@
+#ifndef _IOQ_H
+#define _IOQ_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Request queue between fs.c and bdev.c, with the same calls as the latter.
+ *
+ * Writes are not issued as they are made, but kept in the queue, where a
+ * later write of the same block replaces them and reads find them. When it
+ * is full, part of the queue is written back in block order, from where the
+ * last request left the disk head and sweeping upwards (an elevator), with
+ * adjacent blocks merged into range writes. A block queued for too long is
+ * written back first, so that blocks far from the head are not starved.
+ *
+ * Reads are still served at once, from the queue when it holds all their
+ * blocks. Views and copies reach the image directly, so the queued blocks
+ * they cover are written back before them.
+ *
+ * A block stays queued until it is written back: if that fails, ioqSync()
+ * and the writes back that need it keep failing, and it is retried by each
+ * of them.
+ */
+
+int ioqRead(uint32_t block, uint32_t count, void *buf);
+int ioqWrite(uint32_t block, uint32_t count, const void *buf);
+int ioqReadBlock(uint32_t block, void *buf);
+int ioqWriteBlock(uint32_t block, const void *buf);
+const void *ioqMap(uint32_t block, uint32_t count);
+ssize_t ioqCopyOut(uint64_t offset, size_t count, int fd);
+ssize_t ioqCopyIn(int fd, uint64_t offset, size_t count);
+
+// Write back every queued block
+int ioqSync(void);
+
+// Forget the queued blocks and release the queue, once it was synced or
+// when the image is given up
+void ioqClose(void);
+
+#endif /* _IOQ_H */
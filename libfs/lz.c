@@ -0,0 +1,180 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// the last bytes of a block are always literals
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lzHash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the extra bytes of a length of at least 15
+static uint8_t *putLength(uint8_t *op, const uint8_t *end, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        if (op == end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return NULL;
+    }
+    *op++ = length;
+
+    return op;
+}
+
+// Write a sequence: @literals bytes from @anchor, then a match of @match
+// bytes at @offset (none if @match is 0)
+static uint8_t *putSequence(uint8_t *op, const uint8_t *end,
+                            const uint8_t *anchor, size_t literals,
+                            size_t offset, size_t match) {
+    uint8_t *token = op++;
+    size_t code = match ? match - LZ_MIN_MATCH : 0;
+
+    if (token >= end) {
+        return NULL;
+    }
+    *token = (literals < 15 ? literals : 15) << 4 | (code < 15 ? code : 15);
+    if (literals >= 15 && (op = putLength(op, end, literals)) == NULL) {
+        return NULL;
+    }
+    if ((size_t)(end - op) < literals) {
+        return NULL;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (match == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (code >= 15 && (op = putLength(op, end, code)) == NULL) {
+        return NULL;
+    }
+
+    return op;
+}
+
+size_t lzCompress(const uint8_t *src, size_t count, uint8_t *dst,
+                  size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *end = dst + capacity;
+    uint8_t *op = dst;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (count > LZ_MATCH_LIMIT && ip < count - LZ_MATCH_LIMIT) {
+        uint32_t hash = lzHash(read32(src + ip));
+        size_t candidate = table[hash];
+
+        table[hash] = ip;
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET ||
+            read32(src + candidate) != read32(src + ip)) {
+            ip++;
+            continue;
+        }
+
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < count - LZ_LAST_LITERALS &&
+               src[candidate + match] == src[ip + match]) {
+            match++;
+        }
+
+        op = putSequence(op, end, src + anchor, ip - anchor, ip - candidate,
+                         match);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += match;
+        anchor = ip;
+    }
+
+    op = putSequence(op, end, src + anchor, count - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - dst;
+}
+
+// Read the extra bytes of a length of 15
+static int getLength(const uint8_t *src, size_t count, size_t *ip,
+                     size_t *length) {
+    uint8_t byte;
+
+    do {
+        if (*ip >= count) {
+            return -1;
+        }
+        byte = src[(*ip)++];
+        *length += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+long lzDecompress(const uint8_t *src, size_t count, uint8_t *dst,
+                  size_t capacity) {
+    size_t ip = 0, op = 0;
+
+    while (ip < count) {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4;
+        size_t match = token & 15;
+
+        if (literals == 15 && getLength(src, count, &ip, &literals) == -1) {
+            return -1;
+        }
+        if (literals > count - ip || literals > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+
+        // the last sequence has no match
+        if (ip == count) {
+            break;
+        }
+
+        if (count - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+        if (match == 15 && getLength(src, count, &ip, &match) == -1) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (match > capacity - op) {
+            return -1;
+        }
+        // byte by byte, as the match may overlap its own output
+        for (size_t i = 0; i < match; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op;
+}
@@ -0,0 +1,24 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fast LZ77 codec producing LZ4 blocks: a sequence of literals followed by
+ * a match (2-byte offset, length of at least 4) per token. Compression is
+ * greedy, with one hash table probe per position, and favors speed over
+ * ratio.
+ */
+
+// Compress the @count bytes of @src into @dst (@capacity bytes). Return the
+// compressed size, or 0 if it would not fit.
+size_t lzCompress(const uint8_t *src, size_t count, uint8_t *dst,
+                  size_t capacity);
+
+// Decompress the @count bytes of @src into @dst (@capacity bytes). Return
+// the decompressed size, or -1 if @src is corrupted or does not fit.
+long lzDecompress(const uint8_t *src, size_t count, uint8_t *dst,
+                  size_t capacity);
+
+#endif /* _LZ_H */
@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "sim.h"
+
+// Name of the environment variable describing the device from the start
+#define SIM_ENV "FS_SIM"
+
+#define NS_PER_S 1000000000.0
+
+// Device being simulated (see fs_sim.h), times in ns
+struct simDevice {
+    int hdd;
+    double latency;
+    double seek;
+    double track;
+    double rpm;
+    double bandwidth;
+    double errors;
+    uint64_t seed;
+    int sleep;
+};
+
+static struct simDevice simDevice;
+static int simActive;
+static int envChecked;
+
+static struct fs_sim_stats simStats;
+// block following the last request, where the head of a disk is left
+static uint64_t simHead;
+// time at which the device is done with the requests made so far
+static uint64_t simFree;
+// state of the failure generator
+static uint64_t simRandom;
+
+static uint64_t clockNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Uniform number in [0, 1) (xorshift64*)
+static double simDraw(void) {
+    simRandom ^= simRandom >> 12;
+    simRandom ^= simRandom << 25;
+    simRandom ^= simRandom >> 27;
+    return (simRandom * 2685821657736338717ULL >> 11) / 9007199254740992.0;
+}
+
+// Square root of @x, in [0, 1] (Newton's method, sparing a dependency on libm)
+static double simSqrt(double x) {
+    double root = 1;
+
+    if (x <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < 32; i++) {
+        root = (root + x / root) / 2;
+    }
+    return root;
+}
+
+// Parse time @text, in us unless suffixed, into @ns
+static int parseTime(const char *text, double *ns) {
+    static const struct {
+        const char *suffix;
+        double scale;
+    } units[] = {{"ns", 1}, {"us", 1e3}, {"", 1e3}, {"ms", 1e6}, {"s", 1e9}};
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        if (strcmp(end, units[i].suffix) == 0) {
+            *ns = value * units[i].scale;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Parse bandwidth @text, in bytes/s possibly suffixed with K, M or G
+static int parseBandwidth(const char *text, double *bandwidth) {
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value <= 0) {
+        return -1;
+    }
+    if (*end != '\0' && end[1] == '\0') {
+        switch (*end) {
+        case 'G':
+            value *= 1024;
+            // fall through
+        case 'M':
+            value *= 1024;
+            // fall through
+        case 'K':
+            value *= 1024;
+            end++;
+            break;
+        }
+    }
+    *bandwidth = value;
+
+    return *end == '\0' ? 0 : -1;
+}
+
+static int parseNumber(const char *text, double *value) {
+    char *end;
+
+    *value = strtod(text, &end);
+    return end == text || *end != '\0' || *value < 0 ? -1 : 0;
+}
+
+// Set @device as described by @spec
+static int parseSpec(const char *spec, struct simDevice *device) {
+    char *copy = strdup(spec);
+    char *save = NULL;
+    char *setting;
+    double value;
+    int ret = 0;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    setting = strtok_r(copy, ",", &save);
+    memset(device, 0, sizeof(*device));
+    device->seed = 1;
+    device->sleep = 1;
+    if (setting != NULL && strcmp(setting, "hdd") == 0) {
+        device->hdd = 1;
+        device->seek = 15e6;
+        device->track = 1e6;
+        device->rpm = 7200;
+        device->bandwidth = 150.0 * 1024 * 1024;
+    } else if (setting != NULL && strcmp(setting, "ssd") == 0) {
+        device->latency = 50e3;
+        device->bandwidth = 500.0 * 1024 * 1024;
+    } else {
+        free(copy);
+        return -1;
+    }
+
+    while (ret == 0 && (setting = strtok_r(NULL, ",", &save)) != NULL) {
+        char *text = strchr(setting, '=');
+
+        if (text == NULL) {
+            ret = -1;
+            break;
+        }
+        *text++ = '\0';
+
+        if (strcmp(setting, "latency") == 0) {
+            ret = parseTime(text, &device->latency);
+        } else if (strcmp(setting, "seek") == 0) {
+            ret = parseTime(text, &device->seek);
+        } else if (strcmp(setting, "track") == 0) {
+            ret = parseTime(text, &device->track);
+        } else if (strcmp(setting, "rpm") == 0) {
+            ret = parseNumber(text, &device->rpm);
+        } else if (strcmp(setting, "bw") == 0) {
+            ret = parseBandwidth(text, &device->bandwidth);
+        } else if (strcmp(setting, "errors") == 0) {
+            ret = parseNumber(text, &device->errors) == -1 ||
+                          device->errors > 1 ? -1 : 0;
+        } else if (strcmp(setting, "seed") == 0) {
+            ret = parseNumber(text, &value);
+            device->seed = value;
+        } else if (strcmp(setting, "sleep") == 0) {
+            ret = parseNumber(text, &value) == -1 || value > 1 ? -1 : 0;
+            device->sleep = value != 0;
+        } else {
+            ret = -1;
+        }
+    }
+    free(copy);
+
+    // a seek never takes less than a short one
+    if (device->seek < device->track) {
+        device->seek = device->track;
+    }
+
+    return ret;
+}
+
+int fs_sim_start(const char *spec) {
+    struct simDevice device;
+
+    // the environment variable no longer matters once a device was set up
+    envChecked = 1;
+
+    if (spec == NULL || parseSpec(spec, &device) == -1) {
+        return -1;
+    }
+
+    simDevice = device;
+    simActive = 1;
+    memset(&simStats, 0, sizeof(simStats));
+    simHead = 0;
+    simFree = 0;
+    // xorshift gets stuck at 0
+    simRandom = device.seed ? device.seed : 1;
+
+    return 0;
+}
+
+int fs_sim_stop(void) {
+    envChecked = 1;
+    if (!simActive) {
+        return -1;
+    }
+    simActive = 0;
+    return 0;
+}
+
+int fs_sim_stats(struct fs_sim_stats *stats) {
+    if (!simActive || stats == NULL) {
+        return -1;
+    }
+    *stats = simStats;
+    return 0;
+}
+
+// Time device @simDevice takes to serve @count blocks at @block, in ns
+static double simCost(uint32_t block, uint32_t count) {
+    double cost = simDevice.latency +
+                  (double)count * BLOCK_SIZE * NS_PER_S / simDevice.bandwidth;
+
+    if (block != simHead) {
+        simStats.seeks++;
+        if (simDevice.hdd) {
+            uint64_t distance = block > simHead ? block - simHead
+                                                : simHead - block;
+            int blocks = block_disk_count();
+            double span = blocks > 0 ? (double)distance / blocks : 1;
+
+            if (span > 1) {
+                span = 1;
+            }
+            cost += simDevice.track +
+                    (simDevice.seek - simDevice.track) * simSqrt(span);
+            if (simDevice.rpm > 0) {
+                cost += 30 * NS_PER_S / simDevice.rpm;
+            }
+        }
+    }
+    simHead = (uint64_t)block + count;
+
+    return cost;
+}
+
+int simRequest(int write, uint32_t block, uint32_t count) {
+    uint64_t start, cost;
+
+    if (!envChecked) {
+        const char *spec = getenv(SIM_ENV);
+
+        envChecked = 1;
+        if (spec != NULL && spec[0] != '\0' && fs_sim_start(spec) == -1) {
+            fprintf(stderr, "%s: invalid device '%s', ignored\n", SIM_ENV,
+                    spec);
+        }
+    }
+
+    if (!simActive) {
+        return 0;
+    }
+
+    if (write) {
+        simStats.writes++;
+        simStats.write_blocks += count;
+    } else {
+        simStats.reads++;
+        simStats.read_blocks += count;
+    }
+
+    // a failing request still keeps the device busy
+    cost = simCost(block, count);
+    simStats.busy_ns += cost;
+
+    if (simDevice.sleep) {
+        struct timespec until;
+
+        start = clockNs();
+        simFree = (simFree > start ? simFree : start) + cost;
+        until.tv_sec = simFree / 1000000000ULL;
+        until.tv_nsec = simFree % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+               EINTR) {
+        }
+    }
+
+    if (simDevice.errors > 0 && simDraw() < simDevice.errors) {
+        simStats.errors++;
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
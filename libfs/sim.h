@@ -0,0 +1,17 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdint.h>
+
+#include "fs_sim.h"
+
+/*
+ * Internal hook of bdev.c, called before every request it makes to the
+ * image. It is a cheap no-op when no device is simulated.
+ */
+
+// Serve a request for @count blocks at block @block on the simulated device,
+// waiting for it if needed: return -1 if the request must fail, 0 otherwise
+int simRequest(int write, uint32_t block, uint32_t count);
+
+#endif /* _SIM_H */
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+// Name of the environment variable enabling recording from the start
+#define TRACE_ENV "FS_TRACE"
+
+static FILE *traceFile;
+static uint64_t traceEpoch;
+static int envChecked;
+static int atexitRegistered;
+
+static uint64_t clockNs(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void traceAtExit(void) {
+    if (traceFile != NULL) {
+        fs_trace_stop();
+    }
+}
+
+int fs_trace_start(const char *filename) {
+    struct fs_trace_header header;
+
+    // the environment variable no longer matters once a trace was started
+    envChecked = 1;
+
+    if (traceFile != NULL || filename == NULL) {
+        return -1;
+    }
+
+    traceFile = fopen(filename, "wb");
+    if (traceFile == NULL) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FS_TRACE_MAGIC, sizeof(header.magic));
+    header.version = FS_TRACE_VERSION;
+    header.record_size = sizeof(struct fs_trace_record);
+    header.start_time = clockNs(CLOCK_REALTIME);
+    if (fwrite(&header, sizeof(header), 1, traceFile) != 1) {
+        fclose(traceFile);
+        traceFile = NULL;
+        return -1;
+    }
+
+    traceEpoch = clockNs(CLOCK_MONOTONIC);
+
+    // make sure buffered records reach the file even without fs_trace_stop()
+    if (!atexitRegistered) {
+        atexit(traceAtExit);
+        atexitRegistered = 1;
+    }
+
+    return 0;
+}
+
+int fs_trace_stop(void) {
+    int ret = 0;
+
+    if (traceFile == NULL) {
+        return -1;
+    }
+
+    if (ferror(traceFile)) {
+        ret = -1;
+    }
+    if (fclose(traceFile) != 0) {
+        ret = -1;
+    }
+    traceFile = NULL;
+
+    return ret;
+}
+
+uint64_t traceBegin(void) {
+    if (!envChecked) {
+        const char *filename = getenv(TRACE_ENV);
+
+        envChecked = 1;
+        if (filename != NULL && filename[0] != '\0') {
+            fs_trace_start(filename);
+        }
+    }
+
+    if (traceFile == NULL) {
+        return 0;
+    }
+
+    return clockNs(CLOCK_MONOTONIC);
+}
+
+static void traceRecord(enum fs_trace_op op, int fd, const char *name,
+                        uint64_t offset, uint64_t arg, int64_t result,
+                        uint64_t start) {
+    struct fs_trace_record record;
+
+    // the call started before recording did (or there is no recording)
+    if (traceFile == NULL || start == 0) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = start - traceEpoch;
+    record.duration = clockNs(CLOCK_MONOTONIC) - start;
+    record.arg = arg;
+    record.offset = offset;
+    record.result = result;
+    record.fd = fd;
+    record.op = op;
+    if (name != NULL) {
+        strncpy(record.name, name, FS_TRACE_NAME_LEN - 1);
+    }
+
+    fwrite(&record, sizeof(record), 1, traceFile);
+}
+
+void traceEnd(enum fs_trace_op op, int fd, const char *name, uint64_t arg,
+              int64_t result, uint64_t start) {
+    traceRecord(op, fd, name, 0, arg, result, start);
+}
+
+void traceEndAt(enum fs_trace_op op, int fd, uint64_t offset, uint64_t arg,
+                int64_t result, uint64_t start) {
+    traceRecord(op, fd, NULL, offset, arg, result, start);
+}
+
+void traceFlush(void) {
+    if (traceFile != NULL) {
+        fflush(traceFile);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#include "fs_trace.h"
+
+/*
+ * Internal hooks used by the public entry points of fs.c. Every call is
+ * bracketed as follows:
+ *
+ *     uint64_t start = traceBegin();
+ *     int ret = doSomething(...);
+ *     traceEnd(FS_TRACE_SOMETHING, fd, name, arg, ret, start);
+ *
+ * Both are cheap no-ops when no trace is being recorded.
+ */
+
+// Return the current trace time, or 0 when not recording
+uint64_t traceBegin(void);
+
+// Append a record for a call that started at @start
+void traceEnd(enum fs_trace_op op, int fd, const char *name, uint64_t arg,
+              int64_t result, uint64_t start);
+
+// Same as traceEnd(), for a call at an explicit file offset
+void traceEndAt(enum fs_trace_op op, int fd, uint64_t offset, uint64_t arg,
+                int64_t result, uint64_t start);
+
+// Push buffered records to the trace file
+void traceFlush(void);
+
+#endif /* _TRACE_H */